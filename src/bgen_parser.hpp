@@ -6,7 +6,11 @@
 #include "genfile/bgen/bgen.hpp"
 #include "typedefs.hpp"
 #include "mpi_utils.hpp"
+#include "sample_mask.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
 #include <cassert>
 #include <stdexcept>
@@ -20,16 +24,22 @@
 // bgen::read_genotype_data_block(), or the bgen wiki for a description of the API.
 // The purpose of this object is to store genotype probability values in the desired
 // data structure (which here is a vector of vectors of doubles).
+// Parsing is local to this rank (and safe to run on worker threads); summary
+// statistics across ranks need a call to compute_summary_stats() afterwards, or
+// set_summary_stats() with sums from local_summary_stats() reduced in bulk.
 struct DosageSetter {
 	typedef EigenDataVector Data;
 
-	DosageSetter(std::unordered_map<long, bool> invalid_sample_ids, long nInvalid) :
-		m_sample_is_invalid(invalid_sample_ids), m_nInvalid(nInvalid)
+	explicit DosageSetter(const SampleMask& sample_mask) :
+		m_sample_mask(sample_mask), m_nInvalid(sample_mask.n_excluded)
 	{
+		m_want_codes = false;
+		m_has_codes = false;
 	}
 
 	// Called once allowing us to set storage.
 	void initialise( std::size_t number_of_samples, std::size_t number_of_alleles ) {
+		m_has_codes = false;
 		m_dosage.resize(number_of_samples - m_nInvalid);
 		m_samples_skipped = 0;
 		m_missing_entries.clear();
@@ -51,11 +61,12 @@ struct DosageSetter {
 	// Called once per sample to determine whether we want data for this sample
 	bool set_sample( std::size_t i ) {
 		// Only want data from samples with complete data across pheno/covar/env
-		if (m_sample_is_invalid[i]) {
+		long row = m_sample_mask.row(i);
+		if (row < 0) {
 			m_samples_skipped++;
 			return false;
 		} else {
-			m_sample_i = i - m_samples_skipped;
+			m_sample_i = row;
 			return true;
 		}
 	}
@@ -98,14 +109,98 @@ struct DosageSetter {
 
 	// If present with this signature, called once after all data has been set.
 	void finalise() {
-		double Ngeno = m_dosage.rows();
-		double Nmissing = m_missing_entries.size();
+		assert(m_samples_skipped == m_nInvalid);
+	}
+
+	// Fast path for unphased, diploid, biallelic layout 2 blocks with 8 bits
+	// per probability. Dosages go straight to m_codes as 8-bit low-mem codes
+	// (see GenotypeMatrix::CompressDosage) with the summary sums taken in the
+	// same pass. Returns false, without touching any state, for other layouts
+	// and for malformed blocks with p(AA) + p(AB) > 1.
+	bool parse_biallelic_8bit(genfile::byte_t const* buffer,
+	                          genfile::byte_t const* const end,
+	                          genfile::bgen::Context const& context) {
+		if ((context.flags & genfile::bgen::e_Layout) != genfile::bgen::e_Layout2) return false;
+		if (end - buffer < 10) return false;
+		std::uint32_t N = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((std::uint32_t) buffer[3] << 24);
+		std::uint16_t K = buffer[4] | (buffer[5] << 8);
+		if (K != 2 || buffer[6] != 2 || buffer[7] != 2) return false;
+		if (end - buffer != 10 + 3 * (long) N) return false;
+		genfile::byte_t const* ploidy = buffer + 8;
+		if (ploidy[N] != 0 || ploidy[N + 1] != 8) return false;
+		genfile::byte_t const* probs = ploidy + N + 2;
+		for (std::uint32_t ii = 0; ii < N; ii++) {
+			if (!(ploidy[ii] & 0x80) && probs[2 * ii] + probs[2 * ii + 1] > 255) return false;
+		}
 
-		Ngeno = mpiUtils::mpiReduce_inplace(&Ngeno);
-		Nmissing = mpiUtils::mpiReduce_inplace(&Nmissing);
-		m_sum_eij = mpiUtils::mpiReduce_inplace(&m_sum_eij);
-		m_sum_eij2 = mpiUtils::mpiReduce_inplace(&m_sum_eij2);
-		m_sum_fij_minus_eij2 = mpiUtils::mpiReduce_inplace(&m_sum_fij_minus_eij2);
+		m_has_codes = true;
+		m_codes.resize(N - m_nInvalid);
+		m_samples_skipped = 0;
+		m_missing_entries.clear();
+		m_sum_eij = 0;
+		m_sum_eij2 = 0;
+		m_sum_fij_minus_eij2 = 0;
+
+		// With p(AA) = a / 255 and p(AB) = b / 255; dosage = tt / 255 and
+		// E[x^2] = ff / 255 for tt = 510 - 2a - b and ff = 1020 - 4a - 3b.
+		std::uint64_t sum_tt = 0;
+		double sum_tt2 = 0, sum_ff = 0;
+		for (std::uint32_t ii = 0; ii < N; ii++) {
+			long kk = m_sample_mask.row(ii);
+			if (kk < 0) {
+				m_samples_skipped++;
+				continue;
+			}
+			if (ploidy[ii] & 0x80) {
+				m_missing_entries.insert(kk);
+				m_codes[kk] = 0;
+				continue;
+			}
+			std::uint32_t aa = probs[2 * ii], bb = probs[2 * ii + 1];
+			std::uint32_t tt = 510 - 2 * aa - bb;
+			m_codes[kk] = (std::uint8_t) std::min(255u, tt * 128 / 255);
+			sum_tt += tt;
+			sum_tt2 += (double) (tt * tt);
+			sum_ff += 1020.0 - 4.0 * aa - 3.0 * bb;
+		}
+		m_sum_eij = sum_tt / 255.0;
+		m_sum_eij2 = sum_tt2 / 255.0 / 255.0;
+		m_sum_fij_minus_eij2 = sum_ff / 255.0 - m_sum_eij2;
+		assert(m_samples_skipped == m_nInvalid);
+		return true;
+	}
+
+	// Number of sums written by local_summary_stats()
+	static const long n_summary_stats = 5;
+
+	// Sums over samples on this rank, for use with set_summary_stats() once
+	// reduced across ranks.
+	void local_summary_stats(double* stats) const {
+		stats[0] = m_has_codes ? m_codes.size() : m_dosage.rows();
+		stats[1] = m_missing_entries.size();
+		stats[2] = m_sum_eij;
+		stats[3] = m_sum_eij2;
+		stats[4] = m_sum_fij_minus_eij2;
+	}
+
+	// Reduce sums across ranks; must be called in the same variant order on
+	// every rank.
+	void compute_summary_stats() {
+		double stats[n_summary_stats], global[n_summary_stats];
+		local_summary_stats(stats);
+		mpiUtils::mpiReduce_double(stats, global, n_summary_stats);
+		set_summary_stats(global);
+	}
+
+	// MAF, info etc from sums reduced across ranks. Also fills in missing
+	// entries with the mean.
+	void set_summary_stats(const double* stats) {
+		std::copy(stats, stats + n_summary_stats, m_summary_stats);
+		double Ngeno = stats[0];
+		double Nmissing = stats[1];
+		m_sum_eij = stats[2];
+		m_sum_eij2 = stats[3];
+		m_sum_fij_minus_eij2 = stats[4];
 
 		double Nvalid = Ngeno - Nmissing;
 		m_missingness = Nmissing / Ngeno;
@@ -121,13 +216,72 @@ struct DosageSetter {
 		m_sigma2 /= (Nvalid - 1);
 
 		// Fill in missing values with mean
-		for (const auto& ii : m_missing_entries) {
-			m_dosage(ii) = m_mean;
+		if (m_has_codes) {
+			std::uint8_t mean_code = (std::uint8_t) std::floor(std::min(m_mean, 2.0 - 1e-6) * 128.0);
+			for (const auto& ii : m_missing_entries) {
+				m_codes[ii] = mean_code;
+			}
+		} else {
+			for (const auto& ii : m_missing_entries) {
+				m_dosage(ii) = m_mean;
+			}
 		}
-		assert(m_samples_skipped == m_nInvalid);
+	}
+
+	// Sums last passed to set_summary_stats(), ie. reduced across ranks
+	const double* summary_stats() const {
+		return m_summary_stats;
+	}
+
+	// Variant whose probability block was skipped (see BgenQcSidecar); all
+	// dosages are zero and the sums are set later from the sidecar.
+	void set_skipped(std::size_t number_of_samples) {
+		m_has_codes = false;
+		m_dosage.setZero(number_of_samples - m_nInvalid);
+		m_missing_entries.clear();
+		m_sum_eij = 0;
+		m_sum_eij2 = 0;
+		m_sum_fij_minus_eij2 = 0;
+	}
+
+	// Rows start to start + n of the last variant, as 8-bit low-mem codes or
+	// dosages; used by the rank decoding for everyone under --bgen-scatter.
+	void copy_rows(long start, long n, std::uint8_t* out) const {
+		for (long ii = 0; ii < n; ii++) {
+			out[ii] = m_has_codes ? m_codes[start + ii] :
+			          (std::uint8_t) std::floor(std::min((double) m_dosage(start + ii), 2.0 - 1e-6) * 128.0);
+		}
+	}
+
+	void copy_rows(long start, long n, double* out) const {
+		for (long ii = 0; ii < n; ii++) {
+			out[ii] = m_has_codes ? (m_codes[start + ii] + 0.5) / 128.0 : m_dosage(start + ii);
+		}
+	}
+
+	// This rank's rows of a variant decoded on another rank, with missing
+	// entries already filled in. Follow with set_summary_stats().
+	void set_scattered(const std::uint8_t* codes, long n) {
+		m_has_codes = true;
+		m_codes.assign(codes, codes + n);
+		m_missing_entries.clear();
+	}
+
+	void set_scattered(const double* dosage, long n) {
+		m_has_codes = false;
+		m_dosage.resize(n);
+		for (long ii = 0; ii < n; ii++) {
+			m_dosage(ii) = dosage[ii];
+		}
+		m_missing_entries.clear();
 	}
 
 	Data m_dosage;
+	// Set m_want_codes to allow parse_biallelic_8bit; m_has_codes is true if
+	// the last variant went through it and its dosages are in m_codes.
+	std::vector<std::uint8_t> m_codes;
+	bool m_want_codes;
+	bool m_has_codes;
 	double m_missingness;
 	double m_maf;
 	double m_info;
@@ -136,12 +290,13 @@ struct DosageSetter {
 	double m_sum_eij;
 
 private:
-	std::unordered_map<long, bool> m_sample_is_invalid;
+	const SampleMask& m_sample_mask;
 	std::size_t m_samples_skipped;
 	std::size_t m_sample_i;
 	long m_nInvalid;
 
 	std::unordered_set<long> m_missing_entries;
+	double m_summary_stats[n_summary_stats];
 	double m_sum_eij2;
 	double m_sum_fij_minus_eij2;
 	double m_eij;
@@ -0,0 +1,514 @@
+#include "bgen_stream.hpp"
+#include "mpi_utils.hpp"
+
+#include "tools/eigen3.3/Dense"
+
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include <fstream>
+#include <stdexcept>
+
+bool fails_maf_info_filters(const DosageSetter& setter, const parameters& p){
+	double maf_j = setter.m_maf;
+	if (p.maf_lim && (maf_j < p.min_maf || maf_j > 1 - p.min_maf)) {
+		return true;
+	}
+	if (p.info_lim && setter.m_info < p.min_info) {
+		return true;
+	}
+	return false;
+}
+
+bool is_constant_variant(const DosageSetter& setter, const parameters& p){
+	if (p.keep_constant_variants) return false;
+	return setter.m_sum_eij < 5.0 || std::sqrt(setter.m_sigma2) <= 1e-12;
+}
+
+namespace {
+const char bgenQcMagic[8] = {'L', 'E', 'M', 'M', 'A', 'Q', 'C', '1'};
+}
+
+BgenQcSidecar::BgenQcSidecar(const std::string& filename,
+                             const std::uint64_t& key,
+                             const long& n_var) :
+	filename(filename), key(key), n_var(n_var), n_recorded(0), loaded(false) {
+	sums.resize(DosageSetter::n_summary_stats, n_var);
+	recorded.assign(n_var, false);
+}
+
+bool BgenQcSidecar::load(const parameters& p){
+	// Wait for any sidecar rank 0 is still writing
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	std::ifstream in(filename, std::ios::binary);
+	char magic[sizeof(bgenQcMagic)];
+	std::uint64_t file_key = 0;
+	long file_n_var = -1, n_stats = -1;
+	in.read(magic, sizeof(magic));
+	in.read(reinterpret_cast<char*>(&file_key), sizeof(file_key));
+	in.read(reinterpret_cast<char*>(&file_n_var), sizeof(file_n_var));
+	in.read(reinterpret_cast<char*>(&n_stats), sizeof(n_stats));
+	bool ok = in && std::equal(magic, magic + sizeof(magic), bgenQcMagic) && file_key == key &&
+	          file_n_var == n_var && n_stats == sums.rows();
+	if (ok) {
+		in.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(double));
+		ok = (bool) in;
+	}
+
+	// Every rank must skip the same variants
+	loaded = mpiUtils::mpiReduce_inplace((double) ok) == mpiUtils::mpiReduce_inplace(1.0);
+	if (loaded) {
+		SampleMask no_samples;
+		DosageSetter setter(no_samples);
+		fails.resize(n_var);
+		for (long jj = 0; jj < n_var; jj++) {
+			setter.set_summary_stats(sums.col(jj).data());
+			fails[jj] = fails_maf_info_filters(setter, p) || is_constant_variant(setter, p);
+		}
+	}
+	return loaded;
+}
+
+void BgenQcSidecar::record(long jj, const DosageSetter& setter){
+	if (loaded || jj >= n_var || recorded[jj]) return;
+	std::copy(setter.summary_stats(), setter.summary_stats() + sums.rows(), sums.col(jj).data());
+	recorded[jj] = true;
+	n_recorded++;
+	if (n_recorded == n_var) {
+		save();
+	}
+}
+
+void BgenQcSidecar::save() const {
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	if (world_rank != 0) return;
+
+	std::ofstream out(filename, std::ios::binary);
+	long n_stats = sums.rows();
+	out.write(bgenQcMagic, sizeof(bgenQcMagic));
+	out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+	out.write(reinterpret_cast<const char*>(&n_var), sizeof(n_var));
+	out.write(reinterpret_cast<const char*>(&n_stats), sizeof(n_stats));
+	out.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(double));
+	if (!out) {
+		throw std::runtime_error("Error writing bgen QC cache to " + filename);
+	}
+	std::cout << " - Wrote QC statistics of " << n_var << " variants to " << filename << std::endl;
+}
+
+long read_raw_bgen_batch(genfile::bgen::View::UniquePtr &bgenView,
+                         std::vector<RawBgenVariant>& batch,
+                         const long& max_variants,
+                         bool &bgen_pass,
+                         const BgenQcSidecar* qc,
+                         const long& first_index){
+	long nn = 0;
+	while (nn < max_variants && bgen_pass) {
+		RawBgenVariant& var = batch[nn];
+		bgen_pass = bgenView->read_variant(&var.SNPID, &var.rsid, &var.chr, &var.pos, &var.alleles);
+		if (!bgen_pass) break;
+		long jj = first_index + nn;
+		var.skipped = qc != nullptr && qc->skip(jj);
+		if (var.skipped) {
+			bgenView->ignore_genotype_data_block();
+			var.block.clear();
+			var.qc_sums = qc->cached_sums(jj);
+		} else {
+			bgenView->read_genotype_data_block(&var.block);
+		}
+		nn++;
+	}
+	return nn;
+}
+
+long skip_raw_bgen_variants(genfile::bgen::View::UniquePtr &bgenView,
+                            const long& n_variants,
+                            bool &bgen_pass){
+	// Only variant headers are read
+	RawBgenVariant var;
+	long nn = 0;
+	while (nn < n_variants && bgen_pass) {
+		bgen_pass = bgenView->read_variant(&var.SNPID, &var.rsid, &var.chr, &var.pos, &var.alleles);
+		if (!bgen_pass) break;
+		bgenView->ignore_genotype_data_block();
+		nn++;
+	}
+	return nn;
+}
+
+namespace {
+void decode_raw_bgen_variant(const genfile::bgen::Context& context,
+                             const RawBgenVariant& var,
+                             std::vector<genfile::byte_t>& buffer,
+                             DosageSetter& setter){
+	// Uncompress and parse one probability block (as bgen::View does)
+	genfile::byte_t const* begin = &var.block[0];
+	genfile::byte_t const* end = begin + var.block.size();
+	if ((context.flags & genfile::bgen::e_CompressedSNPBlocks) != genfile::bgen::e_NoCompression) {
+		genfile::bgen::uncompress_probability_data(context, var.block, &buffer);
+		begin = &buffer[0];
+		end = begin + buffer.size();
+	}
+	if (!setter.m_want_codes || !setter.parse_biallelic_8bit(begin, end, context)) {
+		genfile::bgen::parse_probability_data(begin, end, context, setter);
+	}
+}
+}
+
+void decode_raw_bgen_batch(const genfile::bgen::Context& context,
+                           const std::vector<RawBgenVariant>& batch,
+                           const long& n_batch,
+                           std::vector<DosageSetter>& setters,
+                           std::vector<std::vector<genfile::byte_t> >& buffers){
+	long n_thread = buffers.size();
+	std::vector<std::thread> t_pool;
+	for (long tt = 0; tt < n_thread; tt++) {
+		t_pool.push_back(std::thread([&context, &batch, &buffers, &setters, tt, n_thread, n_batch] {
+			for (long kk = tt; kk < n_batch; kk += n_thread) {
+				if (batch[kk].skipped) {
+					setters[kk].set_skipped(context.number_of_samples);
+				} else {
+					decode_raw_bgen_variant(context, batch[kk], buffers[tt], setters[kk]);
+				}
+			}
+		}));
+	}
+	for (auto& tt : t_pool) {
+		tt.join();
+	}
+}
+
+void reduce_summary_stats(const std::vector<RawBgenVariant>& batch,
+                          std::vector<DosageSetter>& setters,
+                          const long& n_batch,
+                          MPI_Comm comm){
+	long n_stats = DosageSetter::n_summary_stats;
+	Eigen::MatrixXd stats(n_stats, n_batch);
+	for (long kk = 0; kk < n_batch; kk++) {
+		setters[kk].local_summary_stats(stats.col(kk).data());
+	}
+	stats = mpiUtils::mpiReduce_inplace(stats, comm);
+	for (long kk = 0; kk < n_batch; kk++) {
+		if (batch[kk].skipped) {
+			stats.col(kk) = Eigen::Map<const Eigen::VectorXd>(batch[kk].qc_sums, n_stats);
+		}
+	}
+	for (long kk = 0; kk < n_batch; kk++) {
+		setters[kk].set_summary_stats(stats.col(kk).data());
+	}
+}
+
+void broadcast_bgen_batch_size(long& n_batch, bool& bgen_pass){
+	long sizes[2] = {n_batch, bgen_pass ? 1L : 0L};
+	MPI_Bcast(sizes, 2, MPI_LONG, 0, MPI_COMM_WORLD);
+	n_batch = sizes[0];
+	bgen_pass = sizes[1] == 1;
+}
+
+namespace {
+// Variant ids as '\0' terminated fields; SNPID, rsid, chr, pos, number of
+// alleles then the alleles.
+void pack_variant_ids(const std::vector<RawBgenVariant>& batch,
+                      const long& n_batch,
+                      std::string& ids){
+	ids.clear();
+	for (long kk = 0; kk < n_batch; kk++) {
+		const RawBgenVariant& var = batch[kk];
+		std::vector<std::string> fields = {var.SNPID, var.rsid, var.chr,
+			                               std::to_string(var.pos),
+			                               std::to_string(var.alleles.size())};
+		fields.insert(fields.end(), var.alleles.begin(), var.alleles.end());
+		for (const auto& field : fields) {
+			ids += field;
+			ids += '\0';
+		}
+	}
+}
+
+void unpack_variant_ids(const std::string& ids,
+                        std::vector<RawBgenVariant>& batch,
+                        const long& n_batch){
+	std::size_t pos = 0;
+	auto next_field = [&ids, &pos]() {
+		std::string field(ids.c_str() + pos);
+		pos += field.size() + 1;
+		return field;
+	};
+	for (long kk = 0; kk < n_batch; kk++) {
+		RawBgenVariant& var = batch[kk];
+		var.SNPID = next_field();
+		var.rsid = next_field();
+		var.chr = next_field();
+		var.pos = (std::uint32_t) std::stoul(next_field());
+		var.alleles.resize(std::stoul(next_field()));
+		for (auto& allele : var.alleles) {
+			allele = next_field();
+		}
+		var.block.clear();
+	}
+}
+
+template <typename T>
+void scatter_samples(const SampleMask& sample_mask,
+                     const long& n_batch,
+                     MPI_Datatype type,
+                     const std::vector<DosageSetter>& all_setters,
+                     std::vector<DosageSetter>& setters){
+	// Send buffer is ordered by rank, then variant, then sample
+	int world_rank, world_size;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+	std::vector<int> counts(world_size), displs(world_size);
+	for (int rr = 0; rr < world_size; rr++) {
+		long count = sample_mask.scatter_counts[rr] * n_batch;
+		long displ = sample_mask.scatter_displs[rr] * n_batch;
+		if (displ + count > INT_MAX) {
+			throw std::runtime_error("Error: too many samples per batch for --bgen-scatter; try fewer threads.");
+		}
+		counts[rr] = (int) count;
+		displs[rr] = (int) displ;
+	}
+
+	long n_local = sample_mask.scatter_counts[world_rank];
+	std::vector<T> send, recv(n_local * n_batch);
+	if (world_rank == 0) {
+		send.resize(displs[world_size - 1] + counts[world_size - 1]);
+		for (int rr = 0; rr < world_size; rr++) {
+			long n_rank = sample_mask.scatter_counts[rr];
+			for (long kk = 0; kk < n_batch; kk++) {
+				all_setters[kk].copy_rows(sample_mask.scatter_displs[rr], n_rank,
+				                          send.data() + displs[rr] + kk * n_rank);
+			}
+		}
+	}
+	MPI_Scatterv(send.data(), counts.data(), displs.data(), type,
+	             recv.data(), (int) recv.size(), type, 0, MPI_COMM_WORLD);
+	for (long kk = 0; kk < n_batch; kk++) {
+		setters[kk].set_scattered(recv.data() + kk * n_local, n_local);
+	}
+}
+}
+
+void scatter_bgen_batch(const SampleMask& sample_mask,
+                        std::vector<RawBgenVariant>& batch,
+                        const long& n_batch,
+                        std::vector<DosageSetter>& all_setters,
+                        std::vector<DosageSetter>& setters){
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+	// Rank 0 holds every sample so its sums are already global. Missing
+	// entries are filled with the mean before scattering.
+	long n_stats = DosageSetter::n_summary_stats;
+	Eigen::MatrixXd stats(n_stats, n_batch);
+	std::string ids;
+	if (world_rank == 0) {
+		for (long kk = 0; kk < n_batch; kk++) {
+			if (batch[kk].skipped) {
+				stats.col(kk) = Eigen::Map<const Eigen::VectorXd>(batch[kk].qc_sums, n_stats);
+			} else {
+				all_setters[kk].local_summary_stats(stats.col(kk).data());
+			}
+			all_setters[kk].set_summary_stats(stats.col(kk).data());
+		}
+		pack_variant_ids(batch, n_batch, ids);
+	}
+	MPI_Bcast(stats.data(), (int) stats.size(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	long n_chars = ids.size();
+	MPI_Bcast(&n_chars, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+	ids.resize(n_chars);
+	MPI_Bcast(&ids[0], (int) n_chars, MPI_CHAR, 0, MPI_COMM_WORLD);
+	if (world_rank != 0) {
+		unpack_variant_ids(ids, batch, n_batch);
+	}
+
+	if (setters[0].m_want_codes) {
+		scatter_samples<std::uint8_t>(sample_mask, n_batch, MPI_UNSIGNED_CHAR, all_setters, setters);
+	} else {
+		scatter_samples<double>(sample_mask, n_batch, MPI_DOUBLE, all_setters, setters);
+	}
+	for (long kk = 0; kk < n_batch; kk++) {
+		setters[kk].set_summary_stats(stats.col(kk).data());
+	}
+}
+
+BgenStreamReader::BgenStreamReader(genfile::bgen::View::UniquePtr& view,
+                                   const SampleMask& sample_mask,
+                                   const parameters& p,
+                                   const bool& want_codes,
+                                   const long& chunk_size,
+                                   const long& depth,
+                                   const long& first_variant,
+                                   const long& n_variants,
+                                   MPI_Comm comm,
+                                   BgenQcSidecar* qc) :
+	bgenView(view), sample_mask(sample_mask), n_thread(std::max(1u, p.n_thread)),
+	batch_size(bgenBatchPerThread * n_thread), first_variant(first_variant), n_variants(n_variants),
+	comm(comm), qc(qc), next_index(first_variant), fill_index(0), read_index(0), read_pos(-1), stop(false) {
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	is_reader = !sample_mask.scatter() || world_rank == 0;
+
+	// One batch in use by the consumer plus enough to cover depth chunks.
+	// Ranks receiving scattered batches only need the one in use.
+	long n_ahead = is_reader ? std::max(1L, (depth * chunk_size + batch_size - 1) / batch_size) : 0;
+	ring.resize(n_ahead + 1);
+	for (auto& batch : ring) {
+		batch.vars.resize(batch_size);
+		batch.setters.reserve(batch_size);
+		for (long kk = 0; kk < batch_size; kk++) {
+			batch.setters.emplace_back(sample_mask);
+			batch.setters.back().m_want_codes = want_codes;
+			if (is_reader && sample_mask.scatter()) {
+				batch.all_setters.emplace_back(*sample_mask.all_ranks);
+				batch.all_setters.back().m_want_codes = want_codes;
+			}
+		}
+		batch.n_var = 0;
+		batch.ready = false;
+	}
+	if (is_reader) {
+		background = std::thread(&BgenStreamReader::read_ahead, this);
+	}
+}
+
+BgenStreamReader::~BgenStreamReader() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	if (background.joinable()) {
+		background.join();
+	}
+}
+
+void BgenStreamReader::read_ahead() {
+	// Fill free batches in ring order; a batch with no variants marks EOF.
+	const genfile::bgen::Context& context = bgenView->context();
+	std::vector<std::vector<genfile::byte_t> > buffers(n_thread);
+	bool bgen_pass = true;
+	// Variants left to read in the range; negative reads to EOF
+	long n_left = n_variants;
+	long index = first_variant;
+	while (true) {
+		Batch& batch = ring[fill_index];
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this, &batch] {
+				return stop || !batch.ready;
+			});
+			if (stop) return;
+		}
+
+		long n_var = 0;
+		try {
+			long max_var = n_left < 0 ? batch_size : std::min(batch_size, n_left);
+			n_var = read_raw_bgen_batch(bgenView, batch.vars, max_var, bgen_pass, qc, index);
+			index += n_var;
+			if (n_left > 0) n_left -= n_var;
+			decode_raw_bgen_batch(context, batch.vars, n_var,
+			                      sample_mask.scatter() ? batch.all_setters : batch.setters, buffers);
+		} catch (...) {
+			error = std::current_exception();
+			n_var = 0;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			batch.n_var = n_var;
+			batch.ready = true;
+		}
+		cv.notify_all();
+		if (n_var == 0) return;
+		fill_index = (fill_index + 1) % ring.size();
+	}
+}
+
+bool BgenStreamReader::next(const RawBgenVariant*& var, const DosageSetter*& setter) {
+	if (read_pos >= 0 && read_pos == ring[read_index].n_var) {
+		if (ring[read_index].n_var == 0) return false;
+
+		// Done with this batch; hand it back to the background thread
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			ring[read_index].ready = false;
+		}
+		cv.notify_all();
+		read_index = (read_index + 1) % ring.size();
+		read_pos = -1;
+	}
+
+	Batch& batch = ring[read_index];
+	if (read_pos < 0) {
+		if (is_reader) {
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [&batch] {
+				return batch.ready;
+			});
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		// MPI stays on this thread; one allreduce or scatter per batch
+		if (sample_mask.scatter()) {
+			bool bgen_pass = batch.n_var > 0;
+			broadcast_bgen_batch_size(batch.n_var, bgen_pass);
+			if (batch.n_var > 0) {
+				scatter_bgen_batch(sample_mask, batch.vars, batch.n_var, batch.all_setters, batch.setters);
+			}
+		} else {
+			reduce_summary_stats(batch.vars, batch.setters, batch.n_var, comm);
+		}
+		read_pos = 0;
+		if (batch.n_var == 0) return false;
+	}
+
+	var = &batch.vars[read_pos];
+	setter = &batch.setters[read_pos];
+	if (qc) {
+		qc->record(next_index, *setter);
+	}
+	next_index++;
+	read_pos++;
+	return true;
+}
+
+void stream_bgen_files(const long& n_files,
+                       const long& max_open,
+                       const std::function<bool(long)>& open,
+                       const std::function<bool(long)>& read,
+                       const std::function<void(const std::vector<long>&)>& process,
+                       const std::function<void(long)>& close){
+	std::vector<long> active, with_chunk, finished;
+	long n_opened = 0;
+	while (n_opened < n_files || !active.empty()) {
+		while (n_opened < n_files && (long) active.size() < max_open) {
+			long ii = n_opened++;
+			if (open(ii)) {
+				active.push_back(ii);
+			} else {
+				close(ii);
+			}
+		}
+
+		with_chunk.clear();
+		finished.clear();
+		for (long ii : active) {
+			if (read(ii)) {
+				with_chunk.push_back(ii);
+			} else {
+				finished.push_back(ii);
+			}
+		}
+		if (!with_chunk.empty()) {
+			process(with_chunk);
+		}
+		for (long ii : finished) {
+			close(ii);
+		}
+		active = with_chunk;
+	}
+}
@@ -0,0 +1,225 @@
+#ifndef LEMMA_BGEN_STREAM_HPP
+#define LEMMA_BGEN_STREAM_HPP
+
+#include "parameters.hpp"
+#include "sample_mask.hpp"
+#include "bgen_parser.hpp"
+
+#include "genfile/bgen/bgen.hpp"
+#include "genfile/bgen/View.hpp"
+#include "tools/eigen3.3/Dense"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Variants decoded per thread in each batch
+const long bgenBatchPerThread = 16;
+
+// Variant identifiers plus its still compressed probability block
+struct RawBgenVariant {
+	std::string SNPID, rsid, chr;
+	std::uint32_t pos;
+	std::vector<std::string> alleles;
+	std::vector<genfile::byte_t> block;
+	// Block not read as the variant fails QC per the sidecar, which holds
+	// its summary sums
+	bool skipped;
+	const double* qc_sums;
+
+	RawBgenVariant() : pos(0), skipped(false), qc_sums(nullptr) {
+	}
+};
+
+// Filters on summary statistics reduced across ranks; --maf / --info, then
+// (unless --keep-constant-variants) variants with (near) constant dosage.
+bool fails_maf_info_filters(const DosageSetter& setter, const parameters& p);
+bool is_constant_variant(const DosageSetter& setter, const parameters& p);
+
+// Summary sums (see DosageSetter::local_summary_stats) of every variant of a
+// bgen query, reduced over the valid samples of all ranks. Cached on disk with
+// --bgen-qc-cache, so that later runs with the same file, query and samples
+// skip the probability blocks of variants failing the filters above without
+// uncompressing them. Filter thresholds may differ between runs.
+class BgenQcSidecar {
+	const std::string filename;
+	const std::uint64_t key;
+	const long n_var;
+	Eigen::MatrixXd sums;
+	std::vector<bool> fails, recorded;
+	long n_recorded;
+	bool loaded;
+
+	void save() const;
+
+public:
+	BgenQcSidecar(const std::string& filename,
+	              const std::uint64_t& key,
+	              const long& n_var);
+
+	// Collective; uses the file only if it matches on every rank.
+	bool load(const parameters& p);
+
+	bool skip(long jj) const {
+		return loaded && fails[jj];
+	}
+
+	const double* cached_sums(long jj) const {
+		return sums.col(jj).data();
+	}
+
+	// Sums of variant jj once reduced; the file is written by rank 0 once
+	// every variant has been recorded.
+	void record(long jj, const DosageSetter& setter);
+};
+
+// Read up to max_variants raw variants in file order. With a loaded sidecar
+// the blocks of failing variants are skipped; first_index is the index of the
+// next variant in the query.
+long read_raw_bgen_batch(genfile::bgen::View::UniquePtr &bgenView,
+                         std::vector<RawBgenVariant>& batch,
+                         const long& max_variants,
+                         bool &bgen_pass,
+                         const BgenQcSidecar* qc = nullptr,
+                         const long& first_index = 0);
+
+// Uncompress and parse the first n_batch variants of batch; variant kk is
+// decoded by thread kk % n_thread. No MPI calls.
+void decode_raw_bgen_batch(const genfile::bgen::Context& context,
+                           const std::vector<RawBgenVariant>& batch,
+                           const long& n_batch,
+                           std::vector<DosageSetter>& setters,
+                           std::vector<std::vector<genfile::byte_t> >& buffers);
+
+// Skip up to n_variants variants without reading their probability blocks;
+// returns the number skipped. Each variant header is still read, see
+// fileUtils::seek_bgen_variant to skip many variants.
+long skip_raw_bgen_variants(genfile::bgen::View::UniquePtr &bgenView,
+                            const long& n_variants,
+                            bool &bgen_pass);
+
+// Summary statistics of the first n_batch setters with a single allreduce;
+// from the sidecar for skipped variants.
+void reduce_summary_stats(const std::vector<RawBgenVariant>& batch,
+                          std::vector<DosageSetter>& setters,
+                          const long& n_batch,
+                          MPI_Comm comm = MPI_COMM_WORLD);
+
+// With --bgen-scatter only rank 0 reads the bgen file; other ranks take the
+// batch size and EOF flag from rank 0.
+void broadcast_bgen_batch_size(long& n_batch, bool& bgen_pass);
+
+// Rank 0 has decoded the first n_batch variants of batch into all_setters
+// (over sample_mask.all_ranks). Broadcasts variant ids and summary statistics,
+// and sends each rank its samples of every variant with one MPI_Scatterv into
+// setters. Collective; the batch is sent as low-mem codes if setters want them.
+void scatter_bgen_batch(const SampleMask& sample_mask,
+                        std::vector<RawBgenVariant>& batch,
+                        const long& n_batch,
+                        std::vector<DosageSetter>& all_setters,
+                        std::vector<DosageSetter>& setters);
+
+// Streams decoded variants from a bgen view. A background thread reads and
+// decodes batches of variants ahead of the consumer into a ring of reusable
+// buffers, so that file IO and decompression overlap with whatever the caller
+// does between calls to next(). The view must not be used elsewhere while the
+// reader is alive; it may read up to the read-ahead depth past the last
+// variant returned.
+// With --bgen-scatter the background thread only runs on rank 0, which
+// decodes for all ranks; next() then scatters each batch while the following
+// batches are decoded.
+class BgenStreamReader {
+	struct Batch {
+		std::vector<RawBgenVariant> vars;
+		std::vector<DosageSetter> setters;
+		// Decoded over sample_mask.all_ranks with --bgen-scatter, on rank 0
+		std::vector<DosageSetter> all_setters;
+		long n_var;
+		bool ready;
+	};
+
+	genfile::bgen::View::UniquePtr& bgenView;
+	const SampleMask& sample_mask;
+	const long n_thread;
+	const long batch_size;
+	// Variants [first_variant, first_variant + n_variants) of the query are
+	// read; all to EOF if n_variants < 0. The view must already be at
+	// first_variant, see fileUtils::seek_bgen_variant.
+	const long first_variant, n_variants;
+	const MPI_Comm comm;
+	BgenQcSidecar* qc;
+	// Query index of the next variant returned by next()
+	long next_index;
+	// Whether this rank reads the bgen file
+	bool is_reader;
+
+	std::vector<Batch> ring;
+	// Next batch to be filled by the background thread / read by next()
+	long fill_index, read_index;
+	// Position of the next variant within ring[read_index]; -1 until the
+	// batch has been taken from the background thread.
+	long read_pos;
+	bool stop;
+	// Rethrown by next() if reading or decoding failed
+	std::exception_ptr error;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::thread background;
+
+	void read_ahead();
+
+public:
+	// depth is the number of chunks of chunk_size variants to keep decoded
+	// ahead of the consumer. Summary statistics are reduced over comm;
+	// MPI_COMM_SELF if sample_mask keeps every sample on this rank.
+	BgenStreamReader(genfile::bgen::View::UniquePtr& view,
+	                 const SampleMask& sample_mask,
+	                 const parameters& p,
+	                 const bool& want_codes,
+	                 const long& chunk_size,
+	                 const long& depth,
+	                 const long& first_variant = 0,
+	                 const long& n_variants = -1,
+	                 MPI_Comm comm = MPI_COMM_WORLD,
+	                 BgenQcSidecar* qc = nullptr);
+
+	~BgenStreamReader();
+
+	BgenStreamReader(const BgenStreamReader&) = delete;
+	BgenStreamReader& operator=(const BgenStreamReader&) = delete;
+
+	// Next variant in file order, with summary statistics reduced across
+	// ranks. Returns false at EOF. Pointers are valid until the next call.
+	bool next(const RawBgenVariant*& var, const DosageSetter*& setter);
+};
+
+// Per file state of stream_bgen_files(); callers extend it with their own
+struct StreamedBgenFile {
+	std::unique_ptr<BgenStreamReader> reader;
+	// Query index of the next variant
+	long n_var_parsed = 0;
+	bool done = false;
+};
+
+// Streams up to max_open of n_files bgen files at once, opened in file order.
+// Each round reads the next chunk of every open file on this thread, so that
+// MPI calls come in the same order on every rank, then hands the files that
+// read a chunk to process(), which may work on them in parallel. open(ii)
+// returns false if file ii has nothing to stream; read(ii) returns false at
+// its end. close(ii) is called once file ii is done, after any process() of
+// its last chunk.
+void stream_bgen_files(const long& n_files,
+                       const long& max_open,
+                       const std::function<bool(long)>& open,
+                       const std::function<bool(long)>& read,
+                       const std::function<void(const std::vector<long>&)>& process,
+                       const std::function<void(long)>& close);
+
+#endif //LEMMA_BGEN_STREAM_HPP
@@ -9,6 +9,7 @@
 #include "eigen_utils.hpp"
 #include "variational_parameters.hpp"
 #include "file_utils.hpp"
+#include "bgen_stream.hpp"
 #include "mpi_utils.hpp"
 
 #include "tools/eigen3.3/Dense"
@@ -21,14 +22,17 @@
 #include <cassert>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <chrono>
 #include <ctime>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <regex>
 #include <vector>
 #include <string>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <thread>
 #include <unordered_map>
@@ -105,9 +109,16 @@ public:
 	boost_io::filtering_ostream outf_scan;
 	genfile::bgen::View::UniquePtr bgenView;
 	std::vector<genfile::bgen::View::UniquePtr> streamBgenViews;
+	// Number of selected variants up to the end of each chromosome, per file
+	std::vector<std::vector<long> > streamBgenChrEnds;
+	// Per-variant QC sums with --bgen-qc-cache
+	std::shared_ptr<BgenQcSidecar> bgenQc;
+	std::vector<std::shared_ptr<BgenQcSidecar> > streamBgenQc;
 
 	bool filters_applied;
-	std::unordered_map<long, bool> sample_is_invalid;
+	SampleMask sample_mask;
+	// Valid samples on any rank
+	SampleMask sample_mask_all_ranks;
 
 // grids for vbayes
 	std::vector< std::string > hyps_names;
@@ -199,18 +210,11 @@ public:
 		}
 
 		for (int ii = 0; ii < p.streamBgenFiles.size(); ii++) {
-			genfile::bgen::IndexQuery::UniquePtr query = genfile::bgen::IndexQuery::create(p.streamBgiFiles[ii]);
-			if (p.range) {
-				genfile::bgen::IndexQuery::GenomicRange rr1(p.range_chr, p.range_start, p.range_end);
-				query->include_range( rr1 );
-			}
-			if(p.incl_rsids_file != "NULL") {
-				query->include_rsids( rsid_list );
-			}
-			if(p.select_rsid) {
-				query->include_rsids( p.rsid );
-			}
+			genfile::bgen::IndexQuery::UniquePtr query = stream_bgen_query(ii);
 			query->initialise();
+			std::vector<long> chr_ends;
+			fileUtils::read_bgen_metadata(p.streamBgiFiles[ii], *query, chr_ends);
+			streamBgenChrEnds.push_back(chr_ends);
 			streamBgenViews[ii]->set_query(query);
 		}
 
@@ -221,6 +225,23 @@ public:
 		filters_applied = true;
 	}
 
+	genfile::bgen::IndexQuery::UniquePtr stream_bgen_query(long ii) const {
+		// Query of --streamBgen file ii with the range / rsid filters; not
+		// yet initialised so that callers can narrow it further
+		genfile::bgen::IndexQuery::UniquePtr query = genfile::bgen::IndexQuery::create(p.streamBgiFiles[ii]);
+		if (p.range) {
+			genfile::bgen::IndexQuery::GenomicRange rr1(p.range_chr, p.range_start, p.range_end);
+			query->include_range( rr1 );
+		}
+		if(p.incl_rsids_file != "NULL") {
+			query->include_rsids( rsid_list );
+		}
+		if(p.select_rsid) {
+			query->include_rsids( p.rsid );
+		}
+		return query;
+	}
+
 	void read_non_genetic_data(){
 		// Apply sample / rsid / range filters if applicable
 		if(!filters_applied) {
@@ -256,6 +277,10 @@ public:
 		// Exclude samples with missing values in phenos / covars / filters
 		reduce_to_complete_cases();
 
+		if(p.bgen_qc_cache_file != "NULL") {
+			open_bgen_qc_cache();
+		}
+
 		// Read in hyperparameter values
 		if(p.hyps_grid_file != "NULL") {
 			read_hyps();
@@ -418,24 +443,58 @@ public:
 
 	void read_full_bgen(){
 		if(p.bgen_file != "NULL") {
-			std::cout << "Reading in BGEN data" << std::endl;
-			if (p.flip_high_maf_variants) {
-				std::cout << " - Flipping variants with MAF > 0.5" << std::endl;
+			// Each rank caches its own samples
+			std::string cache_file;
+			std::uint64_t cache_key = 0;
+			bool cache_hit = false;
+			if(p.genotype_cache_file != "NULL") {
+				int world_rank;
+				MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+				cache_file = p.genotype_cache_file + ".rank" + std::to_string(world_rank) + ".bin";
+				cache_key = genotype_cache_key();
+				auto start = std::chrono::system_clock::now();
+				cache_hit = fileUtils::read_genotype_cache(cache_file, cache_key, G);
+				// Fall back to parsing on every rank unless all ranks hit
+				cache_hit = mpiUtils::mpiReduce_inplace((double) cache_hit) == mpiUtils::mpiReduce_inplace(1.0);
+				if(cache_hit) {
+					auto end = std::chrono::system_clock::now();
+					std::chrono::duration<double> elapsed = end - start;
+					n_var = G.cols();
+					bgen_pass = false;
+					std::cout << "Reading in BGEN data from cache " << p.genotype_cache_file << std::endl;
+					std::cout << " - Cache contained " << n_var << " valid variants." << std::endl;
+					std::cout << " - Cache read in " << elapsed.count() << "s" << std::endl;
+				}
 			}
 
-			auto start = std::chrono::system_clock::now();
-			p.chunk_size = bgenView->number_of_variants();
-			fileUtils::read_bgen_chunk(bgenView, G, sample_is_invalid, n_samples, p.chunk_size, p, bgen_pass,
-			                           n_var_parsed);
-			auto end = std::chrono::system_clock::now();
-			std::chrono::duration<double> elapsed = end - start;
-			n_var = G.cols();
-			std::cout << " - BGEN file contained " << n_var << " valid variants." << std::endl;
-			std::cout << " - BGEN file parsed in " << elapsed.count() << "s" << std::endl;
-
-			G.calc_scaled_values();
+			if(!cache_hit) {
+				std::cout << "Reading in BGEN data" << std::endl;
+				if (p.flip_high_maf_variants) {
+					std::cout << " - Flipping variants with MAF > 0.5" << std::endl;
+				}
+
+				auto start = std::chrono::system_clock::now();
+				p.chunk_size = bgenView->number_of_variants();
+				fileUtils::read_bgen_chunk(bgenView, G, sample_mask, n_samples, p.chunk_size, p, bgen_pass,
+				                           n_var_parsed, bgenQc.get());
+				auto end = std::chrono::system_clock::now();
+				std::chrono::duration<double> elapsed = end - start;
+				n_var = G.cols();
+				std::cout << " - BGEN file contained " << n_var << " valid variants." << std::endl;
+				std::cout << " - BGEN file parsed in " << elapsed.count() << "s" << std::endl;
+				if(!G.chrs_contiguous()) {
+					throw std::runtime_error("ERROR: variants in " + p.bgen_file + " must be grouped by chromosome");
+				}
+
+				G.calc_scaled_values();
+				if (p.debug) std::cout << " - Computed colwise mean and sd of genetic data" << std::endl << std::endl;
+
+				if(p.genotype_cache_file != "NULL") {
+					fileUtils::write_genotype_cache(cache_file, cache_key, G);
+					std::cout << " - Wrote genotype cache to " << p.genotype_cache_file << std::endl;
+				}
+			}
 			G.compute_cumulative_pos();
-			if (p.debug) std::cout << " - Computed colwise mean and sd of genetic data" << std::endl << std::endl;
 
 			// Set default hyper-parameters if not read from file
 			// Run read_hyps twice as some settings depend on n_var
@@ -454,6 +513,72 @@ public:
 		}
 	}
 
+	std::uint64_t genotype_cache_key() const {
+		// Hash of everything that determines the contents of G on this rank
+		int world_rank, world_size;
+		MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+		MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+		std::stringstream ss;
+		ss << p.bgen_file << " " << boost::filesystem::file_size(p.bgen_file);
+		ss << " " << boost::filesystem::last_write_time(p.bgen_file);
+		ss << " maf " << p.maf_lim << " " << p.min_maf << " info " << p.info_lim << " " << p.min_info;
+		ss << " range " << p.range << " " << p.range_chr << " " << p.range_start << " " << p.range_end;
+		ss << " flip " << p.flip_high_maf_variants << " constant " << p.keep_constant_variants;
+		ss << " low_mem " << p.low_mem << " bits " << p.genotype_bits << " sparse " << p.max_sparse_density;
+		ss << " scalar " << sizeof(scalarData) << " rank " << world_rank << "/" << world_size;
+		ss << " rsids";
+		for (const auto& rsid : rsid_list) ss << " " << rsid;
+		ss << " select";
+		for (const auto& rsid : p.rsid) ss << " " << rsid;
+		ss << " samples " << n_samples << " ";
+		for (long ii = 0; ii < n_samples; ii++) {
+			ss << (sample_mask.is_valid(ii) ? '1' : '0');
+		}
+		return fileUtils::hash_string(ss.str());
+	}
+
+	std::uint64_t bgen_qc_key(const std::string& file) const {
+		// Hash of everything that determines the QC sums of a bgen file;
+		// independent of the filter thresholds and of the number of ranks
+		std::stringstream ss;
+		ss << file << " " << boost::filesystem::file_size(file);
+		ss << " " << boost::filesystem::last_write_time(file);
+		ss << " range " << p.range << " " << p.range_chr << " " << p.range_start << " " << p.range_end;
+		ss << " rsids";
+		for (const auto& rsid : rsid_list) ss << " " << rsid;
+		ss << " select";
+		for (const auto& rsid : p.rsid) ss << " " << rsid;
+		ss << " samples " << n_samples << " ";
+		for (long ii = 0; ii < n_samples; ii++) {
+			ss << (sample_mask_all_ranks.is_valid(ii) ? '1' : '0');
+		}
+		return fileUtils::hash_string(ss.str());
+	}
+
+	void open_bgen_qc_cache(){
+		// Sidecars are filled in as variants are first decoded, and written
+		// once every variant of the file has been seen.
+		auto open = [&](const std::string& file, const std::string& suffix, long n_variants) {
+			std::string filename = p.bgen_qc_cache_file + suffix;
+			std::shared_ptr<BgenQcSidecar> qc = std::make_shared<BgenQcSidecar>(filename, bgen_qc_key(file), n_variants);
+			if (qc->load(p)) {
+				std::cout << "Reading per-variant QC statistics from " << filename << std::endl;
+			}
+			return qc;
+		};
+		if (p.bgen_file != "NULL") {
+			bgenQc = open(p.bgen_file, ".bgen.qc", bgenView->number_of_variants());
+		}
+		// Ranks only see part of each file with --streamBgen-partition-variants
+		if (!p.streamBgen_partition_variants) {
+			for (int ii = 0; ii < p.streamBgenFiles.size(); ii++) {
+				streamBgenQc.push_back(open(p.streamBgenFiles[ii], ".streamBgen" + std::to_string(ii) + ".qc",
+				                            streamBgenViews[ii]->number_of_variants()));
+			}
+		}
+	}
+
 	void read_incl_rsids(){
 		boost_io::filtering_istream fg;
 		std::string gz_str = ".gz";
@@ -849,11 +974,7 @@ public:
 				EigenDataMatrix tau1_j = X_kk.transpose() * Y2 / (N-1.0);
 				Eigen::MatrixXd tau2_j = EigenUtils::solve(HtH, Hty);
 				double rss_null = (Y2 - X_kk * tau1_j).squaredNorm();
-#ifdef DATA_AS_FLOAT
-				double rss_alt  = (Y2 - H * tau2_j.cast<float>()).squaredNorm();
-#else
 				double rss_alt  = (Y2 - H * tau2_j).squaredNorm();
-#endif
 				// T-test; main effect of variant j
 				boost_m::students_t t_dist(n_samples - 1);
 				double main_se_j    = std::sqrt(rss_null) / (N - 1.0);
@@ -934,11 +1055,10 @@ public:
 			long ii = 0;
 			std::cout << " - processing precomputed entries from " << p.dxteex_file << std::endl;
 			while(read_dxteex_line(6, fg, dxteex_row, n_cols, snpid, ii)) {
-				auto it = std::find(G.SNPID.begin(), G.SNPID.end(), snpid);
-				if(it == G.SNPID.end()) {
+				long jj = G.SNPID.find(snpid);
+				if(jj < 0) {
 					nNotFound++;
 				} else {
-					long jj = it - G.SNPID.begin();
 					for (int ll = 0; ll < n_env; ll++) {
 						for (int mm = 0; mm <= ll; mm++) {
 							dXtEEX_lowertri(jj, dXtEEX_col_ind(ll, mm, n_env)) = dxteex_row(ll * n_env + mm);
@@ -1185,18 +1305,21 @@ public:
 			read_vb_init_file(p.vb_init_file, vb_init_mat, vb_init_colnames,
 			                  init_key);
 			std::cout << "--vb_init file with contextual information detected" << std::endl;
-			std::cout << "Warning: This will be O(PL) where L = " << vb_init_mat.rows();
-			std::cout << " is the number of lines in file given to --vb_init." << std::endl;
 
-			std::vector<std::string>::iterator it;
+			// Index of first variant with each chr~pos~a0~a1 key
+			std::unordered_map<std::string, long> key_index;
+			for (long jj = 0; jj < n_var; jj++) {
+				key_index.emplace(G.snp_key(jj), jj);
+			}
+
 			unsigned long index_kk;
 			for(int kk = 0; kk < vb_init_mat.rows(); kk++) {
-				it = std::find(G.SNPKEY.begin(), G.SNPKEY.end(), init_key[kk]);
-				if (it == G.SNPKEY.end()) {
+				auto it = key_index.find(init_key[kk]);
+				if (it == key_index.end()) {
 					std::cout << "WARNING: Can't locate variant with key: ";
 					std::cout << init_key[kk] << std::endl;
 				} else {
-					index_kk = it - G.SNPKEY.begin();
+					index_kk = it->second;
 					vp_init.alpha_beta(index_kk)    = 1.0;
 					vp_init.mu1_beta(index_kk)      = vb_init_mat(kk, 5);
 					if(n_effects > 1) {
@@ -1440,13 +1563,32 @@ public:
 
 		mpiUtils::partition_valid_samples_across_ranks(n_samples, n_var, n_env, p, incomplete_cases, sample_location);
 
-		sample_is_invalid.clear();
-		for (long ii = 0; ii < n_samples; ii++) {
-			if (incomplete_cases.find(ii) == incomplete_cases.end()) {
-				sample_is_invalid[ii] = false;
+		std::vector<bool> is_excluded(n_samples, false);
+		for (const auto& kv : incomplete_cases) {
+			if (kv.first < n_samples) is_excluded[kv.first] = true;
+		}
+		sample_mask.assign(n_samples, is_excluded);
+
+		// Valid samples are held by ranks in contiguous blocks, in file order
+		int world_size;
+		MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+		std::vector<bool> is_invalid(n_samples, false);
+		std::vector<int> rank_counts(world_size, 0);
+		for (const auto& kv : sample_location) {
+			if (kv.second < 0) {
+				is_invalid[kv.first] = true;
 			} else {
-				sample_is_invalid[ii] = true;
+				rank_counts[kv.second]++;
+			}
+		}
+		sample_mask_all_ranks.assign(n_samples, is_invalid);
+		if (p.bgen_scatter) {
+			sample_mask.scatter_counts = rank_counts;
+			sample_mask.scatter_displs.assign(world_size, 0);
+			for (int rr = 1; rr < world_size; rr++) {
+				sample_mask.scatter_displs[rr] = sample_mask.scatter_displs[rr - 1] + rank_counts[rr - 1];
 			}
+			sample_mask.all_ranks = std::make_shared<SampleMask>(sample_mask_all_ranks);
 		}
 
 		if(n_pheno > 0) {
@@ -8,15 +8,24 @@
 
 #include "genfile/bgen/bgen.hpp"
 #include "genfile/bgen/View.hpp"
+#include "genfile/bgen/IndexQuery.hpp"
+#include "db/Connection.hpp"
+#include "db/SQLStatement.hpp"
 #include "bgen_parser.hpp"
+#include "bgen_stream.hpp"
 
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/filesystem.hpp>
 
+#include <cstdint>
+#include <fstream>
+#include <functional>
 #include <iomanip>
+#include <limits>
 #include <string>
+#include <thread>
 #include <vector>
 #include <map>
 #include <set>
@@ -170,7 +179,7 @@ void fileUtils::dump_predicted_vec_to_file(Eigen::Ref<Eigen::MatrixXd> mat,
 	}
 }
 
-void fileUtils::write_snp_stats_to_file(boost_io::filtering_ostream &ofile, const int &n_effects,
+void fileUtils::write_snp_stats_to_file(std::ostream &ofile, const int &n_effects,
                                         const GenotypeMatrix &X,
                                         const bool &append,
                                         const Eigen::Ref<const Eigen::VectorXd> &neglogp_beta,
@@ -220,7 +229,7 @@ void fileUtils::write_snp_stats_to_file(boost_io::filtering_ostream &ofile, cons
 	}
 }
 
-void fileUtils::write_snp_stats_to_file(boost_io::filtering_ostream &ofile, const int &n_effects,
+void fileUtils::write_snp_stats_to_file(std::ostream &ofile, const int &n_effects,
                                         const GenotypeMatrix &X,
                                         const bool &append,
                                         const Eigen::Ref<const Eigen::VectorXd> &neglogp_beta,
@@ -235,7 +244,7 @@ void fileUtils::write_snp_stats_to_file(boost_io::filtering_ostream &ofile, cons
 	                                   test_stat_beta, test_stat_gam, test_stat_rgam, emptyVec);
 }
 
-void fileUtils::write_snp_stats_to_file(boost_io::filtering_ostream &ofile,
+void fileUtils::write_snp_stats_to_file(std::ostream &ofile,
                                         const int &n_effects,
                                         const GenotypeMatrix &X,
                                         const bool &append,
@@ -253,50 +262,472 @@ void fileUtils::write_snp_stats_to_file(boost_io::filtering_ostream &ofile,
 	}
 }
 
-void fileUtils::read_bgen_metadata(const std::string& filename,
-                                   std::vector<int>& chr) {
-	genfile::bgen::View::UniquePtr bgenView = genfile::bgen::View::create(filename);
+/***************** Binary caches *****************/
+namespace {
+const char genotypeCacheMagic[8] = {'L', 'E', 'M', 'M', 'A', 'G', 'C', '2'};
+const char ldblockCacheMagic[8] = {'L', 'E', 'M', 'M', 'A', 'L', 'D', '1'};
 
-	std::string chr_j, rsid_j, SNPID_j;
-	std::uint32_t pos_j;
-	std::vector< std::string > alleles_j;
-	bool bgen_pass = true;
+template <typename T>
+void write_pod(std::ostream& out, const T& x){
+	out.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
 
-	chr.clear();
+template <typename T>
+void read_pod(std::istream& in, T& x){
+	in.read(reinterpret_cast<char*>(&x), sizeof(T));
+}
 
-	while (bgen_pass) {
-		bgen_pass = bgenView->read_variant(&SNPID_j, &rsid_j, &chr_j, &pos_j, &alleles_j);
-		if (bgen_pass) {
-			bgenView->ignore_genotype_data_block();
-		}
-		chr.push_back(std::stoi(chr_j));
+template <typename T>
+void write_vector(std::ostream& out, const std::vector<T>& vec){
+	long size = vec.size();
+	write_pod(out, size);
+	out.write(reinterpret_cast<const char*>(vec.data()), size * sizeof(T));
+}
+
+template <typename T>
+void read_vector(std::istream& in, std::vector<T>& vec){
+	long size = 0;
+	read_pod(in, size);
+	vec.resize(size);
+	in.read(reinterpret_cast<char*>(vec.data()), size * sizeof(T));
+}
+
+void write_strings(std::ostream& out, const InternedStrings& vec){
+	long size = vec.size();
+	write_pod(out, size);
+	for (long jj = 0; jj < size; jj++) {
+		std::string str = vec[jj];
+		long len = str.size();
+		write_pod(out, len);
+		out.write(str.data(), len);
 	}
 }
 
-bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
-                                GenotypeMatrix &G,
-                                const std::unordered_map<long, bool> &sample_is_invalid,
-                                const long &n_samples,
-                                const long &chunk_size,
-                                const parameters &p,
-                                bool &bgen_pass,
-                                long &n_var_parsed){
-	// Wrapper around BgenView to read in a 'chunk' of data. Remembers
-	// if last call hit the EOF, and returns false if so.
+void read_strings(std::istream& in, InternedStrings& vec){
+	long size = 0;
+	read_pod(in, size);
+	vec.resize(size);
+	std::string str;
+	for (long jj = 0; jj < size && in; jj++) {
+		long len = 0;
+		read_pod(in, len);
+		str.resize(len);
+		in.read(&str[0], len);
+		vec.set(jj, str);
+	}
+}
 
-	// Exit function if last call hit EOF.
-	if (!bgen_pass) return false;
+template <typename Derived>
+void write_eigen(std::ostream& out, const Eigen::PlainObjectBase<Derived>& mat){
+	long rows = mat.rows(), cols = mat.cols();
+	write_pod(out, rows);
+	write_pod(out, cols);
+	out.write(reinterpret_cast<const char*>(mat.data()), rows * cols * sizeof(typename Derived::Scalar));
+}
+
+template <typename Derived>
+void read_eigen(std::istream& in, Eigen::PlainObjectBase<Derived>& mat){
+	long rows = 0, cols = 0;
+	read_pod(in, rows);
+	read_pod(in, cols);
+	mat.resize(rows, cols);
+	in.read(reinterpret_cast<char*>(mat.data()), rows * cols * sizeof(typename Derived::Scalar));
+}
+}
+
+std::uint64_t fileUtils::hash_string(const std::string& str){
+	// 64 bit FNV-1a; stable across builds unlike std::hash
+	std::uint64_t hash = fnv_offset_basis;
+	hash_bytes(hash, str.data(), str.size());
+	return hash;
+}
+
+void fileUtils::hash_bytes(std::uint64_t& hash, const void* data, const std::size_t& n_bytes){
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (std::size_t ii = 0; ii < n_bytes; ii++) {
+		hash ^= bytes[ii];
+		hash *= 1099511628211ULL;
+	}
+}
+
+void fileUtils::hash_field(std::uint64_t& hash, const std::string& field){
+	std::uint64_t size = field.size();
+	hash_bytes(hash, &size, sizeof(size));
+	hash_bytes(hash, field.data(), field.size());
+}
+
+void fileUtils::write_genotype_cache(const std::string& filename,
+                                     const std::uint64_t& key,
+                                     const GenotypeMatrix& G){
+	// Binary snapshot of G after calc_scaled_values(); see read_genotype_cache
+	assert(G.scaling_performed);
+	std::ofstream out(filename, std::ios::binary);
+	if(!out) {
+		throw std::runtime_error("Could not open " + filename + " to write genotype cache");
+	}
+	out.write(genotypeCacheMagic, sizeof(genotypeCacheMagic));
+	write_pod(out, key);
+	long nn = G.rows(), pp = G.cols();
+	write_pod(out, nn);
+	write_pod(out, pp);
+	write_pod(out, G.low_mem);
+
+	if(G.low_mem) {
+		write_eigen(out, G.M);
+		write_eigen(out, G.dosage_scale);
+		write_eigen(out, G.dosage_offset);
+		std::vector<char> col_is_sparse(G.col_is_sparse.begin(), G.col_is_sparse.end());
+		write_vector(out, col_is_sparse);
+		write_vector(out, G.col_index);
+		write_vector(out, G.dense_vars);
+		write_vector(out, G.sparse_vars);
+		write_vector(out, G.sparse_col_ptr);
+		write_vector(out, G.sparse_rows);
+		write_vector(out, G.sparse_codes);
+	} else {
+		write_eigen(out, G.G);
+	}
+	write_eigen(out, G.compressed_dosage_means);
+	write_eigen(out, G.compressed_dosage_sds);
+	write_eigen(out, G.compressed_dosage_inv_sds);
+
+	write_vector(out, G.chromosome);
+	write_vector(out, G.position);
+	write_vector(out, G.maf);
+	write_vector(out, G.info);
+	write_strings(out, G.al_0);
+	write_strings(out, G.al_1);
+	write_strings(out, G.rsid);
+	write_strings(out, G.SNPID);
+	if(!out) {
+		throw std::runtime_error("Error writing genotype cache to " + filename);
+	}
+}
+
+bool fileUtils::read_genotype_cache(const std::string& filename,
+                                    const std::uint64_t& key,
+                                    GenotypeMatrix& G){
+	// Returns false if the cache is missing or was built from different
+	// data / settings, in which case G is left untouched.
+	std::ifstream in(filename, std::ios::binary);
+	if(!in) return false;
+
+	char magic[sizeof(genotypeCacheMagic)];
+	std::uint64_t cache_key = 0;
+	long nn = 0, pp = 0;
+	bool low_mem = false;
+	in.read(magic, sizeof(magic));
+	read_pod(in, cache_key);
+	read_pod(in, nn);
+	read_pod(in, pp);
+	read_pod(in, low_mem);
+	if(!in || !std::equal(magic, magic + sizeof(magic), genotypeCacheMagic)) return false;
+	if(cache_key != key || low_mem != G.low_mem) return false;
+
+	G.resize(nn, pp);
+	if(G.low_mem) {
+		std::vector<char> col_is_sparse;
+		read_eigen(in, G.M);
+		read_eigen(in, G.dosage_scale);
+		read_eigen(in, G.dosage_offset);
+		read_vector(in, col_is_sparse);
+		G.col_is_sparse.assign(col_is_sparse.begin(), col_is_sparse.end());
+		read_vector(in, G.col_index);
+		read_vector(in, G.dense_vars);
+		read_vector(in, G.sparse_vars);
+		read_vector(in, G.sparse_col_ptr);
+		read_vector(in, G.sparse_rows);
+		read_vector(in, G.sparse_codes);
+	} else {
+		read_eigen(in, G.G);
+	}
+	read_eigen(in, G.compressed_dosage_means);
+	read_eigen(in, G.compressed_dosage_sds);
+	read_eigen(in, G.compressed_dosage_inv_sds);
+
+	read_vector(in, G.chromosome);
+	read_vector(in, G.position);
+	read_vector(in, G.maf);
+	read_vector(in, G.info);
+	read_strings(in, G.al_0);
+	read_strings(in, G.al_1);
+	read_strings(in, G.rsid);
+	read_strings(in, G.SNPID);
+	if(!in) {
+		throw std::runtime_error("Genotype cache " + filename + " is truncated or corrupt");
+	}
+
+	G.compute_chr_offsets();
+	G.scaling_performed = true;
+	return true;
+}
+
+void fileUtils::write_xtx_block_cache(const std::string& filename,
+                                      const std::uint64_t& key,
+                                      const unsigned int& main_chunk_size,
+                                      const unsigned int& gxe_chunk_size,
+                                      const std::vector<std::size_t>& offsets,
+                                      const std::vector<float>& arena){
+	// Packed main effect LD blocks of VBayes and the chunk sizes of the run
+	// that built them; see read_xtx_block_cache
+	std::ofstream out(filename, std::ios::binary);
+	if(!out) {
+		throw std::runtime_error("Could not open " + filename + " to write LD block cache");
+	}
+	out.write(ldblockCacheMagic, sizeof(ldblockCacheMagic));
+	write_pod(out, key);
+	write_pod(out, main_chunk_size);
+	write_pod(out, gxe_chunk_size);
+	write_vector(out, offsets);
+	write_vector(out, arena);
+	if(!out) {
+		throw std::runtime_error("Error writing LD block cache to " + filename);
+	}
+}
+
+bool fileUtils::read_xtx_block_cache_chunk_sizes(const std::string& filename,
+                                                 const std::uint64_t& key,
+                                                 unsigned int& main_chunk_size,
+                                                 unsigned int& gxe_chunk_size){
+	// Chunk sizes stored in the header of a cache built from the same data;
+	// returns false if the cache is missing or stale, leaving them untouched
+	std::ifstream in(filename, std::ios::binary);
+	if(!in) return false;
+
+	char magic[sizeof(ldblockCacheMagic)];
+	std::uint64_t cache_key = 0;
+	unsigned int cache_main = 0, cache_gxe = 0;
+	in.read(magic, sizeof(magic));
+	read_pod(in, cache_key);
+	read_pod(in, cache_main);
+	read_pod(in, cache_gxe);
+	if(!in || !std::equal(magic, magic + sizeof(magic), ldblockCacheMagic)) return false;
+	if(cache_key != key) return false;
+
+	main_chunk_size = cache_main;
+	gxe_chunk_size = cache_gxe;
+	return true;
+}
+
+bool fileUtils::read_xtx_block_cache(const std::string& filename,
+                                     const std::uint64_t& key,
+                                     const unsigned int& main_chunk_size,
+                                     std::vector<std::size_t>& offsets,
+                                     std::vector<float>& arena){
+	// Returns false if the cache is missing or was built from different
+	// data / chunking, in which case offsets and arena are left untouched.
+	std::ifstream in(filename, std::ios::binary);
+	if(!in) return false;
+
+	char magic[sizeof(ldblockCacheMagic)];
+	std::uint64_t cache_key = 0;
+	unsigned int cache_main = 0, cache_gxe = 0;
+	in.read(magic, sizeof(magic));
+	read_pod(in, cache_key);
+	read_pod(in, cache_main);
+	read_pod(in, cache_gxe);
+	if(!in || !std::equal(magic, magic + sizeof(magic), ldblockCacheMagic)) return false;
+	if(cache_key != key || cache_main != main_chunk_size) return false;
+
+	read_vector(in, offsets);
+	read_vector(in, arena);
+	if(!in || offsets.empty() || offsets.back() != arena.size()) {
+		throw std::runtime_error("LD block cache " + filename + " is truncated or corrupt");
+	}
+	return true;
+}
+
+void fileUtils::write_ztz_block_cache(const std::string& filename,
+                                      const std::uint64_t& key,
+                                      const std::map<long, Eigen::MatrixXd>& blocks){
+	// Interaction LD blocks of VBayes by memoize id; see read_ztz_block_cache
+	std::ofstream out(filename, std::ios::binary);
+	if(!out) {
+		throw std::runtime_error("Could not open " + filename + " to write LD block cache");
+	}
+	out.write(ldblockCacheMagic, sizeof(ldblockCacheMagic));
+	write_pod(out, key);
+	long n_blocks = blocks.size();
+	write_pod(out, n_blocks);
+	for (const auto& kv : blocks) {
+		write_pod(out, kv.first);
+		write_eigen(out, kv.second);
+	}
+	if(!out) {
+		throw std::runtime_error("Error writing LD block cache to " + filename);
+	}
+}
 
-	// Temporary variables to store info from read_variant()
-	std::string chr_j;
-	std::uint32_t pos_j;
-	std::string rsid_j;
-	std::vector< std::string > alleles_j;
-	std::string SNPID_j;
+bool fileUtils::read_ztz_block_cache(const std::string& filename,
+                                     const std::uint64_t& key,
+                                     std::map<long, Eigen::MatrixXd>& blocks){
+	// Returns false if the cache is missing or stale, leaving blocks untouched
+	std::ifstream in(filename, std::ios::binary);
+	if(!in) return false;
+
+	char magic[sizeof(ldblockCacheMagic)];
+	std::uint64_t cache_key = 0;
+	in.read(magic, sizeof(magic));
+	read_pod(in, cache_key);
+	if(!in || !std::equal(magic, magic + sizeof(magic), ldblockCacheMagic)) return false;
+	if(cache_key != key) return false;
+
+	long n_blocks = 0;
+	read_pod(in, n_blocks);
+	std::map<long, Eigen::MatrixXd> cached;
+	for (long kk = 0; kk < n_blocks && in; kk++) {
+		long id = 0;
+		read_pod(in, id);
+		read_eigen(in, cached[id]);
+	}
+	if(!in) {
+		throw std::runtime_error("LD block cache " + filename + " is truncated or corrupt");
+	}
+	blocks = std::move(cached);
+	return true;
+}
+
+/***************** BGEN decode pipeline *****************/
+namespace {
+typedef std::function<bool (const RawBgenVariant&, const DosageSetter&)> VariantFilter;
+typedef std::function<void (const VariantFilter&)> VariantSource;
+
+void decode_bgen_variants(genfile::bgen::View::UniquePtr &bgenView,
+                          const SampleMask &sample_mask,
+                          const long &max_kept,
+                          const parameters &p,
+                          bool &bgen_pass,
+                          long &n_var_parsed,
+                          const bool &want_codes,
+                          BgenQcSidecar* qc,
+                          const VariantFilter& keep_variant){
+	// Producer / consumer pipeline; one thread reads raw variant blocks in
+	// file order while p.n_thread workers uncompress and parse the previous
+	// batch. keep_variant(var, setter) is then called in file order on this
+	// thread and returns true if the variant passed its filters. Stops after
+	// max_kept variants are kept, without reading any further variants.
+	// With want_codes, 8-bit biallelic data is decoded straight to low-mem codes.
+	// With --bgen-scatter rank 0 alone reads, decoding the next batch for all
+	// ranks while the current one is scattered. Query indices of variants
+	// start from n_var_parsed for the QC sidecar.
+	long n_thread = std::max(1u, p.n_thread);
+	long batch_size = bgenBatchPerThread * n_thread;
+	const genfile::bgen::Context& context = bgenView->context();
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	bool scatter = sample_mask.scatter();
+	bool is_reader = !scatter || world_rank == 0;
+
+	std::vector<RawBgenVariant> batch(batch_size), next_batch(batch_size);
+	std::vector<DosageSetter> setters, all_setters, next_all_setters;
+	setters.reserve(batch_size);
+	for (long kk = 0; kk < batch_size; kk++) {
+		setters.emplace_back(sample_mask);
+		setters.back().m_want_codes = want_codes;
+	}
+	if (scatter && is_reader) {
+		all_setters.reserve(batch_size);
+		next_all_setters.reserve(batch_size);
+		for (long kk = 0; kk < batch_size; kk++) {
+			all_setters.emplace_back(*sample_mask.all_ranks);
+			all_setters.back().m_want_codes = want_codes;
+			next_all_setters.emplace_back(*sample_mask.all_ranks);
+			next_all_setters.back().m_want_codes = want_codes;
+		}
+	}
+	std::vector<std::vector<genfile::byte_t> > buffers(n_thread), next_buffers(n_thread);
+
+	long n_kept = 0;
+	long n_batch = 0;
+	long read_index = n_var_parsed;
+	if (is_reader) {
+		n_batch = read_raw_bgen_batch(bgenView, batch, std::min(batch_size, max_kept), bgen_pass, qc, read_index);
+		read_index += n_batch;
+		if (scatter) {
+			decode_raw_bgen_batch(context, batch, n_batch, all_setters, buffers);
+		}
+	}
+	if (scatter) {
+		broadcast_bgen_batch_size(n_batch, bgen_pass);
+	}
+	while (n_batch > 0) {
+		// Read ahead only as far as could be needed if this batch all passes
+		long n_next = 0;
+		long max_next = std::min(batch_size, max_kept - n_kept - n_batch);
+		std::thread reader;
+		if (is_reader && bgen_pass && max_next > 0) {
+			reader = std::thread([&, max_next] {
+				n_next = read_raw_bgen_batch(bgenView, next_batch, max_next, bgen_pass, qc, read_index);
+				read_index += n_next;
+				if (scatter) {
+					decode_raw_bgen_batch(context, next_batch, n_next, next_all_setters, next_buffers);
+				}
+			});
+		}
 
-	long nInvalid = sample_is_invalid.size() - n_samples;
-	DosageSetter setter_v2(sample_is_invalid, nInvalid);
+		if (scatter) {
+			scatter_bgen_batch(sample_mask, batch, n_batch, all_setters, setters);
+			if (reader.joinable()) {
+				reader.join();
+			}
+		} else {
+			decode_raw_bgen_batch(context, batch, n_batch, setters, buffers);
+			if (reader.joinable()) {
+				reader.join();
+			}
 
+			// One allreduce for the QC sums of the whole batch
+			reduce_summary_stats(batch, setters, n_batch);
+		}
+		for (long kk = 0; kk < n_batch; kk++) {
+			if (qc) {
+				qc->record(n_var_parsed, setters[kk]);
+			}
+			n_var_parsed++;
+			if (keep_variant(batch[kk], setters[kk])) {
+				n_kept++;
+			}
+		}
+
+		std::swap(batch, next_batch);
+		std::swap(all_setters, next_all_setters);
+		n_batch = n_next;
+		if (is_reader && n_batch == 0 && bgen_pass && n_kept < max_kept) {
+			n_batch = read_raw_bgen_batch(bgenView, batch, std::min(batch_size, max_kept - n_kept), bgen_pass, qc, read_index);
+			read_index += n_batch;
+			if (scatter) {
+				decode_raw_bgen_batch(context, batch, n_batch, all_setters, buffers);
+			}
+		}
+		if (scatter) {
+			broadcast_bgen_batch_size(n_batch, bgen_pass);
+		}
+	}
+}
+
+void stream_bgen_variants(BgenStreamReader& reader,
+                          const long &max_kept,
+                          long &n_var_parsed,
+                          const VariantFilter& keep_variant){
+	// As decode_bgen_variants, with variants already decoded in the background
+	long n_kept = 0;
+	const RawBgenVariant* var;
+	const DosageSetter* setter;
+	while (n_kept < max_kept && reader.next(var, setter)) {
+		n_var_parsed++;
+		if (keep_variant(*var, *setter)) {
+			n_kept++;
+		}
+	}
+}
+
+bool fill_bgen_chunk(const VariantSource& for_each_variant,
+                     GenotypeMatrix &G,
+                     const long &n_samples,
+                     const long &chunk_size,
+                     const parameters &p){
+	// Filters variants from for_each_variant into G, until chunk_size variants
+	// are kept or the source is exhausted. Returns false if none were kept.
 	double chunk_missingness = 0;
 	long n_var_incomplete = 0;
 
@@ -305,63 +736,50 @@ bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
 
 	long int n_constant_variance = 0;
 	std::uint32_t jj = 0;
-	while ( jj < chunk_size && bgen_pass) {
-		bgen_pass = bgenView->read_variant( &SNPID_j, &rsid_j, &chr_j, &pos_j, &alleles_j );
-		if (!bgen_pass) break;
-		n_var_parsed++;
-
-		// Read dosage
-		bgenView->read_genotype_data_block( setter_v2 );
-
-		double d1     = setter_v2.m_sum_eij;
+	bool can_take_codes = G.low_mem && G.params.genotype_bits == 8;
+	for_each_variant([&](const RawBgenVariant& var, const DosageSetter& setter_v2) {
 		double maf_j  = setter_v2.m_maf;
 		double info_j = setter_v2.m_info;
-		double mu     = setter_v2.m_mean;
 		double missingness_j    = setter_v2.m_missingness;
-		double sigma = std::sqrt(setter_v2.m_sigma2);
 
 		// Filters
-		if (p.maf_lim && (maf_j < p.min_maf || maf_j > 1 - p.min_maf)) {
-			continue;
-		}
-		if (p.info_lim && info_j < p.min_info) {
-			continue;
+		if (fails_maf_info_filters(setter_v2, p)) {
+			return false;
 		}
 		// if (p.missingness_lim && missingness_j > p.max_missingness) {
-		//  continue;
+		//  return false;
 		// }
-		if(!p.keep_constant_variants && d1 < 5.0) {
+		if (is_constant_variant(setter_v2, p)) {
 			n_constant_variance++;
-			continue;
-		}
-		if(!p.keep_constant_variants && sigma <= 1e-12) {
-			n_constant_variance++;
-			continue;
+			return false;
 		}
 
 		// filters passed; write contextual info
 		chunk_missingness += missingness_j;
 		if(missingness_j > 0) n_var_incomplete++;
 
-		G.al_0[jj]     = alleles_j[0];
-		G.al_1[jj]     = alleles_j[1];
+		G.al_0.set(jj, var.alleles[0]);
+		G.al_1.set(jj, var.alleles[1]);
 		G.maf[jj]      = maf_j;
 		G.info[jj]     = info_j;
-		G.rsid[jj]     = rsid_j;
-		G.chromosome[jj] = std::stoi(chr_j);
-		G.position[jj] = pos_j;
-		std::string key_j = chr_j + "~" + std::to_string(pos_j) + "~" + alleles_j[0] + "~" + alleles_j[1];
-		G.SNPKEY[jj]   = key_j;
-		G.SNPID[jj] = SNPID_j;
-
-		for (std::uint32_t ii = 0; ii < n_samples; ii++) {
-			G.assign_index(ii, jj, setter_v2.m_dosage[ii]);
+		G.rsid.set(jj, var.rsid);
+		G.chromosome[jj] = std::stoi(var.chr);
+		G.position[jj] = var.pos;
+		G.SNPID.set(jj, var.SNPID);
+
+		if (setter_v2.m_has_codes) {
+			if (!can_take_codes) {
+				throw std::runtime_error("Error: 8-bit dosage codes require a low-mem "
+				                         "GenotypeMatrix with 8 bits per genotype");
+			}
+			G.assign_codes(jj, setter_v2.m_codes.data());
+		} else {
+			G.assign_col(jj, setter_v2.m_dosage.cast<double>());
 		}
-		// G.compressed_dosage_sds[jj] = sigma;
-		// G.compressed_dosage_means[jj] = mu;
 
 		jj++;
-	}
+		return true;
+	});
 
 	// need to resize G whilst retaining existing coefficients if while
 	// loop exits early due to EOF.
@@ -388,82 +806,32 @@ bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
 	}
 }
 
-bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
-                                Eigen::MatrixXd &G,
-                                const std::unordered_map<long, bool> &sample_is_invalid,
-                                const long &n_samples,
-                                const long &chunk_size,
-                                const parameters &p,
-                                bool &bgen_pass,
-                                long &n_var_parsed,
-                                std::vector<std::string>& SNPIDS){
-	// Wrapper around BgenView to read in a 'chunk' of data. Remembers
-	// if last call hit the EOF, and returns false if so.
-
-	// Exit function if last call hit EOF.
-	if (!bgen_pass) return false;
-
-	// Temporary variables to store info from read_variant()
-	std::string chr_j;
-	std::uint32_t pos_j;
-	std::string rsid_j;
-	std::vector< std::string > alleles_j;
-	std::string SNPID_j;
-
-	long nInvalid = sample_is_invalid.size() - n_samples;
-	DosageSetter setter_v2(sample_is_invalid, nInvalid);
-
-	double chunk_missingness = 0;
-	long n_var_incomplete = 0;
+bool fill_bgen_chunk(const VariantSource& for_each_variant,
+                     Eigen::MatrixXd &G,
+                     const long &n_samples,
+                     const long &chunk_size,
+                     const parameters &p,
+                     std::vector<std::string>& SNPIDS){
 	SNPIDS.clear();
 
 	// Resize genotype matrix
 	G.resize(n_samples, chunk_size);
 
-	long int n_constant_variance = 0;
 	std::uint32_t jj = 0;
-	while ( jj < chunk_size && bgen_pass) {
-		bgen_pass = bgenView->read_variant( &SNPID_j, &rsid_j, &chr_j, &pos_j, &alleles_j );
-		if (!bgen_pass) break;
-		n_var_parsed++;
-
-		// Read probs + check maf filter
-		bgenView->read_genotype_data_block( setter_v2 );
-
-		double d1     = setter_v2.m_sum_eij;
-		double maf_j  = setter_v2.m_maf;
-		double info_j = setter_v2.m_info;
-		double mu     = setter_v2.m_mean;
-		double missingness_j    = setter_v2.m_missingness;
-		double sigma = std::sqrt(setter_v2.m_sigma2);
-
+	for_each_variant([&](const RawBgenVariant& var, const DosageSetter& setter_v2) {
 		// Filters
-		if (p.maf_lim && (maf_j < p.min_maf || maf_j > 1 - p.min_maf)) {
-			continue;
-		}
-		if (p.info_lim && info_j < p.min_info) {
-			continue;
+		if (fails_maf_info_filters(setter_v2, p) || is_constant_variant(setter_v2, p)) {
+			return false;
 		}
-		if(!p.keep_constant_variants && d1 < 5.0) {
-			n_constant_variance++;
-			continue;
-		}
-		if(!p.keep_constant_variants && sigma <= 1e-12) {
-			n_constant_variance++;
-			continue;
+		if (setter_v2.m_has_codes) {
+			throw std::runtime_error("Error: expected dosages rather than 8-bit codes");
 		}
 
-		SNPIDS.push_back(SNPID_j);
-
-		// filters passed; write contextual info
-		chunk_missingness += missingness_j;
-		if(missingness_j > 0) n_var_incomplete++;
-
-		for (std::uint32_t ii = 0; ii < n_samples; ii++) {
-			G(ii, jj) = setter_v2.m_dosage[ii];
-		}
+		SNPIDS.push_back(var.SNPID);
+		G.col(jj) = setter_v2.m_dosage.cast<double>();
 		jj++;
-	}
+		return true;
+	});
 
 	// need to resize G whilst retaining existing coefficients if while
 	// loop exits early due to EOF.
@@ -476,3 +844,160 @@ bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
 		return true;
 	}
 }
+}
+
+void fileUtils::read_bgen_metadata(const std::string& bgi_file,
+                                   const genfile::bgen::IndexQuery& query,
+                                   std::vector<long>& chr_ends) {
+	// Chromosome boundaries of the variants selected by query, without a
+	// pass over the bgen file. The .bgi index gives the file offset at which
+	// each chromosome starts; query gives the offset of each selected variant.
+	db::Connection::UniquePtr connection = db::Connection::create("file:" + bgi_file + "?nolock", "r");
+	auto stmt = connection->get_statement(
+		"SELECT MIN(file_start_position) AS start FROM Variant GROUP BY chromosome ORDER BY start");
+	std::vector<std::int64_t> chr_starts;
+	for (stmt->step(); !stmt->empty(); stmt->step()) {
+		chr_starts.push_back(stmt->get<std::int64_t>(0));
+	}
+
+	chr_ends.clear();
+	long n_var = query.number_of_variants();
+	std::size_t cc = 0;
+	for (long jj = 0; jj < n_var; jj++) {
+		std::int64_t start = query.locate_variant(jj).first;
+		bool new_chr = false;
+		while (cc + 1 < chr_starts.size() && chr_starts[cc + 1] <= start) {
+			cc++;
+			new_chr = true;
+		}
+		if (new_chr && jj > 0) {
+			chr_ends.push_back(jj);
+		}
+	}
+	if (n_var > 0) {
+		chr_ends.push_back(n_var);
+	}
+}
+
+void fileUtils::seek_bgen_variant(genfile::bgen::View::UniquePtr &bgenView,
+                                  const std::string& bgi_file,
+                                  const std::function<genfile::bgen::IndexQuery::UniquePtr()>& make_query,
+                                  const long& first_variant) {
+	// Point bgenView at variant first_variant of make_query() without reading
+	// the variants before it. The query is narrowed to start at the
+	// chromosome and position of that variant, found from the .bgi index;
+	// queries order variants by chromosome then position, so only earlier
+	// variants at the same position are left to skip.
+	if (first_variant == 0) return;
+	genfile::bgen::IndexQuery::UniquePtr query = make_query();
+	query->initialise();
+	long n_var = query->number_of_variants();
+	if (first_variant >= n_var) {
+		throw std::logic_error("Cannot seek past the last variant of " + bgi_file);
+	}
+	std::int64_t start = query->locate_variant(first_variant).first;
+
+	db::Connection::UniquePtr connection = db::Connection::create("file:" + bgi_file + "?nolock", "r");
+	auto stmt = connection->get_statement(
+		"SELECT chromosome, position FROM Variant WHERE file_start_position == " + std::to_string(start));
+	stmt->step();
+	if (stmt->empty()) {
+		throw std::runtime_error("Could not locate variant " + std::to_string(first_variant) + " in " + bgi_file);
+	}
+	std::string chr = stmt->get<std::string>(0);
+	std::uint32_t pos = stmt->get<std::int64_t>(1);
+	std::vector<std::string> chrs;
+	auto chr_stmt = connection->get_statement("SELECT DISTINCT chromosome FROM Variant");
+	for (chr_stmt->step(); !chr_stmt->empty(); chr_stmt->step()) {
+		chrs.push_back(chr_stmt->get<std::string>(0));
+	}
+
+	query = make_query();
+	for (const auto& cc : chrs) {
+		if (cc < chr) {
+			genfile::bgen::IndexQuery::GenomicRange rr1(cc, 0, std::numeric_limits<std::uint32_t>::max());
+			query->exclude_range(rr1);
+		}
+	}
+	if (pos > 0) {
+		genfile::bgen::IndexQuery::GenomicRange rr1(chr, 0, pos - 1);
+		query->exclude_range(rr1);
+	}
+	query->initialise();
+
+	long n_skip = first_variant - (n_var - (long) query->number_of_variants());
+	if (n_skip < 0) {
+		throw std::logic_error("Variants of " + bgi_file + " are not ordered by chromosome and position");
+	}
+	bgenView->set_query(query);
+	bool bgen_pass = true;
+	if (skip_raw_bgen_variants(bgenView, n_skip, bgen_pass) != n_skip) {
+		throw std::runtime_error("Unexpected EOF seeking to variant " + std::to_string(first_variant) + " in " + bgi_file);
+	}
+}
+
+bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
+                                GenotypeMatrix &G,
+                                const SampleMask &sample_mask,
+                                const long &n_samples,
+                                const long &chunk_size,
+                                const parameters &p,
+                                bool &bgen_pass,
+                                long &n_var_parsed,
+                                BgenQcSidecar* qc){
+	// Wrapper around BgenView to read in a 'chunk' of data. Remembers
+	// if last call hit the EOF, and returns false if so.
+
+	// Exit function if last call hit EOF.
+	if (!bgen_pass) return false;
+
+	bool want_codes = G.low_mem && G.params.genotype_bits == 8;
+	return fill_bgen_chunk([&](const VariantFilter& keep_variant) {
+		decode_bgen_variants(bgenView, sample_mask, chunk_size, p, bgen_pass, n_var_parsed, want_codes, qc, keep_variant);
+	}, G, n_samples, chunk_size, p);
+}
+
+bool fileUtils::read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
+                                Eigen::MatrixXd &G,
+                                const SampleMask &sample_mask,
+                                const long &n_samples,
+                                const long &chunk_size,
+                                const parameters &p,
+                                bool &bgen_pass,
+                                long &n_var_parsed,
+                                std::vector<std::string>& SNPIDS,
+                                BgenQcSidecar* qc){
+	// Wrapper around BgenView to read in a 'chunk' of data. Remembers
+	// if last call hit the EOF, and returns false if so.
+
+	// Exit function if last call hit EOF.
+	if (!bgen_pass) return false;
+
+	return fill_bgen_chunk([&](const VariantFilter& keep_variant) {
+		decode_bgen_variants(bgenView, sample_mask, chunk_size, p, bgen_pass, n_var_parsed, false, qc, keep_variant);
+	}, G, n_samples, chunk_size, p, SNPIDS);
+}
+
+bool fileUtils::read_bgen_chunk(BgenStreamReader &reader,
+                                GenotypeMatrix &G,
+                                const long &n_samples,
+                                const long &chunk_size,
+                                const parameters &p,
+                                long &n_var_parsed){
+	// Next chunk from a background reader; returns false at EOF.
+	return fill_bgen_chunk([&](const VariantFilter& keep_variant) {
+		stream_bgen_variants(reader, chunk_size, n_var_parsed, keep_variant);
+	}, G, n_samples, chunk_size, p);
+}
+
+bool fileUtils::read_bgen_chunk(BgenStreamReader &reader,
+                                Eigen::MatrixXd &G,
+                                const long &n_samples,
+                                const long &chunk_size,
+                                const parameters &p,
+                                long &n_var_parsed,
+                                std::vector<std::string>& SNPIDS){
+	return fill_bgen_chunk([&](const VariantFilter& keep_variant) {
+		stream_bgen_variants(reader, chunk_size, n_var_parsed, keep_variant);
+	}, G, n_samples, chunk_size, p, SNPIDS);
+}
@@ -7,9 +7,11 @@
 
 #include "parameters.hpp"
 #include "genotype_matrix.hpp"
+#include "sample_mask.hpp"
 
 #include "genfile/bgen/bgen.hpp"
 #include "genfile/bgen/View.hpp"
+#include "genfile/bgen/IndexQuery.hpp"
 #include "tools/eigen3.3/Dense"
 
 #include <boost/iostreams/filtering_stream.hpp>
@@ -17,13 +19,21 @@
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/filesystem.hpp>
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iomanip>
+#include <map>
+#include <ostream>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
 namespace boost_io = boost::iostreams;
 
+class BgenStreamReader;
+class BgenQcSidecar;
+
 /***************** File writing *****************/
 namespace fileUtils {
 long long getValueRAM(const std::string& field = "VmRSS:");
@@ -48,14 +58,14 @@ void dump_predicted_vec_to_file(Eigen::Ref<Eigen::MatrixXd> mat,
                                 const std::string& header,
                                 const std::map<long, int>& sample_location);
 
-void write_snp_stats_to_file(boost_io::filtering_ostream &ofile,
+void write_snp_stats_to_file(std::ostream &ofile,
                              const int &n_effects,
                              const GenotypeMatrix &X,
                              const bool &append,
                              const Eigen::Ref<const Eigen::MatrixXd> &neglogPvals,
                              const Eigen::Ref<const Eigen::MatrixXd> &testStats);
 
-void write_snp_stats_to_file(boost_io::filtering_ostream &ofile, const int &n_effects,
+void write_snp_stats_to_file(std::ostream &ofile, const int &n_effects,
                              const GenotypeMatrix &X,
                              const bool &append,
                              const Eigen::Ref<const Eigen::VectorXd> &neglogp_beta,
@@ -65,7 +75,7 @@ void write_snp_stats_to_file(boost_io::filtering_ostream &ofile, const int &n_ef
                              const Eigen::Ref<const Eigen::VectorXd> &test_stat_gam,
                              const Eigen::Ref<const Eigen::VectorXd> &test_stat_rgam);
 
-void write_snp_stats_to_file(boost_io::filtering_ostream &ofile, const int &n_effects,
+void write_snp_stats_to_file(std::ostream &ofile, const int &n_effects,
                              const GenotypeMatrix &X,
                              const bool &append,
                              const Eigen::Ref<const Eigen::VectorXd> &neglogp_beta,
@@ -77,26 +87,99 @@ void write_snp_stats_to_file(boost_io::filtering_ostream &ofile, const int &n_ef
                              const Eigen::Ref<const Eigen::VectorXd> &test_stat_rgam,
                              const Eigen::Ref<const Eigen::VectorXd> &test_stat_joint);
 
-void read_bgen_metadata(const std::string& filename,
-                        std::vector<int>& chr);
+std::uint64_t hash_string(const std::string& str);
+
+// Incremental form of hash_string: start from fnv_offset_basis and feed
+// fields one at a time. Strings are prefixed by their length so that
+// adjacent fields cannot run into each other.
+const std::uint64_t fnv_offset_basis = 14695981039346656037ULL;
+
+void hash_bytes(std::uint64_t& hash, const void* data, const std::size_t& n_bytes);
+
+void hash_field(std::uint64_t& hash, const std::string& field);
+
+template <typename T>
+void hash_field(std::uint64_t& hash, const T& value){
+	hash_bytes(hash, &value, sizeof(T));
+}
+
+void write_genotype_cache(const std::string& filename,
+                          const std::uint64_t& key,
+                          const GenotypeMatrix& G);
+
+bool read_genotype_cache(const std::string& filename,
+                         const std::uint64_t& key,
+                         GenotypeMatrix& G);
+
+void write_xtx_block_cache(const std::string& filename,
+                           const std::uint64_t& key,
+                           const unsigned int& main_chunk_size,
+                           const unsigned int& gxe_chunk_size,
+                           const std::vector<std::size_t>& offsets,
+                           const std::vector<float>& arena);
+
+bool read_xtx_block_cache_chunk_sizes(const std::string& filename,
+                                      const std::uint64_t& key,
+                                      unsigned int& main_chunk_size,
+                                      unsigned int& gxe_chunk_size);
+
+bool read_xtx_block_cache(const std::string& filename,
+                          const std::uint64_t& key,
+                          const unsigned int& main_chunk_size,
+                          std::vector<std::size_t>& offsets,
+                          std::vector<float>& arena);
+
+void write_ztz_block_cache(const std::string& filename,
+                           const std::uint64_t& key,
+                           const std::map<long, Eigen::MatrixXd>& blocks);
+
+bool read_ztz_block_cache(const std::string& filename,
+                          const std::uint64_t& key,
+                          std::map<long, Eigen::MatrixXd>& blocks);
+
+void read_bgen_metadata(const std::string& bgi_file,
+                        const genfile::bgen::IndexQuery& query,
+                        std::vector<long>& chr_ends);
+
+void seek_bgen_variant(genfile::bgen::View::UniquePtr &bgenView,
+                       const std::string& bgi_file,
+                       const std::function<genfile::bgen::IndexQuery::UniquePtr()>& make_query,
+                       const long& first_variant);
 
 bool read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
                      GenotypeMatrix &G,
-                     const std::unordered_map<long, bool> &sample_is_invalid,
+                     const SampleMask &sample_mask,
                      const long &n_samples,
                      const long &chunk_size,
                      const parameters &p,
                      bool &bgen_pass,
-                     long &n_var_parsed);
+                     long &n_var_parsed,
+                     BgenQcSidecar* qc = nullptr);
 
 bool read_bgen_chunk(genfile::bgen::View::UniquePtr &bgenView,
                      Eigen::MatrixXd &G,
-                     const std::unordered_map<long, bool> &sample_is_invalid,
+                     const SampleMask &sample_mask,
                      const long &n_samples,
                      const long &chunk_size,
                      const parameters &p,
                      bool &bgen_pass,
                      long &n_var_parsed,
+                     std::vector<std::string> &SNPIDS,
+                     BgenQcSidecar* qc = nullptr);
+
+bool read_bgen_chunk(BgenStreamReader &reader,
+                     GenotypeMatrix &G,
+                     const long &n_samples,
+                     const long &chunk_size,
+                     const parameters &p,
+                     long &n_var_parsed);
+
+bool read_bgen_chunk(BgenStreamReader &reader,
+                     Eigen::MatrixXd &G,
+                     const long &n_samples,
+                     const long &chunk_size,
+                     const parameters &p,
+                     long &n_var_parsed,
                      std::vector<std::string> &SNPIDS);
 }
 
@@ -6,6 +6,7 @@
 #include "parameters.hpp"
 #include "typedefs.hpp"
 #include "mpi_utils.hpp"
+#include "parallel_utils.hpp"
 
 #include "tools/eigen3.3/Dense"
 #include <algorithm>
@@ -14,41 +15,209 @@
 #include <cstdint>
 #include <cmath>
 #include <random>
-#include <thread>
 #include <vector>
+#include <numeric>
 #include <map>
+#include <set>
 
 void GenotypeMatrix::assign_index(const long &ii, const long &jj, double x) {
 	if(low_mem) {
 		if(std::isnan(x)) {
 			throw std::runtime_error("ERROR: missing values not yet compatible in low-mem mode");
 		}
-		M(ii, jj) = CompressDosage(x);
+		if(col_is_sparse[jj]) {
+			throw std::runtime_error("ERROR: cannot assign to a variant already stored in sparse format");
+		}
+		set_code(ii, jj, CompressDosage(x, jj));
 	} else {
+		std::vector<std::uint64_t>& mask = missing_genos[jj];
+		std::uint64_t bit = (std::uint64_t) 1 << (ii % 64);
 		if(std::isnan(x)) {
-			missing_genos[jj][ii] = 1;
+			if(mask.empty()) {
+				mask.resize((nn + 63) / 64, 0);
+			}
+			mask[ii / 64] |= bit;
+			G(ii, jj) = 0.0;
 		} else {
+			if(!mask.empty()) {
+				mask[ii / 64] &= ~bit;
+			}
 			G(ii, jj) = x;
 		}
 	}
 	scaling_performed = false;
 }
 
-#ifdef DATA_AS_FLOAT
-#else
-void GenotypeMatrix::col(long jj, EigenRefDataVector vec) const {
+void GenotypeMatrix::assign_col(const long &jj, const Eigen::Ref<const Eigen::VectorXd> &dosage) {
+	assert(dosage.rows() == nn);
+	if(low_mem && n_bits == 4) {
+		// Spread the 16 codes over this variant's local dosage range
+		double lo = dosage.minCoeff(), hi = dosage.maxCoeff();
+		dosage_offset[jj] = lo;
+		dosage_scale[jj] = (hi - lo > 1e-9) ? (hi - lo) / codeMask : 1.0;
+	}
+	for (long ii = 0; ii < nn; ii++) {
+		assign_index(ii, jj, dosage[ii]);
+	}
+}
+
+void GenotypeMatrix::assign_codes(const long &jj, const std::uint8_t* codes) {
+	assert(low_mem && n_bits == 8);
+	if(col_is_sparse[jj]) {
+		throw std::runtime_error("ERROR: cannot assign to a variant already stored in sparse format");
+	}
+	std::copy(codes, codes + nn, M.col(col_index[jj]).data());
+	scaling_performed = false;
+}
+
+void GenotypeMatrix::col(long jj, Eigen::Ref<Eigen::VectorXd> vec) const {
 	assert(jj < pp);
 	assert(scaling_performed);
 
 	if(low_mem) {
-		vec = M.cast<double>().col(jj);
-		vec *= (intervalWidth * compressed_dosage_inv_sds[jj]);
-		vec.array() += (0.5 * intervalWidth - compressed_dosage_means[jj]) * compressed_dosage_inv_sds[jj];
+		decompress_col(jj, vec.data());
 	} else {
 		vec = G.col(jj);
 	}
 }
-#endif
+
+void GenotypeMatrix::col(long jj, Eigen::Ref<Eigen::VectorXf> vec) const {
+	assert(jj < pp);
+	assert(scaling_performed);
+
+	if(low_mem) {
+		decompress_col(jj, vec.data());
+	} else {
+		vec = G.col(jj).cast<float>();
+	}
+}
+
+template <typename T>
+void GenotypeMatrix::unpack_dense(long mm, long r0, long nr, T aa, T bb, T* __restrict__ dst) const {
+	// dst[ii] = aa * code(r0 + ii) + bb for column mm of M; r0 must sit on a
+	// byte boundary. Written as plain loops over raw pointers so that the
+	// compiler vectorises them for whichever instruction set we are built with.
+	assert(r0 % codesPerByte == 0);
+	const unsigned char* __restrict__ src = M.col(mm).data() + r0 / codesPerByte;
+	long n_full = nr / codesPerByte;
+	if(n_bits == 8) {
+		for (long ii = 0; ii < nr; ii++) {
+			dst[ii] = aa * src[ii] + bb;
+		}
+		return;
+	} else if(n_bits == 4) {
+		for (long kk = 0; kk < n_full; kk++) {
+			dst[2 * kk]     = aa * (src[kk] & 0x0F) + bb;
+			dst[2 * kk + 1] = aa * (src[kk] >> 4) + bb;
+		}
+	} else {
+		for (long kk = 0; kk < n_full; kk++) {
+			dst[4 * kk]     = aa * (src[kk] & 0x03) + bb;
+			dst[4 * kk + 1] = aa * ((src[kk] >> 2) & 0x03) + bb;
+			dst[4 * kk + 2] = aa * ((src[kk] >> 4) & 0x03) + bb;
+			dst[4 * kk + 3] = aa * (src[kk] >> 6) + bb;
+		}
+	}
+	for (long ii = n_full * codesPerByte; ii < nr; ii++) {
+		dst[ii] = aa * ((src[ii / codesPerByte] >> ((ii % codesPerByte) * n_bits)) & codeMask) + bb;
+	}
+}
+
+template <typename T>
+void GenotypeMatrix::unpack_col(long jj, long r0, long nr, T aa, T bb, T* dst) const {
+	// dst[ii] = aa * code(r0 + ii, jj) + bb
+	if(col_is_sparse[jj]) {
+		std::fill(dst, dst + nr, bb);
+		long kk = col_index[jj];
+		auto first = sparse_rows.begin() + sparse_col_ptr[kk];
+		auto last = sparse_rows.begin() + sparse_col_ptr[kk + 1];
+		for (auto it = std::lower_bound(first, last, r0); it != last && *it < r0 + nr; it++) {
+			dst[*it - r0] = aa * sparse_codes[it - sparse_rows.begin()] + bb;
+		}
+	} else {
+		unpack_dense(col_index[jj], r0, nr, aa, bb, dst);
+	}
+}
+
+template <typename T>
+void GenotypeMatrix::decompress_col(long jj, T* dst) const {
+	// Fused decompress + standardise in a single pass over M.col(jj);
+	// (DecompressDosage(m) - mean) * inv_sd == aa * m + bb.
+	const T aa = dosage_scale[jj] * compressed_dosage_inv_sds[jj];
+	const T bb = (dosage_offset[jj] - compressed_dosage_means[jj]) * compressed_dosage_inv_sds[jj];
+	unpack_col(jj, 0, nn, aa, bb, dst);
+}
+
+void GenotypeMatrix::decode_tile(long r0, long c0, long nr, long nc, EigenDataMatrix& tile) const {
+	// Raw codes of M[r0:r0+nr, c0:c0+nc]
+	tile.resize(nr, nc);
+	for (long cc = 0; cc < nc; cc++) {
+		unpack_dense<scalarData>(c0 + cc, r0, nr, 1, 0, tile.col(cc).data());
+	}
+}
+
+std::uint8_t GenotypeMatrix::get_code(const long &ii, const long &jj) const {
+	if(col_is_sparse[jj]) {
+		long kk = col_index[jj];
+		auto first = sparse_rows.begin() + sparse_col_ptr[kk];
+		auto last = sparse_rows.begin() + sparse_col_ptr[kk + 1];
+		auto it = std::lower_bound(first, last, ii);
+		return (it != last && *it == ii) ? sparse_codes[it - sparse_rows.begin()] : 0;
+	} else {
+		return (M(ii / codesPerByte, col_index[jj]) >> ((ii % codesPerByte) * n_bits)) & codeMask;
+	}
+}
+
+void GenotypeMatrix::compress_sparse_columns() {
+	// Move variants with few non-zero codes out of M into CSC storage, then
+	// compact the remaining dense columns to the front of M.
+	assert(sparse_vars.empty());
+	long max_nnz = (long) std::floor(params.max_sparse_density * nn);
+	long n_dense = 0;
+	std::vector<std::uint8_t> codes(panelRows);
+	dense_vars.clear();
+	for (long jj = 0; jj < pp; jj++) {
+		long mm = col_index[jj];
+		long nnz = 0;
+		for (long r0 = 0; r0 < nn; r0 += panelRows) {
+			long nr = std::min(panelRows, nn - r0);
+			unpack_dense<std::uint8_t>(mm, r0, nr, 1, 0, codes.data());
+			nnz += nr - std::count(codes.begin(), codes.begin() + nr, 0);
+		}
+
+		// Sparse entries cost a row index and a code each
+		long sparse_bytes = nnz * (sizeof(std::uint32_t) + 1);
+		if(nnz <= max_nnz && sparse_bytes < M.rows()) {
+			for (long r0 = 0; r0 < nn; r0 += panelRows) {
+				long nr = std::min(panelRows, nn - r0);
+				unpack_dense<std::uint8_t>(mm, r0, nr, 1, 0, codes.data());
+				for (long ii = 0; ii < nr; ii++) {
+					if(codes[ii] != 0) {
+						sparse_rows.push_back(r0 + ii);
+						sparse_codes.push_back(codes[ii]);
+					}
+				}
+			}
+			sparse_col_ptr.push_back(sparse_rows.size());
+			col_is_sparse[jj] = true;
+			col_index[jj] = sparse_vars.size();
+			sparse_vars.push_back(jj);
+		} else {
+			if(mm != n_dense) {
+				M.col(n_dense) = M.col(mm);
+			}
+			col_index[jj] = n_dense;
+			dense_vars.push_back(jj);
+			n_dense++;
+		}
+	}
+	M.conservativeResize(M.rows(), n_dense);
+
+	if(params.verbose && !sparse_vars.empty()) {
+		std::cout << "Storing " << sparse_vars.size() << " of " << pp;
+		std::cout << " variants in sparse format" << std::endl;
+	}
+}
 
 Eigen::MatrixXd GenotypeMatrix::transpose_multiply(EigenRefDataMatrix lhs) const {
 	// Return G^t lhs
@@ -60,16 +229,15 @@ Eigen::MatrixXd GenotypeMatrix::transpose_multiply(EigenRefDataMatrix lhs) const
 		Eigen::MatrixXd res;
 		Eigen::VectorXd colsums = lhs.colwise().sum().matrix().cast<double>();
 
-		// Diagnostic messages as worried about RAM
+		// Decompress M one tile at a time; threads own disjoint column panels
 		Eigen::MatrixXd Mt_lhs(pp, lhs.cols());
-		for (int ll = 0; ll < lhs.cols(); ll++) {
-			EigenRefDataVector tmp = lhs.col(ll);
-			Mt_lhs.col(ll) = tmp.cast<double>().transpose() * M.cast<double>();
-		}
+		std::vector<std::vector<long> > panel_chunks = partition_panels(n_panels());
+		parallelUtils::parallel_for(panel_chunks.size(), [this, &panel_chunks, &lhs, &Mt_lhs](long tt) {
+			lowmem_panel_transpose_multiply(panel_chunks[tt], lhs, Mt_lhs);
+		});
 
-		res = intervalWidth * (compressed_dosage_inv_sds.asDiagonal() * Mt_lhs);
-		res += 0.5 * intervalWidth * compressed_dosage_inv_sds * colsums.transpose();
-		res -= compressed_dosage_inv_sds.cwiseProduct(compressed_dosage_means) * colsums.transpose();
+		res = dosage_scale.cwiseProduct(compressed_dosage_inv_sds).asDiagonal() * Mt_lhs;
+		res += (dosage_offset - compressed_dosage_means).cwiseProduct(compressed_dosage_inv_sds) * colsums.transpose();
 		if(params.debug) std::cout << "Ending transpose multiply" << std::endl;
 		return res;
 	} else {
@@ -84,30 +252,167 @@ Eigen::VectorXd GenotypeMatrix::mult_vector_by_chr(const long& chr, const Eigen:
 		calc_scaled_values();
 	}
 
-	// Find chr block
-	// Chromosomes read via bgen guaranteed to be ordered in blocks
-	std::vector<int> tmp;
-	tmp.push_back(chr);
-	auto it_start = std::find(chromosome.begin(), chromosome.end(), chr);
-	auto it_end = std::find_end(chromosome.begin(), chromosome.end(), tmp.begin(), tmp.end());
-	long chr_st, chr_en, chr_size;
-	chr_st = it_start - chromosome.begin();
-	chr_en = it_end - chromosome.begin();
-	chr_size = chr_en - chr_st + 1;
+	long chr_idx = chr_index(chr);
+	long chr_st = chr_offsets[chr_idx], chr_size = chr_offsets[chr_idx + 1] - chr_st;
 
-	Eigen::VectorXd res;
 	if(low_mem) {
 		Eigen::VectorXd rhs_trans = rhs.cwiseProduct(compressed_dosage_inv_sds);
-		auto offset = rhs_trans.segment(chr_st, chr_size).sum() * intervalWidth * 0.5;
-		offset -= compressed_dosage_means.segment(chr_st, chr_size).dot(rhs_trans.segment(chr_st, chr_size));
+		double offset = (dosage_offset - compressed_dosage_means).segment(chr_st, chr_size).dot(rhs_trans.segment(chr_st, chr_size));
+		EigenDataVector rhs_scaled = rhs_trans.cwiseProduct(dosage_scale).cast<scalarData>();
+
+		// Dense and sparse variants of chr are contiguous in each store;
+		// threads own disjoint blocks of rows
+		Eigen::VectorXd res = Eigen::VectorXd::Zero(nn);
+		long m_st = std::lower_bound(dense_vars.begin(), dense_vars.end(), chr_st) - dense_vars.begin();
+		long m_en = std::lower_bound(dense_vars.begin(), dense_vars.end(), chr_st + chr_size) - dense_vars.begin();
+		long n_row_blocks = (nn + panelRows - 1) / panelRows;
+		std::vector<std::vector<long> > row_chunks = partition_panels(n_row_blocks);
+		parallelUtils::parallel_for(row_chunks.size(), [&](long tt) {
+			EigenDataMatrix tile;
+			EigenDataVector rhs_panel;
+			for (const auto& bb : row_chunks[tt]) {
+				long r0 = bb * panelRows;
+				long nr = std::min(panelRows, nn - r0);
+				for (long c0 = m_st; c0 < m_en; c0 += panelCols) {
+					long nc = std::min(panelCols, m_en - c0);
+					rhs_panel.resize(nc);
+					for (long cc = 0; cc < nc; cc++) {
+						rhs_panel[cc] = rhs_scaled[dense_vars[c0 + cc]];
+					}
+					decode_tile(r0, c0, nr, nc, tile);
+					res.segment(r0, nr) += (tile * rhs_panel).cast<double>();
+				}
+			}
+		});
 
-		res = M.block(0, chr_st, nn, chr_size).cast<double>() * rhs_trans.segment(chr_st, chr_size);
-		return (res.array() * intervalWidth + offset).matrix();
+		long k_st = std::lower_bound(sparse_vars.begin(), sparse_vars.end(), chr_st) - sparse_vars.begin();
+		long k_en = std::lower_bound(sparse_vars.begin(), sparse_vars.end(), chr_st + chr_size) - sparse_vars.begin();
+		for (long kk = k_st; kk < k_en; kk++) {
+			for (long ptr = sparse_col_ptr[kk]; ptr < sparse_col_ptr[kk + 1]; ptr++) {
+				res[sparse_rows[ptr]] += sparse_codes[ptr] * rhs_scaled[sparse_vars[kk]];
+			}
+		}
+		return (res.array() + offset).matrix();
 	} else {
 		return G.block(0, chr_st, nn, chr_size).cast<double>() * rhs.segment(chr_st, chr_size);
 	}
 }
 
+std::vector<Eigen::MatrixXd> GenotypeMatrix::mult_by_chr(const Eigen::Ref<const Eigen::MatrixXd> &rhs) const {
+	// Predictions for chromosome cc and rhs column ll are computed in column
+	// cc * n_rhs + ll of res_all, then split out at the end.
+	assert(rhs.rows() == pp);
+	assert(scaling_performed);
+	long n_rhs = rhs.cols();
+	long n_chrs = chr_ids.size();
+	Eigen::MatrixXd res_all(nn, n_chrs * n_rhs);
+
+	if(low_mem) {
+		Eigen::MatrixXd rhs_trans = compressed_dosage_inv_sds.asDiagonal() * rhs;
+		EigenDataMatrix rhs_scaled = (dosage_scale.asDiagonal() * rhs_trans).cast<scalarData>();
+
+		// Chromosome index of each variant
+		std::vector<long> var_chr(pp);
+		for (long cc = 0; cc < n_chrs; cc++) {
+			std::fill(var_chr.begin() + chr_offsets[cc], var_chr.begin() + chr_offsets[cc + 1], cc);
+		}
+
+		// Threads own disjoint blocks of rows, so each sweeps M once
+		long n_row_blocks = (nn + panelRows - 1) / panelRows;
+		std::vector<std::vector<long> > row_chunks = partition_panels(n_row_blocks);
+		auto sweep_rows = [&](const std::vector<long>& row_blocks) {
+			EigenDataMatrix tile, rhs_panel;
+			for (const auto& bb : row_blocks) {
+				long r0 = bb * panelRows;
+				long nr = std::min(panelRows, nn - r0);
+				EigenDataMatrix res_rows = EigenDataMatrix::Zero(nr, n_chrs * n_rhs);
+
+				// Dense panels span at most a few chromosomes
+				long n_dense = dense_vars.size();
+				for (long c0 = 0; c0 < n_dense; c0 += panelCols) {
+					long nc = std::min(panelCols, n_dense - c0);
+					long ch_lo = var_chr[dense_vars[c0]];
+					long ch_hi = var_chr[dense_vars[c0 + nc - 1]];
+					rhs_panel = EigenDataMatrix::Zero(nc, (ch_hi - ch_lo + 1) * n_rhs);
+					for (long cc = 0; cc < nc; cc++) {
+						long jj = dense_vars[c0 + cc];
+						rhs_panel.block(cc, (var_chr[jj] - ch_lo) * n_rhs, 1, n_rhs) = rhs_scaled.row(jj);
+					}
+					decode_tile(r0, c0, nr, nc, tile);
+					res_rows.middleCols(ch_lo * n_rhs, rhs_panel.cols()).noalias() += tile * rhs_panel;
+				}
+
+				for (long kk = 0; kk < sparse_vars.size(); kk++) {
+					long jj = sparse_vars[kk];
+					auto first = sparse_rows.begin() + sparse_col_ptr[kk];
+					auto last = sparse_rows.begin() + sparse_col_ptr[kk + 1];
+					for (auto it = std::lower_bound(first, last, r0); it != last && *it < r0 + nr; it++) {
+						res_rows.block(*it - r0, var_chr[jj] * n_rhs, 1, n_rhs) +=
+						    (scalarData) sparse_codes[it - sparse_rows.begin()] * rhs_scaled.row(jj);
+					}
+				}
+				res_all.middleRows(r0, nr) = res_rows.cast<double>();
+			}
+		};
+		parallelUtils::parallel_for(row_chunks.size(), [&sweep_rows, &row_chunks](long tt) {
+			sweep_rows(row_chunks[tt]);
+		});
+
+		// Mean / inv-sd correction
+		Eigen::VectorXd offset = dosage_offset - compressed_dosage_means;
+		for (long cc = 0; cc < n_chrs; cc++) {
+			long chr_st = chr_offsets[cc], chr_size = chr_offsets[cc + 1] - chr_offsets[cc];
+			Eigen::RowVectorXd chr_offset = offset.segment(chr_st, chr_size).transpose() * rhs_trans.middleRows(chr_st, chr_size);
+			res_all.middleCols(cc * n_rhs, n_rhs).rowwise() += chr_offset;
+		}
+	} else {
+		for (long cc = 0; cc < n_chrs; cc++) {
+			long chr_st = chr_offsets[cc], chr_size = chr_offsets[cc + 1] - chr_offsets[cc];
+			res_all.middleCols(cc * n_rhs, n_rhs) = G.middleCols(chr_st, chr_size).cast<double>() * rhs.middleRows(chr_st, chr_size);
+		}
+	}
+
+	std::vector<Eigen::MatrixXd> res(n_rhs, Eigen::MatrixXd(nn, n_chrs));
+	for (long ll = 0; ll < n_rhs; ll++) {
+		for (long cc = 0; cc < n_chrs; cc++) {
+			res[ll].col(cc) = res_all.col(cc * n_rhs + ll);
+		}
+	}
+	return res;
+}
+
+void GenotypeMatrix::compute_chr_offsets() {
+	// One block per run of variants on the same chromosome; see
+	// chrs_contiguous() for input where a chromosome is split
+	chr_ids.clear();
+	chr_offsets.clear();
+	for (long jj = 0; jj < pp; jj++) {
+		if(jj == 0 || chromosome[jj] != chromosome[jj - 1]) {
+			chr_ids.push_back(chromosome[jj]);
+			chr_offsets.push_back(jj);
+		}
+	}
+	chr_offsets.push_back(pp);
+}
+
+bool GenotypeMatrix::chrs_contiguous() const {
+	std::set<int> seen;
+	for (long jj = 0; jj < pp; jj++) {
+		if(jj == 0 || chromosome[jj] != chromosome[jj - 1]) {
+			if(!seen.insert(chromosome[jj]).second) return false;
+		}
+	}
+	return true;
+}
+
+long GenotypeMatrix::chr_index(const long &chr) const {
+	auto it = std::find(chr_ids.begin(), chr_ids.end(), chr);
+	if(it == chr_ids.end()) {
+		throw std::runtime_error("ERROR: chromosome " + std::to_string(chr) + " not found");
+	}
+	return it - chr_ids.begin();
+}
+
 template<typename Deriv>
 void GenotypeMatrix::col_block3(const std::vector<long> &chunk,
                                 Eigen::MatrixBase<Deriv> &D) const {
@@ -115,13 +420,16 @@ void GenotypeMatrix::col_block3(const std::vector<long> &chunk,
 
 	// Partition jobs amongst threads
 	long ch_len = chunk.size();
-	std::vector<long> index;
+	long n_thread = std::max(1L, std::min((long) params.n_thread, ch_len));
+	std::vector<std::vector<long> > indexes(n_thread);
 	for (long ii = 0; ii < ch_len; ii++) {
-		index.push_back(ii);
+		indexes[ii % n_thread].push_back(ii);
 	}
 
-	// Decompress char -> double
-	get_cols(index, chunk, D);
+	// Decompress char -> scalarData
+	parallelUtils::parallel_for(n_thread, [this, &indexes, &chunk, &D](long tt) {
+		get_cols(indexes[tt], chunk, D);
+	});
 }
 
 template<typename Deriv>
@@ -131,13 +439,16 @@ void GenotypeMatrix::get_cols(const std::vector<long> &index,
 	// D.col(ii) = X.col(chunk(ii))
 	for(const auto& ii : index ) {
 		long jj = (iter_chunk[ii] % pp);
-//			D.col(ii) = col(jj);
 		col(jj, D.col(ii));
 	}
 }
 
 void GenotypeMatrix::calc_scaled_values() {
+	compute_chr_offsets();
 	if (low_mem) {
+		if(params.max_sparse_density > 0 && sparse_vars.empty()) {
+			compress_sparse_columns();
+		}
 		compute_means_and_sd();
 	} else {
 		standardise_matrix();
@@ -149,33 +460,47 @@ void GenotypeMatrix::compute_means_and_sd() {
 	double Nlocal = nn;
 	double Nglobal = mpiUtils::mpiReduce_inplace(&Nlocal);
 
-	// Column means
-	for (Index jj = 0; jj < pp; jj++) {
-		double sum_mij = 0;
-		compressed_dosage_means[jj] = 0;
-		for (Index ii = 0; ii < nn; ii++) {
-			sum_mij += DecompressDosage(M(ii, jj));
+	// Single pass over M; exact sums of codes m and m^2 per column, converted
+	// to sums of dosage x = m * scale + offset (decoding may differ by rank)
+	Eigen::MatrixXd sums(2, pp);
+	long n_thread = std::max(1L, std::min((long) params.n_thread, (long) pp));
+	parallelUtils::parallel_for(n_thread, [this, n_thread, &sums](long tt) {
+		std::vector<double> codes(panelRows);
+		for (long jj = tt; jj < pp; jj += n_thread) {
+			double s1 = 0, s2 = 0;
+			if(col_is_sparse[jj]) {
+				long kk = col_index[jj];
+				for (long ptr = sparse_col_ptr[kk]; ptr < sparse_col_ptr[kk + 1]; ptr++) {
+					s1 += sparse_codes[ptr];
+					s2 += sparse_codes[ptr] * sparse_codes[ptr];
+				}
+			} else {
+				for (long r0 = 0; r0 < nn; r0 += panelRows) {
+					long nr = std::min(panelRows, nn - r0);
+					unpack_dense<double>(col_index[jj], r0, nr, 1, 0, codes.data());
+					for (long ii = 0; ii < nr; ii++) {
+						s1 += codes[ii];
+						s2 += codes[ii] * codes[ii];
+					}
+				}
+			}
+			double aa = dosage_scale[jj], bb = dosage_offset[jj];
+			sums(0, jj) = aa * s1 + bb * nn;
+			sums(1, jj) = aa * aa * s2 + 2 * aa * bb * s1 + bb * bb * nn;
 		}
-		sum_mij = mpiUtils::mpiReduce_inplace(&sum_mij);
-		compressed_dosage_means[jj] = sum_mij / Nglobal;
-	}
+	});
 
+	// One allreduce for all columns
+	sums = mpiUtils::mpiReduce_inplace(sums);
 
-	// Column standard deviation
-	double val, sigma;
+	double sigma;
 	for (Index jj = 0; jj < pp; jj++) {
-		sigma = 0;
-		for (Index ii = 0; ii < nn; ii++) {
-			val = DecompressDosage(M(ii, jj)) - compressed_dosage_means[jj];
-			sigma += val * val;
-		}
-		sigma = mpiUtils::mpiReduce_inplace(&sigma);
-		compressed_dosage_sds[jj] = std::sqrt(sigma / (Nglobal - 1));
+		double mu = sums(0, jj) / Nglobal;
+		compressed_dosage_means[jj] = mu;
+		sigma = std::max(0.0, sums(1, jj) - Nglobal * mu * mu) / (Nglobal - 1);
+		compressed_dosage_sds[jj] = std::sqrt(sigma);
 	}
 
-//	compressed_dosage_sds /= ((double) nn - 1.0);
-//	compressed_dosage_sds = compressed_dosage_sds.array().sqrt().matrix();
-
 	for (Index jj = 0; jj < pp; jj++) {
 		sigma = compressed_dosage_sds[jj];
 		if (sigma > 1e-9) {
@@ -188,50 +513,79 @@ void GenotypeMatrix::compute_means_and_sd() {
 
 void GenotypeMatrix::standardise_matrix() {
 	assert(!low_mem);
-	for (std::size_t k = 0; k < pp; k++) {
-		double mu = 0.0;
-		double count = 0;
-		for (std::size_t i = 0; i < nn; i++) {
-			if (missing_genos[k].count(i) == 0) {
-				mu += G(i, k);
-				count += 1;
-			}
+	long n_thread = std::max(1L, std::min((long) params.n_thread, (long) pp));
+	parallelUtils::parallel_for(n_thread, [this, n_thread](long tt) {
+		for (long kk = tt; kk < pp; kk += n_thread) {
+			standardise_col(kk);
 		}
+	});
+}
 
-		mu = mu / count;
-		double val, sigma = 0.0;
-		for (std::size_t i = 0; i < nn; i++) {
-			if (missing_genos[k].count(i) == 0) {
-				G(i, k) -= mu;
-				val = G(i, k);
-				sigma += val * val;
-			} else {
-				G(i, k) = 0.0;
+void GenotypeMatrix::standardise_col(const long& kk) {
+	// Missing entries are held at zero by assign_index, so full column sums
+	// are valid; only the missing entries need resetting after centering.
+	const std::vector<std::uint64_t>& mask = missing_genos[kk];
+	long n_missing = 0;
+	for (const auto& word : mask) {
+		n_missing += std::bitset<64>(word).count();
+	}
+	double count = nn - n_missing;
+
+	double mu = G.col(kk).sum() / count;
+	G.col(kk).array() -= (scalarData) mu;
+	for (long ww = 0; ww < mask.size(); ww++) {
+		std::uint64_t word = mask[ww];
+		for (long bb = 0; word != 0; bb++, word >>= 1) {
+			if(word & 1) {
+				G(ww * 64 + bb, kk) = 0.0;
 			}
 		}
+	}
 
-		sigma = sqrt(sigma/(count - 1));
-		if (sigma > 1e-12) {
-			for (std::size_t i = 0; i < nn; i++) {
-				G(i, k) /= sigma;
-			}
-		}
+	double sigma = std::sqrt(G.col(kk).squaredNorm() / (count - 1));
+	if (sigma > 1e-12) {
+		G.col(kk) /= (scalarData) sigma;
 	}
 }
 
 void GenotypeMatrix::resize(const long &n, const long &p) {
 	if(low_mem) {
-		M.resize(n, p);
+		M.resize(packed_rows(n), p);
+		if(n_bits < 8) {
+			M.setZero();
+		}
 	} else {
 		G.resize(n, p);
 	}
+
+	// All variants start out dense, in place
+	reset_col_index(p);
+
+	// Default decoding; the 4-bit tier refits per variant in assign_col
+	dosage_scale.resize(p);
+	dosage_offset.resize(p);
+	if(n_bits == 8) {
+		dosage_scale.setConstant(intervalWidth);
+		dosage_offset.setConstant(0.5 * intervalWidth);
+	} else if(n_bits == 4) {
+		dosage_scale.setConstant(L / codeMask);
+		dosage_offset.setZero();
+	} else {
+		dosage_scale.setOnes();
+		dosage_offset.setZero();
+	}
 	compressed_dosage_means.resize(p);
 	compressed_dosage_sds.resize(p);
 	compressed_dosage_inv_sds.resize(p);
+	missing_genos.clear();
 	missing_genos.resize(p);
 	nn = n;
 	pp = p;
 
+	al_0.clear();
+	al_1.clear();
+	rsid.clear();
+	SNPID.clear();
 	al_0.resize(p);
 	al_1.resize(p);
 	maf.resize(p);
@@ -239,7 +593,6 @@ void GenotypeMatrix::resize(const long &n, const long &p) {
 	rsid.resize(p);
 	chromosome.resize(p);
 	position.resize(p);
-	SNPKEY.resize(p);
 	SNPID.resize(p);
 }
 
@@ -247,32 +600,39 @@ void GenotypeMatrix::move_variant(std::uint32_t old_index, std::uint32_t new_ind
 	// If shuffle variants + assoicated information left if we decide to
 	// exclude from analysis.
 	assert(new_index < old_index);
+	assert(sparse_vars.empty());
 
 	if(low_mem) {
 		M.col(new_index) = M.col(old_index);
+		dosage_scale[new_index] = dosage_scale[old_index];
+		dosage_offset[new_index] = dosage_offset[old_index];
 	} else {
 		G.col(new_index) = G.col(old_index);
+		missing_genos[new_index] = missing_genos[old_index];
 	}
 
 //		std::cout << "Moving " << rsid[old_index] << " from " << old_index << " to " << new_index << std::endl;
 
-	al_0[new_index]       = al_0[old_index];
-	al_1[new_index]       = al_1[old_index];
+	al_0.move(old_index, new_index);
+	al_1.move(old_index, new_index);
 	maf[new_index]        = maf[old_index];
 	info[new_index]       = info[old_index];
-	rsid[new_index]       = rsid[old_index];
+	rsid.move(old_index, new_index);
 	chromosome[new_index] = chromosome[old_index];
-	position[new_index]   = position[new_index];
-	SNPKEY[new_index]     = SNPKEY[old_index];
-	SNPID[new_index]      = SNPID[old_index];
+	position[new_index]   = position[old_index];
+	SNPID.move(old_index, new_index);
 }
 
 void GenotypeMatrix::conservativeResize(const long &n, const long &p) {
+	assert(sparse_vars.empty());
 	if(low_mem) {
-		M.conservativeResize(n, p);
+		M.conservativeResize(packed_rows(n), p);
 	} else {
 		G.conservativeResize(n, p);
 	}
+	reset_col_index(p);
+	dosage_scale.conservativeResize(p);
+	dosage_offset.conservativeResize(p);
 	compressed_dosage_means.conservativeResize(p);
 	compressed_dosage_sds.conservativeResize(p);
 	compressed_dosage_inv_sds.conservativeResize(p);
@@ -287,7 +647,6 @@ void GenotypeMatrix::conservativeResize(const long &n, const long &p) {
 	rsid.resize(p);
 	chromosome.resize(p);
 	position.resize(p);
-	SNPKEY.resize(p);
 	SNPID.resize(p);
 }
 
@@ -297,9 +656,7 @@ Eigen::VectorXd GenotypeMatrix::col(long jj) const {
 	Eigen::VectorXd vec(nn);
 
 	if(low_mem) {
-		vec = M.cast<double>().col(jj);
-		vec *= (intervalWidth * compressed_dosage_inv_sds[jj]);
-		vec.array() += (0.5 * intervalWidth - compressed_dosage_means[jj]) * compressed_dosage_inv_sds[jj];
+		decompress_col(jj, vec.data());
 	} else {
 		vec = G.col(jj);
 	}
@@ -311,29 +668,140 @@ EigenDataMatrix GenotypeMatrix::operator*(EigenRefDataMatrix rhs) const {
 	assert(rhs.rows() == pp);
 
 	if(low_mem) {
-		EigenDataMatrix res(nn, rhs.cols());
-		for (int ll = 0; ll < rhs.cols(); ll++) {
-			EigenRefDataVector tmp = rhs.col(ll);
-			res.col(ll) = M.cast<scalarData>() * compressed_dosage_inv_sds.cast<scalarData>().asDiagonal() * tmp.cast<scalarData>();
+		// Fold interval width and inv-sd scaling into rhs once
+		EigenDataMatrix rhs_scaled = dosage_scale.cwiseProduct(compressed_dosage_inv_sds).cast<scalarData>().asDiagonal() * rhs;
+
+		// Each thread accumulates the contribution of its column panels
+		std::vector<std::vector<long> > panel_chunks = partition_panels(n_panels());
+		std::vector<EigenDataMatrix> res_local(panel_chunks.size());
+		parallelUtils::parallel_for(panel_chunks.size(), [this, &panel_chunks, &rhs_scaled, &res_local](long tt) {
+			lowmem_panel_multiply(panel_chunks[tt], rhs_scaled, res_local[tt]);
+		});
+		EigenDataMatrix res = std::move(res_local[0]);
+		for (long tt = 1; tt < res_local.size(); tt++) {
+			res += res_local[tt];
 		}
-		res *= intervalWidth;
-		// res = M.cast<scalarData>() * compressed_dosage_inv_sds.cast<scalarData>().asDiagonal() * rhs * intervalWidth;
-		res.array().rowwise() += (compressed_dosage_inv_sds.cast<scalarData>().asDiagonal() * rhs).array().colwise().sum() * intervalWidth * 0.5;
-		res.array().rowwise() -= (compressed_dosage_inv_sds.cast<scalarData>().cwiseProduct(compressed_dosage_means.cast<scalarData>()).asDiagonal() * rhs).array().colwise().sum();
+
+		// Mean / inv-sd correction
+		EigenDataVector offset = (dosage_offset - compressed_dosage_means).cwiseProduct(compressed_dosage_inv_sds).cast<scalarData>();
+		res.array().rowwise() += (offset.transpose() * rhs).array();
 		return res;
 	} else {
 		return G * rhs;
 	}
 }
 
+void GenotypeMatrix::lowmem_panel_multiply(const std::vector<long>& panel_index,
+                                           const Eigen::Ref<const EigenDataMatrix>& rhs_scaled,
+                                           EigenDataMatrix& res) const {
+	// res = X[, panels] * rhs_scaled[panels, ] with raw codes for X
+	res = EigenDataMatrix::Zero(nn, rhs_scaled.cols());
+	long n_dense = dense_vars.size(), n_sparse = sparse_vars.size();
+	long n_dense_panels = (n_dense + panelCols - 1) / panelCols;
+	EigenDataMatrix tile, rhs_panel;
+	for (const auto& ii : panel_index) {
+		if(ii < n_dense_panels) {
+			long c0 = ii * panelCols;
+			long nc = std::min(panelCols, n_dense - c0);
+			rhs_panel.resize(nc, rhs_scaled.cols());
+			for (long cc = 0; cc < nc; cc++) {
+				rhs_panel.row(cc) = rhs_scaled.row(dense_vars[c0 + cc]);
+			}
+			for (long r0 = 0; r0 < nn; r0 += panelRows) {
+				long nr = std::min(panelRows, nn - r0);
+				decode_tile(r0, c0, nr, nc, tile);
+				res.middleRows(r0, nr).noalias() += tile * rhs_panel;
+			}
+		} else {
+			long k0 = (ii - n_dense_panels) * panelCols;
+			long k1 = std::min(k0 + panelCols, n_sparse);
+			for (long kk = k0; kk < k1; kk++) {
+				long jj = sparse_vars[kk];
+				for (long ptr = sparse_col_ptr[kk]; ptr < sparse_col_ptr[kk + 1]; ptr++) {
+					res.row(sparse_rows[ptr]) += (scalarData) sparse_codes[ptr] * rhs_scaled.row(jj);
+				}
+			}
+		}
+	}
+}
+
+void GenotypeMatrix::lowmem_panel_transpose_multiply(const std::vector<long>& panel_index,
+                                                     const Eigen::Ref<const EigenDataMatrix>& lhs,
+                                                     Eigen::Ref<Eigen::MatrixXd> res) const {
+	// res[panels, ] = X[, panels]^t * lhs with raw codes for X
+	long n_dense = dense_vars.size(), n_sparse = sparse_vars.size();
+	long n_dense_panels = (n_dense + panelCols - 1) / panelCols;
+	EigenDataMatrix tile, res_panel;
+	Eigen::Matrix<scalarData, 1, Eigen::Dynamic> res_row;
+	for (const auto& ii : panel_index) {
+		if(ii < n_dense_panels) {
+			long c0 = ii * panelCols;
+			long nc = std::min(panelCols, n_dense - c0);
+			res_panel = EigenDataMatrix::Zero(nc, lhs.cols());
+			for (long r0 = 0; r0 < nn; r0 += panelRows) {
+				long nr = std::min(panelRows, nn - r0);
+				decode_tile(r0, c0, nr, nc, tile);
+				res_panel.noalias() += tile.transpose() * lhs.middleRows(r0, nr);
+			}
+			for (long cc = 0; cc < nc; cc++) {
+				res.row(dense_vars[c0 + cc]) = res_panel.row(cc).cast<double>();
+			}
+		} else {
+			long k0 = (ii - n_dense_panels) * panelCols;
+			long k1 = std::min(k0 + panelCols, n_sparse);
+			for (long kk = k0; kk < k1; kk++) {
+				res_row = Eigen::Matrix<scalarData, 1, Eigen::Dynamic>::Zero(lhs.cols());
+				for (long ptr = sparse_col_ptr[kk]; ptr < sparse_col_ptr[kk + 1]; ptr++) {
+					res_row += (scalarData) sparse_codes[ptr] * lhs.row(sparse_rows[ptr]);
+				}
+				res.row(sparse_vars[kk]) = res_row.cast<double>();
+			}
+		}
+	}
+}
+
+long GenotypeMatrix::n_panels() const {
+	// Dense panels of M first, then blocks of sparse columns
+	long n_dense_panels = (dense_vars.size() + panelCols - 1) / panelCols;
+	long n_sparse_panels = (sparse_vars.size() + panelCols - 1) / panelCols;
+	return n_dense_panels + n_sparse_panels;
+}
+
+void GenotypeMatrix::reset_col_index(const long &p) {
+	dense_vars.resize(p);
+	std::iota(dense_vars.begin(), dense_vars.end(), 0);
+	col_index = dense_vars;
+	col_is_sparse.assign(p, false);
+	sparse_vars.clear();
+	sparse_col_ptr.assign(1, 0);
+	sparse_rows.clear();
+	sparse_codes.clear();
+}
+
+std::vector<std::vector<long> > GenotypeMatrix::partition_panels(long n_panels) const {
+	// Deal column panels out to threads round robin
+	long n_thread = std::max(1L, std::min((long) params.n_thread, n_panels));
+	std::vector<std::vector<long> > chunks(n_thread);
+	for (long ii = 0; ii < n_panels; ii++) {
+		chunks[ii % n_thread].push_back(ii);
+	}
+	return chunks;
+}
 
 // No need to call this TemporaryFunction() function,
 // it's just to avoid link error.
 void TemporaryFunctionGenotypeMatrix (){
 	std::vector<long> chunk;
 	EigenDataMatrix mat;
+	Eigen::MatrixXf mat_float;
 	parameters p;
 	GenotypeMatrix X(p, false);
 
 	X.col_block3(chunk, mat);
+	X.col_block3(chunk, mat_float);
+
+	auto mat_panel = mat.middleCols(0, 0);
+	auto mat_float_panel = mat_float.middleCols(0, 0);
+	X.col_block3(chunk, mat_panel);
+	X.col_block3(chunk, mat_float_panel);
 }
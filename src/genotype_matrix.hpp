@@ -3,6 +3,7 @@
 
 #include "parameters.hpp"
 #include "typedefs.hpp"
+#include "interned_strings.hpp"
 #include "tools/eigen3.3/Dense"
 #include <algorithm>
 #include <iostream>
@@ -13,6 +14,7 @@
 #include <random>
 #include <thread>
 #include <vector>
+#include <bitset>
 #include <map>
 
 // Memory efficient class for storing dosage data
@@ -27,6 +29,17 @@ class GenotypeMatrix {
 	const double invIntervalWidth = numCompressedIntervals / 2.0;
 	long nn, pp;
 
+	// Tile sizes for low-mem decompress-and-multiply kernels; a tile of
+	// panelRows x panelCols decompressed dosages should sit in L2 cache.
+	const long panelRows = 1024;
+	const long panelCols = 64;
+
+	// Low-mem storage tier; each dosage is held as an n_bits code, packed
+	// column-major into the bytes of M (8 / n_bits samples per byte).
+	const int n_bits;
+	const long codesPerByte;
+	const std::uint8_t codeMask;
+
 public:
 	const bool low_mem;
 	bool scaling_performed;
@@ -36,15 +49,31 @@ public:
 	EigenDataMatrix G;
 
 	std::vector<int> chromosome;
-	std::vector<std::string> al_0, al_1, rsid;
+	// Interned; resize() recycles their storage, conservativeResize() keeps it
+	InternedStrings al_0, al_1, rsid, SNPID;
 	std::vector<std::uint32_t> position;
 	std::vector<long> cumulative_pos;
+	// Chromosome chr_ids[cc] spans variants chr_offsets[cc] to chr_offsets[cc + 1] - 1
+	std::vector<int> chr_ids;
+	std::vector<long> chr_offsets;
 	std::vector<double> maf, info;
-	// chr~pos~a0~a1
-	std::vector< std::string > SNPKEY;
-	std::vector< std::string > SNPID;
 
-	std::vector<std::map<std::size_t, bool> > missing_genos;
+	// Low-mem decoding; dosage = code * dosage_scale[jj] + dosage_offset[jj]
+	Eigen::VectorXd dosage_scale;
+	Eigen::VectorXd dosage_offset;
+
+	// Low-mem variant jj is either dense, held in M.col(col_index[jj]), or
+	// sparse, held as the non-zero codes of CSC column col_index[jj].
+	// dense_vars and sparse_vars list the variants in each store, in order.
+	std::vector<long> col_index, dense_vars, sparse_vars;
+	std::vector<bool> col_is_sparse;
+	std::vector<long> sparse_col_ptr;
+	std::vector<std::uint32_t> sparse_rows;
+	std::vector<std::uint8_t> sparse_codes;
+
+	// Per-column bitmask of missing samples (bit ii % 64 of word ii / 64);
+	// left empty for columns without missing values.
+	std::vector<std::vector<std::uint64_t> > missing_genos;
 	Eigen::VectorXd compressed_dosage_means;
 	Eigen::VectorXd compressed_dosage_sds;
 	Eigen::VectorXd compressed_dosage_inv_sds;
@@ -53,14 +82,22 @@ public:
 	typedef Eigen::Index Index;
 
 	// Constructors
-	GenotypeMatrix(const parameters& my_params, const bool& use_low_mem) : low_mem(use_low_mem),
+	GenotypeMatrix(const parameters& my_params, const bool& use_low_mem) :
+		n_bits(use_low_mem ? my_params.genotype_bits : 8),
+		codesPerByte(8 / n_bits),
+		codeMask((1u << n_bits) - 1),
+		low_mem(use_low_mem),
 		params(my_params){
 		scaling_performed = false;
 		nn = 0;
 		pp = 0;
 	};
 
-	explicit GenotypeMatrix(const parameters& my_params) : low_mem(my_params.low_mem),
+	explicit GenotypeMatrix(const parameters& my_params) :
+		n_bits(my_params.low_mem ? my_params.genotype_bits : 8),
+		codesPerByte(8 / n_bits),
+		codeMask((1u << n_bits) - 1),
+		low_mem(my_params.low_mem),
 		params(my_params){
 		scaling_performed = false;
 		nn = 0;
@@ -74,6 +111,12 @@ public:
 	// Eigen element access
 	void assign_index(const long& ii, const long& jj, double x);
 
+	// Assign a whole column; lets the 4-bit tier fit a per-variant range
+	void assign_col(const long& jj, const Eigen::Ref<const Eigen::VectorXd>& dosage);
+
+	// Assign a whole column of precomputed 8-bit codes (low-mem, 8-bit tier)
+	void assign_codes(const long& jj, const std::uint8_t* codes);
+
 	/********** Output / Read access methods ************/
 
 	// Eigen element access
@@ -83,60 +126,19 @@ public:
 		}
 
 		if(low_mem) {
-			return (DecompressDosage(M(ii, jj)) - compressed_dosage_means[jj]) * compressed_dosage_inv_sds[jj];
+			return (DecompressDosage(get_code(ii, jj), jj) - compressed_dosage_means[jj]) * compressed_dosage_inv_sds[jj];
 		} else {
 			return G(ii, jj);
 		}
 	}
 
-#ifdef DATA_AS_FLOAT
-	// Eigen read column
-	Eigen::VectorXf col(long jj) const {
-		assert(jj < pp);
-		assert(scaling_performed);
-		Eigen::VectorXf vec(nn);
-
-		if(low_mem) {
-			vec = M.cast<float>().col(jj);
-			vec *= (intervalWidth * compressed_dosage_inv_sds[jj]);
-			vec.array() += (0.5 * intervalWidth - compressed_dosage_means[jj]) * compressed_dosage_inv_sds[jj];
-		} else {
-			vec = G.col(jj);
-		}
-		return vec;
-	}
-#else
 	// Eigen read column
 	Eigen::VectorXd col(long jj) const;
-#endif
 
-	// Eigen read column
-	void col(long jj, EigenRefDataVector vec) const;
+	// Eigen read column; single precision variant used by --mixed-precision
+	void col(long jj, Eigen::Ref<Eigen::VectorXd> vec) const;
 
-	// Eigen matrix multiplication
-#ifdef DATA_AS_FLOAT
-	// Eigen matrix multiplication
-	EigenDataMatrix operator*(Eigen::Ref<Eigen::MatrixXd> rhs) const {
-		assert(scaling_performed);
-		assert(rhs.rows() == pp);
-		if(low_mem) {
-			if(params.mode_debug) std::cout << "Starting low-mem matrix mult" << std::endl;
-			EigenDataMatrix res(nn, rhs.cols());
-			for (int ll = 0; ll < rhs.cols(); ll++) {
-				Eigen::Ref<Eigen::VectorXd> tmp = rhs.col(ll);
-				res.col(ll) = M.cast<scalarData>() * compressed_dosage_inv_sds.cast<scalarData>().asDiagonal() * tmp.cast<scalarData>();
-			}
-			res *= intervalWidth;
-			// res = M.cast<scalarData>() * compressed_dosage_inv_sds.cast<scalarData>().asDiagonal() * rhs.cast<scalarData>() * intervalWidth;
-			res.array().rowwise() += (compressed_dosage_inv_sds.cast<scalarData>().asDiagonal() * rhs.cast<scalarData>()).array().colwise().sum() * intervalWidth * 0.5;
-			res.array().rowwise() -= (compressed_dosage_inv_sds.cast<scalarData>().cwiseProduct(compressed_dosage_means.cast<scalarData>()).asDiagonal() * rhs.cast<scalarData>()).array().colwise().sum();
-			if(params.mode_debug) std::cout << "Ending low-mem matrix mult" << std::endl;
-			return res;
-		} else {
-			return G * rhs.cast<scalarData>();
-		}
-	}
-#endif
+	void col(long jj, Eigen::Ref<Eigen::VectorXf> vec) const;
 
 	// Eigen matrix multiplication
 	EigenDataMatrix operator*(EigenRefDataMatrix rhs) const;
@@ -146,6 +148,10 @@ public:
 	// Eigen lhs matrix multiplication
 	Eigen::VectorXd mult_vector_by_chr(const long& chr, const Eigen::Ref<const Eigen::VectorXd>& rhs);
 
+	// Per chromosome predictions for each column of rhs in a single sweep;
+	// res[ll].col(cc) = X[, chr_ids[cc]] * rhs[chr_ids[cc], ll]
+	std::vector<Eigen::MatrixXd> mult_by_chr(const Eigen::Ref<const Eigen::MatrixXd>& rhs) const;
+
 	template <typename Deriv>
 	void col_block3(const std::vector<long>& chunk,
 	                Eigen::MatrixBase<Deriv>& D) const;
@@ -155,6 +161,34 @@ public:
 	              const std::vector<long> &iter_chunk,
 	              Eigen::MatrixBase<Deriv>& D) const;
 
+	/********** Low-mem kernels; internal use ************/
+	template <typename T>
+	void unpack_dense(long mm, long r0, long nr, T aa, T bb, T* dst) const;
+
+	template <typename T>
+	void unpack_col(long jj, long r0, long nr, T aa, T bb, T* dst) const;
+
+	template <typename T>
+	void decompress_col(long jj, T* dst) const;
+
+	void decode_tile(long r0, long c0, long nr, long nc, EigenDataMatrix& tile) const;
+
+	void lowmem_panel_multiply(const std::vector<long>& panel_index,
+	                           const Eigen::Ref<const EigenDataMatrix>& rhs_scaled,
+	                           EigenDataMatrix& res) const;
+
+	void lowmem_panel_transpose_multiply(const std::vector<long>& panel_index,
+	                                     const Eigen::Ref<const EigenDataMatrix>& lhs,
+	                                     Eigen::Ref<Eigen::MatrixXd> res) const;
+
+	long n_panels() const;
+
+	std::vector<std::vector<long> > partition_panels(long n_panels) const;
+
+	void compress_sparse_columns();
+
+	void reset_col_index(const long& p);
+
 	/********** Mean center & unit variance; internal use ************/
 	void calc_scaled_values();
 
@@ -162,7 +196,16 @@ public:
 
 	void standardise_matrix();
 
+	void standardise_col(const long& kk);
+
 	/********** Utility functions ************/
+	void compute_chr_offsets();
+
+	// True if the variants of each chromosome form a single block
+	bool chrs_contiguous() const;
+
+	long chr_index(const long& chr) const;
+
 	void compute_cumulative_pos(){
 		cumulative_pos.resize(pp);
 		cumulative_pos[0] = position[0];
@@ -173,6 +216,11 @@ public:
 		}
 	}
 
+	// chr~pos~a0~a1
+	std::string snp_key(const long& jj) const {
+		return std::to_string(chromosome[jj]) + "~" + std::to_string(position[jj]) + "~" + al_0[jj] + "~" + al_1[jj];
+	}
+
 	inline Index rows() const {
 		return nn;
 	}
@@ -193,18 +241,34 @@ public:
 	}
 
 	/********** Compression/Decompression ************/
-	inline std::uint8_t CompressDosage(double dosage){
+	inline std::uint8_t CompressDosage(double dosage, const long& jj){
 		assert(dosage <= 2.0);
 		if(dosage > 2) {
 			std::cout << "WARNING: dosage = " << dosage << std::endl;
 		}
-		dosage = std::min(dosage, L - 1e-6);
-		return static_cast<std::uint8_t>(std::floor(dosage * invIntervalWidth));
+		if(n_bits == 8) {
+			dosage = std::min(dosage, L - 1e-6);
+			return static_cast<std::uint8_t>(std::floor(dosage * invIntervalWidth));
+		} else {
+			double code = std::round((dosage - dosage_offset[jj]) / dosage_scale[jj]);
+			return static_cast<std::uint8_t>(std::max(0.0, std::min(code, (double) codeMask)));
+		}
+	}
+
+	inline double DecompressDosage(std::uint8_t compressed_dosage, const long& jj) const {
+		return compressed_dosage * dosage_scale[jj] + dosage_offset[jj];
+	}
+
+	std::uint8_t get_code(const long& ii, const long& jj) const;
+
+	inline void set_code(const long& ii, const long& jj, std::uint8_t code){
+		long shift = (ii % codesPerByte) * n_bits;
+		std::uint8_t& byte = M(ii / codesPerByte, col_index[jj]);
+		byte = static_cast<std::uint8_t>((byte & ~(codeMask << shift)) | (code << shift));
 	}
 
-	inline double DecompressDosage(std::uint8_t compressed_dosage)
-	{
-		return (compressed_dosage + 0.5)*intervalWidth;
+	inline long packed_rows(const long& n) const {
+		return (n + codesPerByte - 1) / codesPerByte;
 	}
 };
 
@@ -0,0 +1,75 @@
+#include "interned_strings.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+InternedStrings::InternedStrings() {
+	// Id 0 is always the empty string
+	offsets.assign(2, 0);
+	rehash(16);
+}
+
+std::uint64_t InternedStrings::slot_of(const char* str, std::size_t len) const {
+	// Linear probe from the FNV-1a hash of str; returns the slot holding str
+	// or the first empty slot after it
+	std::uint64_t hash = 14695981039346656037ULL;
+	for (std::size_t ii = 0; ii < len; ii++) {
+		hash ^= static_cast<unsigned char>(str[ii]);
+		hash *= 1099511628211ULL;
+	}
+	std::uint64_t mask = slots.size() - 1;
+	std::uint64_t slot = hash & mask;
+	while (slots[slot] != 0 && !equals(slots[slot] - 1, str, len)) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+bool InternedStrings::equals(std::uint32_t id, const char* str, std::size_t len) const {
+	return offsets[id + 1] - offsets[id] == len &&
+	       std::memcmp(arena.data() + offsets[id], str, len) == 0;
+}
+
+void InternedStrings::rehash(std::size_t n_slots) {
+	slots.assign(n_slots, 0);
+	for (std::uint32_t id = 0; id + 1 < offsets.size(); id++) {
+		slots[slot_of(arena.data() + offsets[id], offsets[id + 1] - offsets[id])] = id + 1;
+	}
+}
+
+std::uint32_t InternedStrings::intern(const std::string& str) {
+	std::uint64_t slot = slot_of(str.data(), str.size());
+	if (slots[slot] != 0) {
+		return slots[slot] - 1;
+	}
+
+	std::uint32_t id = offsets.size() - 1;
+	arena.append(str);
+	offsets.push_back(arena.size());
+	slots[slot] = id + 1;
+
+	// Keep the load factor below 1/2
+	if (2 * offsets.size() > slots.size()) {
+		rehash(2 * slots.size());
+	}
+	return id;
+}
+
+long InternedStrings::lookup(const std::string& str) const {
+	std::uint64_t slot = slot_of(str.data(), str.size());
+	return (long) slots[slot] - 1;
+}
+
+long InternedStrings::find(const std::string& str) const {
+	long id = lookup(str);
+	if (id < 0) return -1;
+	auto it = std::find(ids.begin(), ids.end(), (std::uint32_t) id);
+	return (it == ids.end()) ? -1 : it - ids.begin();
+}
+
+void InternedStrings::clear() {
+	ids.clear();
+	arena.clear();
+	offsets.resize(2);
+	rehash(slots.size());
+}
@@ -0,0 +1,73 @@
+#ifndef LEMMA_INTERNED_STRINGS_HPP
+#define LEMMA_INTERNED_STRINGS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Column of per-variant strings (eg. rsid, alleles). Each distinct string is
+// stored once in a contiguous arena and variants hold a 4 byte id into it.
+// clear() keeps all capacity, so reusing the column across streamed chunks
+// does not allocate once the arena has grown to the size of a chunk.
+class InternedStrings {
+	// String kk spans arena[offsets[kk], offsets[kk + 1])
+	std::string arena;
+	std::vector<std::uint64_t> offsets;
+	// Open addressing hash table over the arena; holds string id + 1, 0 if empty
+	std::vector<std::uint32_t> slots;
+	// Per variant string ids
+	std::vector<std::uint32_t> ids;
+
+	std::uint64_t slot_of(const char* str, std::size_t len) const;
+
+	bool equals(std::uint32_t id, const char* str, std::size_t len) const;
+
+	void rehash(std::size_t n_slots);
+
+public:
+	InternedStrings();
+
+	// Id of str, added to the arena if not already present
+	std::uint32_t intern(const std::string& str);
+
+	// Id of str, or -1 if not present
+	long lookup(const std::string& str) const;
+
+	std::string str(std::uint32_t id) const {
+		return arena.substr(offsets[id], offsets[id + 1] - offsets[id]);
+	}
+
+	std::string operator[](long jj) const {
+		return str(ids[jj]);
+	}
+
+	void set(long jj, const std::string& str){
+		ids[jj] = intern(str);
+	}
+
+	// Index of the first variant with value str, or -1 if none
+	long find(const std::string& str) const;
+
+	void move(long old_index, long new_index){
+		ids[new_index] = ids[old_index];
+	}
+
+	// Existing entries are kept; new entries are the empty string
+	void resize(long p){
+		ids.resize(p, 0);
+	}
+
+	// Drops all variants and strings but keeps capacity
+	void clear();
+
+	long size() const {
+		return ids.size();
+	}
+
+	// Number of distinct strings, including the empty string
+	long n_unique() const {
+		return offsets.size() - 1;
+	}
+};
+
+#endif //LEMMA_INTERNED_STRINGS_HPP
@@ -9,6 +9,9 @@
 #include "rhe_reg.hpp"
 #include "genotype_matrix.hpp"
 #include "mpi_utils.hpp"
+#include "bgen_stream.hpp"
+#include "stats_tests.hpp"
+#include "parallel_utils.hpp"
 
 #include <algorithm>
 #include <dirent.h>
@@ -16,9 +19,11 @@
 #include <fstream>
 #include <cassert>
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <stdexcept>
 #include <memory>
+#include <sstream>
 
 int main( int argc, char** argv ) {
 	parameters p;
@@ -104,84 +109,258 @@ int main( int argc, char** argv ) {
 	if (!p.streamBgenFiles.empty() && p.mode_calc_snpstats) {
 		std::cout << "Computing single-snp hypothesis tests" << std::endl;
 		boost_io::filtering_ostream outf;
-		if(world_rank == 0) {
-			if (p.assocOutFile != "NULL") {
-				fileUtils::fstream_init(outf, p.assocOutFile);
-				std::cout << "Writing single SNP hypothesis tests to file: " << p.assocOutFile << std::endl;
-			} else {
-				std::string assoc_filepath = p.out_file;
-				if(p.mode_vb) {
-					assoc_filepath = fileUtils::filepath_format(assoc_filepath, "", "_loco_pvals");
-				}
-				fileUtils::fstream_init(outf, assoc_filepath);
-				std::cout << "Writing single SNP hypothesis tests to file: " << assoc_filepath << std::endl;
+		std::string assoc_filepath = p.assocOutFile;
+		if (assoc_filepath == "NULL") {
+			assoc_filepath = p.out_file;
+			if(p.mode_vb) {
+				assoc_filepath = fileUtils::filepath_format(assoc_filepath, "", "_loco_pvals");
 			}
 		}
+		if(world_rank == 0) {
+			fileUtils::fstream_init(outf, assoc_filepath);
+			std::cout << "Writing single SNP hypothesis tests to file: " << assoc_filepath << std::endl;
+		}
 
 		long long n_vars_tot = 0;
 		for (int ii = 0; ii < p.streamBgenFiles.size(); ii++) {
 			n_vars_tot += data.streamBgenViews[ii]->number_of_variants();
 		}
 
-		long ixChr, maxChunkSize = 256;
+		long maxChunkSize = 256;
 		long n_var_parsed_tot = 0, nChunk = 0, print_interval = (p.debug ? 1 : p.streamBgen_print_interval);
-		bool bgen_pass = true, append = false;
-		Eigen::MatrixXd neglogPvals, testStats;
-		GenotypeMatrix Xstream(p, false);
-		for (int ii = 0; ii < p.streamBgenFiles.size(); ii++) {
-			std::cout << "Streaming genotypes from " << p.streamBgenFiles[ii] << std::endl;
+		bool append = false;
+		long n_files = p.streamBgenFiles.size();
+
+		// With --streamBgen-partition-variants each rank tests a contiguous
+		// range of variants over all samples; it needs the LOCO residuals of
+		// every sample but no communication per variant. Other ranks write
+		// their results to a temporary file next to the output, which rank 0
+		// appends in rank order at the end.
+		bool partition = p.streamBgen_partition_variants;
+		MPI_Comm test_comm = partition ? MPI_COMM_SELF : MPI_COMM_WORLD;
+		const SampleMask& test_mask = partition ? data.sample_mask_all_ranks : data.sample_mask;
+		EigenDataMatrix resid_loco = partition ? mpiUtils::allgather_rows(data.resid_loco) : data.resid_loco;
+		EigenDataVector eta;
+		if (data.n_env > 0 && partition) {
+			eta = mpiUtils::allgather_rows(data.vp_init.eta).col(0);
+		} else if (data.n_env > 0) {
+			eta = data.vp_init.eta;
+		}
+		long n_test_samples = resid_loco.rows();
+		std::ofstream rank_out;
+		if (partition) {
+			// Rank 0 has created any parent directory of the output
+			MPI_Barrier(MPI_COMM_WORLD);
+			if (world_rank != 0) {
+				rank_out.open(assoc_filepath + ".rank" + std::to_string(world_rank) + ".tmp");
+				if (!rank_out) {
+					throw std::runtime_error("Could not open temporary file next to " + assoc_filepath);
+				}
+			}
+		}
+		std::ostream& out = (world_rank == 0) ? static_cast<std::ostream&>(outf) : rank_out;
+		bool writes_output = world_rank == 0 || partition;
 
-			std::vector<int> chrsInFile;
-			fileUtils::read_bgen_metadata(p.streamBgenFiles[ii],chrsInFile);
-			std::map<long,long> chr_changes;
-			long chr = chrsInFile[0];
-			for (long jj = 0; jj < chrsInFile.size(); jj++) {
-				if (chr != chrsInFile[jj]) {
-					chr_changes[chr] = jj;
-					chr = chrsInFile[jj];
+		std::vector<long> first_variant(n_files, 0), n_variants(n_files, -1);
+		if (partition) {
+			int world_size;
+			MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+			long long begin = n_vars_tot * world_rank / world_size;
+			long long end = n_vars_tot * (world_rank + 1) / world_size;
+			long long offset = 0;
+			for (long ii = 0; ii < n_files; ii++) {
+				long long n_var = data.streamBgenViews[ii]->number_of_variants();
+				first_variant[ii] = std::min(n_var, std::max(0LL, begin - offset));
+				n_variants[ii] = std::min(n_var, std::max(0LL, end - offset)) - first_variant[ii];
+				offset += n_var;
+			}
+		}
+
+		// Up to --streamBgen-concurrent-files files are read and decoded at
+		// once, each by its own background reader. The chunks read from every
+		// open file in a round are tested on worker threads, with one reduction
+		// of their sums over samples (two for GxE tests). Results are written
+		// in file order; files after the first unfinished one are buffered
+		// until it completes.
+		struct LocoFile : StreamedBgenFile {
+			std::unique_ptr<GenotypeMatrix> X;
+			long chunkSize = 0, ixChr = 0;
+			Eigen::MatrixXd sums, hetero_sums, neglogPvals, testStats;
+			bool buffer_has_header = false;
+			std::ostringstream buffer;
+		};
+		std::vector<LocoFile> files(n_files);
+		long n_written = 0;
+		bool isGxE = eta.rows() > 0;
+
+		// Chunks must not span chromosomes; boundaries come from the .bgi index
+		auto next_chunk_size = [&](long ii) {
+			const std::vector<long>& chr_ends = data.streamBgenChrEnds[ii];
+			auto it = std::upper_bound(chr_ends.begin(), chr_ends.end(), files[ii].n_var_parsed);
+			return (it == chr_ends.end()) ? 0 : std::min(maxChunkSize, *it - files[ii].n_var_parsed);
+		};
+
+		// Copy buffered output of the next files in order; the first
+		// unfinished file then writes straight to out.
+		auto flush_written = [&]() {
+			while (n_written < n_files) {
+				LocoFile& ff = files[n_written];
+				std::string text = ff.buffer.str();
+				if (append && ff.buffer_has_header) {
+					text.erase(0, text.find('\n') + 1);
+				}
+				if (writes_output && !text.empty()) {
+					out << text;
+					append = true;
 				}
+				ff.buffer.str("");
+				ff.buffer_has_header = false;
+				if (!ff.done) break;
+				n_written++;
 			}
-			chr_changes[chr] = chrsInFile.size();
+		};
 
-			long n_var_parsed = 0;
-			long chunkSize = std::min(maxChunkSize, chr_changes[chr]-n_var_parsed);
-			while (fileUtils::read_bgen_chunk(data.streamBgenViews[ii], Xstream, data.sample_is_invalid,
-			                                  data.n_samples, chunkSize, p, bgen_pass, n_var_parsed)) {
+		// One reduction over test_comm for the sums of every chunk in a round
+		auto reduce_sums = [&](const std::vector<long>& chunk_files, bool hetero) {
+			long n_rows = 0, n_cols = 0;
+			for (long ii : chunk_files) {
+				const Eigen::MatrixXd& sums = hetero ? files[ii].hetero_sums : files[ii].sums;
+				n_rows = sums.rows();
+				n_cols += sums.cols();
+			}
+			Eigen::MatrixXd all_sums(n_rows, n_cols);
+			n_cols = 0;
+			for (long ii : chunk_files) {
+				const Eigen::MatrixXd& sums = hetero ? files[ii].hetero_sums : files[ii].sums;
+				all_sums.middleCols(n_cols, sums.cols()) = sums;
+				n_cols += sums.cols();
+			}
+			all_sums = mpiUtils::mpiReduce_inplace(all_sums, test_comm);
+			n_cols = 0;
+			for (long ii : chunk_files) {
+				Eigen::MatrixXd& sums = hetero ? files[ii].hetero_sums : files[ii].sums;
+				sums = all_sums.middleCols(n_cols, sums.cols());
+				n_cols += sums.cols();
+			}
+		};
+
+		auto open_file = [&](long ii) {
+			if (n_variants[ii] == 0) {
+				// No variants of this file in this rank's range
+				return false;
+			}
+			std::cout << "Streaming genotypes from " << p.streamBgenFiles[ii] << std::endl;
+			fileUtils::seek_bgen_variant(data.streamBgenViews[ii], p.streamBgiFiles[ii], [&data, ii] {
+				return data.stream_bgen_query(ii);
+			}, first_variant[ii]);
+			LocoFile& ff = files[ii];
+			ff.reader.reset(new BgenStreamReader(data.streamBgenViews[ii], test_mask, p,
+			                                     false, maxChunkSize, p.streamBgen_read_ahead,
+			                                     first_variant[ii], n_variants[ii],
+			                                     test_comm, data.streamBgenQc.empty() ? nullptr :
+			                                     data.streamBgenQc[ii].get()));
+			ff.X.reset(new GenotypeMatrix(p, false));
+			ff.n_var_parsed = first_variant[ii];
+			ff.chunkSize = next_chunk_size(ii);
+			return true;
+		};
+
+		auto read_file = [&](long ii) {
+			LocoFile& ff = files[ii];
+			long n_var_parsed = ff.n_var_parsed;
+			bool has_chunk = ff.chunkSize > 0 &&
+			                 fileUtils::read_bgen_chunk(*ff.reader, *ff.X, n_test_samples, ff.chunkSize, p, ff.n_var_parsed);
+			n_var_parsed_tot += ff.n_var_parsed - n_var_parsed;
+			if (has_chunk) {
 				if (nChunk % print_interval == 0 && nChunk > 0) {
-					std::cout << "Chunk " << nChunk << " read (size " << chunkSize;
-					std::cout << ", " << n_var_parsed_tot+n_var_parsed - 1 << "/" << n_vars_tot;
+					std::cout << "Chunk " << nChunk << " read (size " << ff.chunkSize;
+					std::cout << ", " << n_var_parsed_tot - 1 << "/" << n_vars_tot;
 					std::cout << " variants parsed)" << std::endl;
 				}
+				nChunk++;
+			}
+			return has_chunk;
+		};
 
-				int firstChr = Xstream.chromosome[0];
-				auto cnt = std::count(Xstream.chromosome.begin(),Xstream.chromosome.end(),firstChr);
-				if (cnt != Xstream.cols()) {
+		auto process_chunks = [&](const std::vector<long>& chunk_files) {
+			long n_chunk_files = chunk_files.size();
+			parallelUtils::parallel_for(n_chunk_files, [&](long kk) {
+				LocoFile& ff = files[chunk_files[kk]];
+				GenotypeMatrix& X = *ff.X;
+				int firstChr = X.chromosome[0];
+				auto cnt = std::count(X.chromosome.begin(), X.chromosome.end(), firstChr);
+				if (cnt != X.cols()) {
 					throw std::logic_error("Expected only one chromosome in this chunk of data");
 				}
 
-				auto it = std::find(data.loco_chrs.begin(),data.loco_chrs.end(),firstChr);
+				auto it = std::find(data.loco_chrs.begin(), data.loco_chrs.end(), firstChr);
 				if (it == data.loco_chrs.end()) {
 					throw std::runtime_error("Could not locate residualised LOCO phenotype for chromosome "+std::to_string(firstChr));
-				} else {
-					ixChr = it - data.loco_chrs.begin();
 				}
+				ff.ixChr = it - data.loco_chrs.begin();
 
-				Xstream.calc_scaled_values();
-				if (data.n_env > 0) {
-					compute_LOCO_pvals(data.resid_loco.col(ixChr), Xstream, neglogPvals, testStats, data.vp_init.eta);
-				} else {
-					compute_LOCO_pvals(data.resid_loco.col(ixChr), Xstream, neglogPvals, testStats);
-				}
+				X.calc_scaled_values();
+				compute_LOCO_sums(resid_loco.col(ff.ixChr), X, eta, ff.sums);
+			});
+			reduce_sums(chunk_files, false);
+			if (isGxE) {
+				parallelUtils::parallel_for(n_chunk_files, [&](long kk) {
+					LocoFile& ff = files[chunk_files[kk]];
+					compute_LOCO_hetero_sums(resid_loco.col(ff.ixChr), *ff.X, eta, ff.sums, ff.hetero_sums);
+				});
+				reduce_sums(chunk_files, true);
+			}
+			parallelUtils::parallel_for(n_chunk_files, [&](long kk) {
+				LocoFile& ff = files[chunk_files[kk]];
+				compute_LOCO_pvals(ff.sums, ff.hetero_sums, isGxE, ff.neglogPvals, ff.testStats);
+			});
 
-				if (world_rank == 0) {
-					fileUtils::write_snp_stats_to_file(outf, data.n_effects, Xstream, append, neglogPvals, testStats);
+			for (long ii : chunk_files) {
+				LocoFile& ff = files[ii];
+				if (writes_output && ii == n_written) {
+					fileUtils::write_snp_stats_to_file(out, data.n_effects, *ff.X, append, ff.neglogPvals, ff.testStats);
+					append = true;
+				} else if (writes_output) {
+					fileUtils::write_snp_stats_to_file(ff.buffer, data.n_effects, *ff.X, ff.buffer_has_header,
+					                                   ff.neglogPvals, ff.testStats);
+					ff.buffer_has_header = true;
 				}
+				ff.chunkSize = next_chunk_size(ii);
+			}
+			flush_written();
+		};
 
-				append = true;
-				nChunk++;
-				chunkSize = std::min(maxChunkSize,chr_changes[chr]-n_var_parsed);
+		auto close_file = [&](long ii) {
+			files[ii].reader.reset();
+			files[ii].X.reset();
+			files[ii].done = true;
+			flush_written();
+		};
+
+		stream_bgen_files(n_files, p.streamBgen_concurrent_files, open_file, read_file, process_chunks, close_file);
+		if (partition) {
+			// Results of each rank follow those of the ranks before it
+			int world_size;
+			MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+			rank_out.close();
+			MPI_Barrier(MPI_COMM_WORLD);
+			for (int rr = 1; rr < world_size && world_rank == 0; rr++) {
+				std::string rank_file = assoc_filepath + ".rank" + std::to_string(rr) + ".tmp";
+				std::ifstream in(rank_file);
+				if (!in) {
+					throw std::runtime_error("Could not open temporary file " + rank_file);
+				}
+				std::string header;
+				if (append) {
+					std::getline(in, header);
+				}
+				if (in.peek() != std::ifstream::traits_type::eof()) {
+					outf << in.rdbuf();
+					append = true;
+				}
+				in.close();
+				std::remove(rank_file.c_str());
 			}
-			n_var_parsed_tot += n_var_parsed;
 		}
 		boost_io::close(outf);
 	}
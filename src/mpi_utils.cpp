@@ -134,9 +134,9 @@ void mpiUtils::mpiReduce_double(void *local, void *global, long size) {
 	MPI_Allreduce(local, global, size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 }
 
-double mpiUtils::mpiReduce_inplace(double *local) {
+double mpiUtils::mpiReduce_inplace(double *local, MPI_Comm comm) {
 	double global;
-	MPI_Allreduce(local, &global, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce(local, &global, 1, MPI_DOUBLE, MPI_SUM, comm);
 	return global;
 }
 
@@ -146,9 +146,9 @@ double mpiUtils::mpiReduce_inplace(double local) {
 	return global;
 }
 
-long mpiUtils::mpiReduce_inplace(long *local) {
+long mpiUtils::mpiReduce_inplace(long *local, MPI_Comm comm) {
 	long global;
-	MPI_Allreduce(local, &global, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce(local, &global, 1, MPI_LONG, MPI_SUM, comm);
 	return global;
 }
 
@@ -158,10 +158,30 @@ long long mpiUtils::mpiReduce_inplace(long long *local) {
 	return global;
 }
 
-Eigen::MatrixXd mpiUtils::mpiReduce_inplace(Eigen::Ref<Eigen::MatrixXd> local){
+Eigen::MatrixXd mpiUtils::mpiReduce_inplace(Eigen::Ref<Eigen::MatrixXd> local, MPI_Comm comm){
 	Eigen::MatrixXd global(local.rows(), local.cols());
 	long size = local.rows() * local.cols();
-	MPI_Allreduce(local.data(), global.data(), size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce(local.data(), global.data(), size, MPI_DOUBLE, MPI_SUM, comm);
+	return global;
+}
+
+Eigen::MatrixXd mpiUtils::allgather_rows(const Eigen::Ref<const Eigen::MatrixXd>& local){
+	int world_size;
+	MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+	int n_local = (int) local.rows();
+	std::vector<int> counts(world_size), displs(world_size, 0);
+	MPI_Allgather(&n_local, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+	for (int rr = 1; rr < world_size; rr++) {
+		displs[rr] = displs[rr - 1] + counts[rr - 1];
+	}
+
+	Eigen::MatrixXd global(displs[world_size - 1] + counts[world_size - 1], local.cols());
+	Eigen::VectorXd col(local.rows());
+	for (long cc = 0; cc < local.cols(); cc++) {
+		col = local.col(cc);
+		MPI_Allgatherv(col.data(), n_local, MPI_DOUBLE, global.col(cc).data(), counts.data(),
+		               displs.data(), MPI_DOUBLE, MPI_COMM_WORLD);
+	}
 	return global;
 }
 
@@ -13,12 +13,6 @@
 #include <vector>
 #include <iostream>
 
-// #ifdef DATA_AS_FLOAT
-// using MPI_EIGEN_TYPE = MPI_FLOAT;
-// #else
-// using MPI_EIGEN_TYPE = MPI_DOUBLE;
-// #endif
-
 namespace mpiUtils {
 
 void sanitise_cout();
@@ -34,12 +28,16 @@ void partition_valid_samples_across_ranks(const long& n_samples,
 
 void mpiReduce_double(void* local, void* global, long size);
 
-double mpiReduce_inplace(double* local);
+double mpiReduce_inplace(double* local, MPI_Comm comm = MPI_COMM_WORLD);
 double mpiReduce_inplace(double local);
-long mpiReduce_inplace(long* local);
+long mpiReduce_inplace(long* local, MPI_Comm comm = MPI_COMM_WORLD);
 long long mpiReduce_inplace(long long* local);
 
-Eigen::MatrixXd mpiReduce_inplace(Eigen::Ref<Eigen::MatrixXd> local);
+Eigen::MatrixXd mpiReduce_inplace(Eigen::Ref<Eigen::MatrixXd> local, MPI_Comm comm = MPI_COMM_WORLD);
+
+// Rows held by each rank stacked in rank order; ie. all valid samples in file
+// order when rows are samples.
+Eigen::MatrixXd allgather_rows(const Eigen::Ref<const Eigen::MatrixXd>& local);
 
 template <typename Derived>
 double squaredNorm(const Eigen::DenseBase<Derived>&obj);
@@ -0,0 +1,40 @@
+#ifndef LEMMA_PARALLEL_UTILS_HPP
+#define LEMMA_PARALLEL_UTILS_HPP
+
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace parallelUtils {
+
+// Run fn(tt) for tt = 0, ..., n_thread - 1, each on its own thread, and
+// wait for all of them. Runs inline when n_thread is 1. An exception thrown
+// by any call is rethrown here once every thread has joined.
+template <typename Fn>
+void parallel_for(long n_thread, const Fn& fn){
+	if(n_thread <= 1) {
+		if(n_thread == 1) fn(0L);
+		return;
+	}
+
+	std::vector<std::thread> t_pool;
+	std::vector<std::exception_ptr> errors(n_thread);
+	for (long tt = 0; tt < n_thread; tt++) {
+		t_pool.push_back(std::thread( [tt, &fn, &errors] {
+			try {
+				fn(tt);
+			} catch (...) {
+				errors[tt] = std::current_exception();
+			}
+		}));
+	}
+	for (auto& tt : t_pool) {
+		tt.join();
+	}
+	for (const auto& error : errors) {
+		if (error) std::rethrow_exception(error);
+	}
+}
+}
+
+#endif //LEMMA_PARALLEL_UTILS_HPP
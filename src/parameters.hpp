@@ -16,14 +16,15 @@ public:
 	std::string r1_hyps_grid_file, r1_probs_grid_file, hyps_grid_file, rhe_random_vectors_file;
 	std::string env_coeffs_file, covar_coeffs_file, hyps_probs_file, vb_init_file;
 	std::string dxteex_file, snpstats_file, mog_weights_file, resume_prefix;
-	std::string assocOutFile, extra_pve_covar_file;
+	std::string assocOutFile, extra_pve_covar_file, genotype_cache_file, bgen_qc_cache_file;
+	std::string ldblock_cache_file;
 	std::vector< std::string > rsid;
 	std::vector< std::string > streamBgenFiles, streamBgiFiles, RHE_groups_files;
 	unsigned int random_seed;
 	long chunk_size, vb_iter_max, vb_iter_start, param_dump_interval, n_pve_samples;
 	long long maxBytesPerRank;
 	int env_update_repeats;
-	unsigned int n_thread, main_chunk_size, gxe_chunk_size;
+	unsigned int n_thread, main_chunk_size, gxe_chunk_size, genotype_bits;
 	std::uint32_t range_start, range_end;
 	bool range, maf_lim, info_lim, joint_covar_update, mode_RHEreg_LM;
 	bool mode_vb, use_vb_on_covars;
@@ -35,11 +36,14 @@ public:
 	bool init_weights_with_snpwise_scan, flip_high_maf_variants, min_spike_diff_set;
 	bool mode_mog_prior_beta, mode_mog_prior_gam, mode_random_start, mode_calc_snpstats;
 	bool mode_remove_squared_envs, mode_squarem, mode_incl_squared_envs, drop_loco;
-	bool exclude_ones_from_env_sq, mode_RHEreg_NM;
+	bool exclude_ones_from_env_sq, mode_RHEreg_NM, mixed_precision, bgen_scatter;
+	bool auto_chunk_size;
+	bool streamBgen_partition_variants;
 	long levenburgMarquardt_max_iter, pheno_col_num;
-	double min_maf, min_info, elbo_tol, alpha_tol;
+	double min_maf, min_info, elbo_tol, alpha_tol, max_sparse_density;
 	double beta_spike_diff_factor, gam_spike_diff_factor, min_spike_diff_factor;
 	long LOSO_window, n_jacknife, streamBgen_print_interval, nelderMead_max_iter, n_LM_starts;
+	long streamBgen_read_ahead, streamBgen_concurrent_files;
 	bool RHE_multicomponent, mode_dump_processed_data, use_raw_env;
 
 // constructors/destructors
@@ -66,10 +70,19 @@ public:
 		resume_prefix("NULL"),
 		env_coeffs_file("NULL"),
 		rhe_random_vectors_file("NULL"),
-		assocOutFile("NULL") {
+		assocOutFile("NULL"),
+		genotype_cache_file("NULL"),
+		bgen_qc_cache_file("NULL"),
+		ldblock_cache_file("NULL") {
 		flip_high_maf_variants = false;
 		init_weights_with_snpwise_scan = false;
 		n_thread = 1;
+		genotype_bits = 8;
+		max_sparse_density = 0;
+		mixed_precision = false;
+		bgen_scatter = false;
+		auto_chunk_size = false;
+		streamBgen_partition_variants = false;
 		n_jacknife = 100;
 		random_seed = -1;
 		env_update_repeats = 1;
@@ -80,11 +93,7 @@ public:
 		use_raw_env = false;
 		chunk_size = 256;
 		main_chunk_size = 64;
-#ifdef DATA_AS_FLOAT
-		gxe_chunk_size = 16;
-#else
 		gxe_chunk_size = 8;
-#endif
 		vb_iter_max = 10000;
 		maxBytesPerRank = 14500000000;
 		vb_iter_start = 0;
@@ -95,6 +104,8 @@ public:
 		gam_spike_diff_factor = 1000;
 		param_dump_interval = 50;
 		streamBgen_print_interval = 100;
+		streamBgen_read_ahead = 1;
+		streamBgen_concurrent_files = 1;
 		range = false;
 		force_write_vparams = false;
 		min_spike_diff_set = false;
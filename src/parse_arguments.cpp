@@ -43,12 +43,6 @@ void print_compilation_details(){
 	std::cout << "- LINUX compatible" << std::endl;
 #endif
 
-#ifdef DATA_AS_FLOAT
-	std::cout << "- Data encoded as float" << std::endl;
-#else
-	std::cout << "- Data encoded as double" << std::endl;
-#endif
-
 #ifdef EIGEN_USE_MKL_ALL
 	std::cout << "- compiled with Intel MKL backend" << std::endl;
 #else
@@ -92,6 +86,12 @@ void parse_arguments(parameters &p, int argc, char **argv) {
 	    ("incl-squared-envs", "QC: Include significant squared environmental effects (SQE) as covariates")
 	    ("random-seed", "Seed used for random number generation (default: random)",
 	    cxxopts::value<unsigned int>(p.random_seed))
+	    ("genotype-cache", "Path prefix for a binary cache of processed --bgen data; written if absent or stale, read otherwise (optional)",
+	    cxxopts::value<std::string>(p.genotype_cache_file))
+	    ("bgen-qc-cache", "Path prefix for cached per-variant QC statistics of bgen files; variants failing --maf / --info are then skipped without decompressing them (optional)",
+	    cxxopts::value<std::string>(p.bgen_qc_cache_file))
+	    ("ldblock-cache", "Path prefix for binary caches of the local LD blocks used by VB; written by rank 0 if absent or stale, read otherwise (optional)",
+	    cxxopts::value<std::string>(p.ldblock_cache_file))
 	;
 
 	options.add_options("VB")
@@ -154,6 +154,9 @@ void parse_arguments(parameters &p, int argc, char **argv) {
 	    ("chunk", "", cxxopts::value<long>(p.chunk_size))
 	    ("high-mem", "", cxxopts::value<bool>())
 	    ("low-mem", "", cxxopts::value<bool>())
+	    ("genotype-bits", "Bits used to store each dosage with low-mem; 8, 4 (per-variant range) or 2 (hard calls)", cxxopts::value<unsigned int>(p.genotype_bits))
+	    ("max-sparse-density", "Low-mem: store variants with at most this fraction of non-zero dosages in sparse format, eg. 0.05 (default 0: disabled)", cxxopts::value<double>(p.max_sparse_density))
+	    ("mixed-precision", "Decompress genotype panels and run VB / RHE products in single precision, with double precision accumulators", cxxopts::value<bool>(p.mixed_precision))
 	    ("joint-covar-update", "Perform batch update in VB algorithm when updating covariates", cxxopts::value<bool>(p.joint_covar_update))
 	    ("min-alpha-diff", "", cxxopts::value<double>(p.alpha_tol))
 	    ("vb-iter-start", "", cxxopts::value<long>(p.vb_iter_start))
@@ -161,6 +164,7 @@ void parse_arguments(parameters &p, int argc, char **argv) {
 	    ("mode-spike-slab", "")
 	    ("main-chunk-size", "", cxxopts::value<unsigned int>(p.main_chunk_size))
 	    ("gxe-chunk-size", "", cxxopts::value<unsigned int>(p.gxe_chunk_size))
+	    ("auto-chunk-size", "Choose --main-chunk-size and --gxe-chunk-size by timing candidate sizes on a sample of chunks before VB, within --maxBytesPerRank; reuses the sizes of a matching --ldblock-cache", cxxopts::value<bool>(p.auto_chunk_size))
 	    ("min-spike-diff-factor", "", cxxopts::value<double>(p.min_spike_diff_factor))
 	    ("mode-regress-out-covars", "QC: Regress covariates from phenotype instead of including in VB")
 	    ("exclude-ones-from-env-sq", "", cxxopts::value<bool>(p.exclude_ones_from_env_sq))
@@ -174,6 +178,10 @@ void parse_arguments(parameters &p, int argc, char **argv) {
 	    ("init-weights-with-snpwise-scan", "", cxxopts::value<bool>(p.init_weights_with_snpwise_scan))
 	    ("mode-pve-est", "Depreciated: Run RHE algorithm", cxxopts::value<bool>())
 	    ("streamBgen-print-interval", "", cxxopts::value<long>(p.streamBgen_print_interval))
+	    ("streamBgen-read-ahead", "Chunks of --streamBgen variants to read and decode in the background (default 1)", cxxopts::value<long>(p.streamBgen_read_ahead))
+	    ("streamBgen-concurrent-files", "Number of --mStreamBgen files to read concurrently (default 1)", cxxopts::value<long>(p.streamBgen_concurrent_files))
+	    ("streamBgen-partition-variants", "Single SNP tests on streamed bgen files: each rank tests a contiguous range of variants over all samples, instead of every rank holding a share of the samples", cxxopts::value<bool>(p.streamBgen_partition_variants))
+	    ("bgen-scatter", "Decode bgen files on rank 0 only and send each rank its samples, instead of every rank decoding every variant", cxxopts::value<bool>(p.bgen_scatter))
 	    ("mode-dump-processed-data", "", cxxopts::value<bool>(p.mode_dump_processed_data))
 	    ("RHEreg-NM", "", cxxopts::value<bool>(p.mode_RHEreg_NM))
 	    ("NM-max-iter", "", cxxopts::value<long>(p.nelderMead_max_iter))
@@ -402,6 +410,24 @@ void parse_arguments(parameters &p, int argc, char **argv) {
 			if(p.n_thread < 1) throw std::runtime_error("--threads must be positive.");
 		}
 
+		if(opts.count("streamBgen-read-ahead")) {
+			if(p.streamBgen_read_ahead < 1) throw std::runtime_error("--streamBgen-read-ahead must be positive.");
+		}
+
+		if(opts.count("streamBgen-concurrent-files")) {
+			if(p.streamBgen_concurrent_files < 1) throw std::runtime_error("--streamBgen-concurrent-files must be positive.");
+		}
+
+		if(p.streamBgen_partition_variants && p.bgen_scatter) {
+			throw std::runtime_error("--streamBgen-partition-variants can not be used with --bgen-scatter.");
+		}
+
+		if(opts.count("genotype-bits")) {
+			if(p.genotype_bits != 8 && p.genotype_bits != 4 && p.genotype_bits != 2) {
+				throw std::runtime_error("--genotype-bits must be one of 8, 4 or 2.");
+			}
+		}
+
 		if(opts.count("min-alpha-diff")) {
 			p.alpha_tol_set_by_user = true;
 			if(p.alpha_tol < 0) throw std::runtime_error("--min-alpha-diff must be positive.");
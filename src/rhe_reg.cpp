@@ -5,13 +5,17 @@
 #include "genotype_matrix.hpp"
 #include "typedefs.hpp"
 #include "file_utils.hpp"
+#include "bgen_stream.hpp"
 #include "parameters.hpp"
 #include "mpi_utils.hpp"
 #include "nelder_mead.hpp"
 #include "levenberg_marquardt.hpp"
+#include "parallel_utils.hpp"
 
 #include "tools/eigen3.3/Dense"
 
+#include <algorithm>
+#include <memory>
 #include <random>
 #include <cmath>
 #include <functional>
@@ -208,73 +212,99 @@ void RHEreg::compute_RHE_trace_operators() {
 			main_fwd_pass_chunks[main_ch_index].push_back(kk);
 		}
 
-		EigenDataMatrix D;
-		long jknf_block_size = (X.cumulative_pos[data.n_var - 1] + p.n_jacknife - 1) / p.n_jacknife;
-		for (auto &iter_chunk : main_fwd_pass_chunks) {
-			if (D.cols() != iter_chunk.size()) {
-				D.resize(n_samples, iter_chunk.size());
-			}
-			X.col_block3(iter_chunk, D);
-
-			// Get jacknife block (just use block assignment of 1st snp)
-			long jacknife_index = X.cumulative_pos[iter_chunk[0]] / jknf_block_size;
-
-			for (auto &comp : components) {
-				comp.add_to_trace_estimator(D, jacknife_index);
-			}
-
-			if(p.mode_RHEreg_NM || p.mode_RHEreg_LM) {
-				Eigen::MatrixXd XtEy(D.cols(), n_env);
-				for (long ll = 0; ll < n_env; ll++) {
-					XtEy.col(ll) = D.transpose() * E.col(ll).asDiagonal() * Y;
-				}
-				XtEy = mpiUtils::mpiReduce_inplace(XtEy);
-
-				for (long ll = 0; ll < n_env; ll++) {
-					for (long mm = 0; mm <= ll; mm++) {
-						ytEXXtEys[jacknife_index](mm, ll) += XtEy.col(ll).dot(XtEy.col(mm));
-						ytEXXtEys[jacknife_index](ll, mm) = ytEXXtEys[jacknife_index](mm, ll);
-					}
-				}
-			}
+		if(p.mixed_precision) {
+			add_genotypes_to_trace_estimators<Eigen::MatrixXf>(main_fwd_pass_chunks);
+		} else {
+			add_genotypes_to_trace_estimators<Eigen::MatrixXd>(main_fwd_pass_chunks);
 		}
 	} else if (!p.streamBgenFiles.empty()) {
 		n_var = 0;
-		long long snp_group_index = 0;
 		long n_var_parsed = 0;
 		long ch = 0;
 		long print_interval = p.streamBgen_print_interval;;
 		if (p.debug) print_interval = 1;
 		long long n_find_operations = 0;
-		std::vector<std::string> SNPIDS;
 		long long n_vars_tot = 0;
 		for (int ii = 0; ii < p.streamBgenFiles.size(); ii++) {
 			n_vars_tot += data.streamBgenViews[ii]->number_of_variants();
 		}
 		long jack_block_size = (n_vars_tot + p.n_jacknife) / p.n_jacknife;
 		if (p.debug) std::cout << "jacknife block size = " << jack_block_size << std::endl;
-		for (int ii = 0; ii < p.streamBgenFiles.size(); ii++) {
-			std::cout << std::endl << "Streaming genotypes from " << p.streamBgenFiles[ii] << std::endl;
+		// Up to --streamBgen-concurrent-files files are read and decoded at
+		// once, each by its own background reader. The chunks read from every
+		// open file in a round are worked on in parallel into per file partial
+		// estimators; X^T Wz needs one reduction per round, the other sums
+		// over samples one per file once it is done. Jacknife blocks are
+		// assigned as if the files were streamed one after another.
+		struct RheFile : StreamedBgenFile {
+			long offset = 0, jacknife_index = 0, n_skipped = 0;
+			long long snp_group_index = 0, n_find_operations = 0;
+			std::vector<std::string> group_snpids, group_names, SNPIDS;
+			Eigen::MatrixXd D;
+			// Columns of D in each component with --RHE-groups, and their
+			// products with the draws of that component
+			std::vector<Eigen::MatrixXd> D_blocks, XtWzs;
+			std::vector<RHEreg_ComponentPartial> partials;
+			// X^T E y of each variant over this rank's samples, and its
+			// jacknife block
+			std::vector<double> XtEy;
+			std::vector<long> XtEy_jacknife;
+		};
+		long n_files = p.streamBgenFiles.size();
+		std::vector<RheFile> files(n_files);
+		for (long ii = 1; ii < n_files; ii++) {
+			files[ii].offset = files[ii - 1].offset + data.streamBgenViews[ii - 1]->number_of_variants();
+		}
+		bool per_file_groups = p.RHE_groups_files.size() > 1;
+		bool with_XtEy = !p.RHE_multicomponent && (p.mode_RHEreg_NM || p.mode_RHEreg_LM);
 
-			if (p.RHE_groups_files.size() > 1) {
-				snp_group_index = 0;
+		auto block = [&](RheFile& ff, long cc) -> const Eigen::MatrixXd& {
+			return p.RHE_multicomponent ? ff.D_blocks[cc] : ff.D;
+		};
+
+		auto open_file = [&](long ii) {
+			std::cout << std::endl << "Streaming genotypes from " << p.streamBgenFiles[ii] << std::endl;
+			RheFile& ff = files[ii];
+			if (per_file_groups) {
 				read_RHE_groups(p.RHE_groups_files[ii]);
+				std::swap(ff.group_snpids, SNPGROUPS_snpid);
+				std::swap(ff.group_names, SNPGROUPS_group);
 			}
-
-			Eigen::MatrixXd D;
-			bool bgen_pass = true;
-			while (fileUtils::read_bgen_chunk(data.streamBgenViews[ii], D, sample_is_invalid,
-			                                  n_samples, 256, p, bgen_pass, n_var_parsed, SNPIDS)) {
-				n_var += D.cols();
+			ff.reader.reset(new BgenStreamReader(data.streamBgenViews[ii], sample_mask, p, false, 256,
+			                                     p.streamBgen_read_ahead, 0, -1, MPI_COMM_WORLD,
+			                                     data.streamBgenQc.empty() ? nullptr :
+			                                     data.streamBgenQc[ii].get()));
+			ff.D_blocks.resize(n_components);
+			ff.XtWzs.resize(n_components);
+			ff.partials.resize(n_components);
+			return true;
+		};
+
+		auto read_file = [&](long ii) {
+			RheFile& ff = files[ii];
+			long n_var_parsed_prev = ff.n_var_parsed;
+			bool has_chunk = fileUtils::read_bgen_chunk(*ff.reader, ff.D, n_samples, 256, p, ff.n_var_parsed, ff.SNPIDS);
+			n_var_parsed += ff.n_var_parsed - n_var_parsed_prev;
+			if (has_chunk) {
+				n_var += ff.D.cols();
 				if (ch % print_interval == 0 && ch > 0) {
 					std::cout << "Chunk " << ch << " read (size " << 256;
 					std::cout << ", " << n_var_parsed - 1 << "/" << n_vars_tot;
 					std::cout << " variants parsed)" << std::endl;
 				}
+				ch++;
 
 				// Get jacknife block (just use block assignment of 1st snp)
-				long jacknife_index = n_var_parsed / jack_block_size;
-
+				ff.jacknife_index = (ff.offset + ff.n_var_parsed) / jack_block_size;
+			}
+			return has_chunk;
+		};
+
+		auto process_chunks = [&](const std::vector<long>& chunk_files) {
+			long n_chunk_files = chunk_files.size();
+			parallelUtils::parallel_for(n_chunk_files, [&](long kk) {
+				RheFile& ff = files[chunk_files[kk]];
+				Eigen::MatrixXd& D = ff.D;
 				long n_chunk = D.cols();
 				std::vector<std::string> placeholder(n_chunk, "col");
 				if (!p.mode_RHE_fast) {
@@ -283,65 +313,140 @@ void RHEreg::compute_RHE_trace_operators() {
 				}
 
 				// parse which snp belongs to which group
-				std::vector<std::vector<int> > block_membership(n_components);
 				if (p.RHE_multicomponent) {
+					const std::vector<std::string>& group_snpids = per_file_groups ? ff.group_snpids : SNPGROUPS_snpid;
+					const std::vector<std::string>& group_names = per_file_groups ? ff.group_names : SNPGROUPS_group;
+					std::vector<std::vector<int> > block_membership(n_components);
+					long long& snp_group_index = ff.snp_group_index;
 					for (long jj = 0; jj < D.cols(); jj++) {
-						if (SNPGROUPS_snpid[snp_group_index] == SNPIDS[jj]) {
-							for (int kk = 0; kk < n_components; kk++) {
-								if (components[kk].group == SNPGROUPS_group[snp_group_index]) {
-									block_membership[kk].push_back(jj);
+						if (snp_group_index < group_snpids.size() && group_snpids[snp_group_index] == ff.SNPIDS[jj]) {
+							for (int cc = 0; cc < n_components; cc++) {
+								if (components[cc].group == group_names[snp_group_index]) {
+									block_membership[cc].push_back(jj);
 								}
 							}
 						} else {
 							// find
-							auto it = std::find(SNPGROUPS_snpid.begin(), SNPGROUPS_snpid.end(), SNPIDS[jj]);
-							if (it == SNPGROUPS_snpid.end()) {
+							auto it = std::find(group_snpids.begin(), group_snpids.end(), ff.SNPIDS[jj]);
+							if (it == group_snpids.end()) {
 								// skip
-								n_var -= 1;
+								ff.n_skipped++;
 							} else {
-								snp_group_index = it - SNPGROUPS_snpid.begin();
-								for (int kk = 0; kk < n_components; kk++) {
-									if (components[kk].group == SNPGROUPS_group[snp_group_index]) {
-										block_membership[kk].push_back(jj);
+								snp_group_index = it - group_snpids.begin();
+								for (int cc = 0; cc < n_components; cc++) {
+									if (components[cc].group == group_names[snp_group_index]) {
+										block_membership[cc].push_back(jj);
 									}
 								}
 							}
-							n_find_operations++;
+							ff.n_find_operations++;
 						}
 						snp_group_index++;
 					}
 					for (int cc = 0; cc < n_components; cc++) {
-						Eigen::MatrixXd D1(D.rows(), block_membership[cc].size());
-						if (D1.cols() > 0) {
-							for (int jjj = 0; jjj < block_membership[cc].size(); jjj++) {
-								D1.col(jjj) = D.col(block_membership[cc][jjj]);
-							}
-							components[cc].add_to_trace_estimator(D1, jacknife_index);
+						ff.D_blocks[cc].resize(D.rows(), block_membership[cc].size());
+						for (int jjj = 0; jjj < block_membership[cc].size(); jjj++) {
+							ff.D_blocks[cc].col(jjj) = D.col(block_membership[cc][jjj]);
 						}
 					}
-				} else {
-					for (auto &comp : components) {
-						comp.add_to_trace_estimator(D, jacknife_index);
-					}
+				}
 
-					if(p.mode_RHEreg_NM ||  p.mode_RHEreg_LM) {
-						Eigen::MatrixXd XtEy(D.cols(), n_env);
-						for (long ll = 0; ll < n_env; ll++) {
-							XtEy.col(ll) = D.transpose() * E.col(ll).asDiagonal() * Y;
-						}
-						XtEy = mpiUtils::mpiReduce_inplace(XtEy);
+				for (int cc = 0; cc < n_components; cc++) {
+					ff.XtWzs[cc] = components[cc].local_XtWz(block(ff, cc));
+				}
 
+				if (with_XtEy) {
+					Eigen::MatrixXd XtEy(D.cols(), n_env);
+					for (long ll = 0; ll < n_env; ll++) {
+						XtEy.col(ll) = D.transpose() * E.col(ll).asDiagonal() * Y;
+					}
+					for (long jj = 0; jj < D.cols(); jj++) {
 						for (long ll = 0; ll < n_env; ll++) {
-							for (long mm = 0; mm <= ll; mm++) {
-								ytEXXtEys[jacknife_index](mm, ll) += XtEy.col(ll).dot(XtEy.col(mm));
-								ytEXXtEys[jacknife_index](ll, mm) = ytEXXtEys[jacknife_index](mm, ll);
-							}
+							ff.XtEy.push_back(XtEy(jj, ll));
 						}
 					}
+					ff.XtEy_jacknife.insert(ff.XtEy_jacknife.end(), D.cols(), ff.jacknife_index);
+				}
+			});
+
+			// One reduction of X^T Wz for every chunk and component
+			long n_rows = 0;
+			for (long ii : chunk_files) {
+				for (int cc = 0; cc < n_components; cc++) {
+					n_rows += files[ii].XtWzs[cc].rows();
 				}
-				ch++;
 			}
-		}
+			Eigen::MatrixXd XtWz(n_rows, n_draws);
+			n_rows = 0;
+			for (long ii : chunk_files) {
+				for (int cc = 0; cc < n_components; cc++) {
+					XtWz.middleRows(n_rows, files[ii].XtWzs[cc].rows()) = files[ii].XtWzs[cc];
+					n_rows += files[ii].XtWzs[cc].rows();
+				}
+			}
+			XtWz = mpiUtils::mpiReduce_inplace(XtWz);
+			n_rows = 0;
+			for (long ii : chunk_files) {
+				for (int cc = 0; cc < n_components; cc++) {
+					long n_block = files[ii].XtWzs[cc].rows();
+					files[ii].XtWzs[cc] = XtWz.middleRows(n_rows, n_block);
+					n_rows += n_block;
+				}
+			}
+
+			parallelUtils::parallel_for(n_chunk_files, [&](long kk) {
+				RheFile& ff = files[chunk_files[kk]];
+				for (int cc = 0; cc < n_components; cc++) {
+					if (block(ff, cc).cols() > 0) {
+						components[cc].add_to_partial(block(ff, cc), ff.XtWzs[cc], ff.jacknife_index, ff.partials[cc]);
+					}
+				}
+			});
+		};
+
+		auto close_file = [&](long ii) {
+			RheFile& ff = files[ii];
+			ff.reader.reset();
+
+			// One reduction for the remaining sums over samples of this file
+			long n_vals = ff.XtEy.size();
+			for (const auto& partial : ff.partials) {
+				n_vals += partial.Xty.size();
+			}
+			Eigen::MatrixXd vals(n_vals, 1);
+			long pos = 0;
+			for (const auto& partial : ff.partials) {
+				std::copy(partial.Xty.begin(), partial.Xty.end(), vals.data() + pos);
+				pos += partial.Xty.size();
+			}
+			std::copy(ff.XtEy.begin(), ff.XtEy.end(), vals.data() + pos);
+			vals = mpiUtils::mpiReduce_inplace(vals);
+			pos = 0;
+			for (int cc = 0; cc < n_components; cc++) {
+				RHEreg_ComponentPartial& partial = ff.partials[cc];
+				std::copy(vals.data() + pos, vals.data() + pos + partial.Xty.size(), partial.Xty.begin());
+				pos += partial.Xty.size();
+				components[cc].merge_partial(partial);
+			}
+
+			for (long vv = 0; vv < ff.XtEy_jacknife.size(); vv++) {
+				const double* XtEy = vals.data() + pos + vv * n_env;
+				long jacknife_index = ff.XtEy_jacknife[vv];
+				for (long ll = 0; ll < n_env; ll++) {
+					for (long mm = 0; mm <= ll; mm++) {
+						ytEXXtEys[jacknife_index](mm, ll) += XtEy[ll] * XtEy[mm];
+						ytEXXtEys[jacknife_index](ll, mm) = ytEXXtEys[jacknife_index](mm, ll);
+					}
+				}
+			}
+
+			n_var -= ff.n_skipped;
+			n_find_operations += ff.n_find_operations;
+			ff = RheFile();
+			ff.done = true;
+		};
+
+		stream_bgen_files(n_files, p.streamBgen_concurrent_files, open_file, read_file, process_chunks, close_file);
 		if (p.verbose) std::cout << n_var << " variants pass QC filters" << std::endl;
 		if (p.debug && p.RHE_multicomponent) {
 			std::cout << n_find_operations << " find operations performed" << std::endl;
@@ -352,6 +457,43 @@ void RHEreg::compute_RHE_trace_operators() {
 	}
 }
 
+template <typename EigenMat>
+void RHEreg::add_genotypes_to_trace_estimators(const std::vector<std::vector<long> >& iter_chunks) {
+	// Genotype panels decompressed at the precision of EigenMat
+	typedef typename EigenMat::Scalar Scalar;
+	EigenMat D;
+	long jknf_block_size = (X.cumulative_pos[data.n_var - 1] + p.n_jacknife - 1) / p.n_jacknife;
+	for (auto &iter_chunk : iter_chunks) {
+		if (D.cols() != iter_chunk.size()) {
+			D.resize(n_samples, iter_chunk.size());
+		}
+		X.col_block3(iter_chunk, D);
+
+		// Get jacknife block (just use block assignment of 1st snp)
+		long jacknife_index = X.cumulative_pos[iter_chunk[0]] / jknf_block_size;
+
+		for (auto &comp : components) {
+			comp.add_to_trace_estimator(D, jacknife_index);
+		}
+
+		if(p.mode_RHEreg_NM || p.mode_RHEreg_LM) {
+			Eigen::MatrixXd XtEy(D.cols(), n_env);
+			for (long ll = 0; ll < n_env; ll++) {
+				Eigen::VectorXd Ey = E.col(ll).cwiseProduct(Y);
+				XtEy.col(ll) = (D.transpose() * Ey.cast<Scalar>()).template cast<double>();
+			}
+			XtEy = mpiUtils::mpiReduce_inplace(XtEy);
+
+			for (long ll = 0; ll < n_env; ll++) {
+				for (long mm = 0; mm <= ll; mm++) {
+					ytEXXtEys[jacknife_index](mm, ll) += XtEy.col(ll).dot(XtEy.col(mm));
+					ytEXXtEys[jacknife_index](ll, mm) = ytEXXtEys[jacknife_index](mm, ll);
+				}
+			}
+		}
+	}
+}
+
 void RHEreg::solve_RHE(std::vector<RHEreg_Component>& components) {
 	boost_io::filtering_ostream outf;
 
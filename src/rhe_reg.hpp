@@ -58,7 +58,7 @@ public:
 	Eigen::ArrayXd n_var_jack;
 
 	EigenDataMatrix zz;
-	const std::unordered_map<long, bool>& sample_is_invalid;
+	const SampleMask& sample_mask;
 	Data& data;
 
 	// std::vector<std::string> components;
@@ -69,7 +69,7 @@ public:
 	       Eigen::VectorXd& myY,
 	       Eigen::MatrixXd& myC,
 	       Eigen::MatrixXd myE) : p(dat.p), X(dat.G), E(myE), Y(myY), C(myC),
-		sample_is_invalid(dat.sample_is_invalid),
+		sample_mask(dat.sample_mask),
 		sample_location(dat.sample_location), data(dat),
 		env_names(dat.env_names) {
 		n_samples = data.n_samples;
@@ -89,7 +89,7 @@ public:
 	RHEreg(Data& dat,
 	       Eigen::VectorXd& myY,
 	       Eigen::MatrixXd& myC) : p(dat.p), X(dat.G), Y(myY), C(myC),
-		sample_is_invalid(dat.sample_is_invalid),
+		sample_mask(dat.sample_mask),
 		sample_location(dat.sample_location), data(dat),
 		env_names(dat.env_names)  {
 		n_samples = data.n_samples;
@@ -114,6 +114,9 @@ public:
 
 	void compute_RHE_trace_operators();
 
+	template <typename EigenMat>
+	void add_genotypes_to_trace_estimators(const std::vector<std::vector<long> >& iter_chunks);
+
 	void solve_RHE(std::vector<RHEreg_Component>& components);
 
 	Eigen::VectorXd run_RHE_levenburgMarquardt();
@@ -80,20 +80,77 @@ void RHEreg_Component::set_inactive() {
 
 void RHEreg_Component::add_to_trace_estimator(Eigen::Ref <Eigen::MatrixXd> X,
                                               long jacknife_index) {
+	_internal_add_to_trace_estimator(X, jacknife_index);
+}
+
+void RHEreg_Component::add_to_trace_estimator(Eigen::Ref <Eigen::MatrixXf> X,
+                                              long jacknife_index) {
+	_internal_add_to_trace_estimator(X, jacknife_index);
+}
+
+template <typename EigenMat>
+void RHEreg_Component::_internal_add_to_trace_estimator(const EigenMat& X,
+                                                        long jacknife_index) {
+	// Products at the precision of X; results reduced and summed in double
+	typedef typename EigenMat::Scalar Scalar;
 	assert(jacknife_index < n_jacknife_local);
 	if(is_active) {
-		Eigen::MatrixXd Xty = X.transpose() * Y;
+		Eigen::MatrixXd Xty = (X.transpose() * Y.cast<Scalar>()).template cast<double>();
 		Xty = mpiUtils::mpiReduce_inplace(Xty);
 		ytXXtys[jacknife_index] += Xty.squaredNorm();
 		if(n_covar > 0) {
-			Eigen::MatrixXd XtWz = X.transpose() * zz;
+			Eigen::MatrixXd XtWz = (X.transpose() * zz.cast<Scalar>()).template cast<double>();
 			XtWz = mpiUtils::mpiReduce_inplace(XtWz);
-			_XXtzs[jacknife_index] += X * XtWz;
+			_XXtzs[jacknife_index] += (X * XtWz.cast<Scalar>()).template cast<double>();
 		}
 		n_vars_local[jacknife_index] += X.cols();
 	}
 }
 
+Eigen::MatrixXd RHEreg_Component::local_XtWz(const Eigen::MatrixXd& X) const {
+	if(is_active && n_covar > 0) {
+		return X.transpose() * zz;
+	}
+	return Eigen::MatrixXd(0, n_draws);
+}
+
+void RHEreg_Component::add_to_partial(const Eigen::MatrixXd& X,
+                                      const Eigen::MatrixXd& XtWz,
+                                      long jacknife_index,
+                                      RHEreg_ComponentPartial& partial) const {
+	// As add_to_trace_estimator, with X^T Wz already reduced
+	assert(jacknife_index < n_jacknife_local);
+	if(is_active) {
+		Eigen::VectorXd Xty = X.transpose() * Y;
+		partial.Xty.insert(partial.Xty.end(), Xty.data(), Xty.data() + Xty.size());
+		partial.Xty_jacknife.insert(partial.Xty_jacknife.end(), Xty.size(), jacknife_index);
+		if(n_covar > 0) {
+			auto it = partial.XXtzs.find(jacknife_index);
+			if(it == partial.XXtzs.end()) {
+				partial.XXtzs[jacknife_index] = X * XtWz;
+			} else {
+				it->second += X * XtWz;
+			}
+		}
+		partial.n_vars[jacknife_index] += X.cols();
+	}
+}
+
+void RHEreg_Component::merge_partial(RHEreg_ComponentPartial& partial) {
+	if(is_active) {
+		for (long jj = 0; jj < partial.Xty.size(); jj++) {
+			ytXXtys[partial.Xty_jacknife[jj]] += partial.Xty[jj] * partial.Xty[jj];
+		}
+		for (const auto& kv : partial.XXtzs) {
+			_XXtzs[kv.first] += kv.second;
+		}
+		for (const auto& kv : partial.n_vars) {
+			n_vars_local[kv.first] += kv.second;
+		}
+	}
+	partial = RHEreg_ComponentPartial();
+}
+
 void RHEreg_Component::finalise() {
 	// Sum over the different jacknife blocks;
 	if(is_active) {
@@ -17,7 +17,20 @@
 
 #include <boost/iostreams/filtering_stream.hpp>
 
+#include <map>
 #include <random>
+#include <vector>
+
+// Contributions of the chunks of one streamed bgen file to a component,
+// accumulated without MPI calls so that files can be worked on in parallel.
+// Xty holds X^T y of each variant over this rank's samples, to be reduced
+// once per file before RHEreg_Component::merge_partial().
+struct RHEreg_ComponentPartial {
+	std::vector<double> Xty;
+	std::vector<long> Xty_jacknife;
+	std::map<long, Eigen::MatrixXd> XXtzs;
+	std::map<long, double> n_vars;
+};
 
 class RHEreg_Component {
 public:
@@ -93,6 +106,26 @@ public:
 	void add_to_trace_estimator(Eigen::Ref<Eigen::MatrixXd> X,
 	                            long jacknife_index = 0);
 
+	// Single precision genotypes (--mixed-precision); accumulated in double
+	void add_to_trace_estimator(Eigen::Ref<Eigen::MatrixXf> X,
+	                            long jacknife_index = 0);
+
+	template <typename EigenMat>
+	void _internal_add_to_trace_estimator(const EigenMat& X,
+	                                      long jacknife_index);
+
+	// Streamed genotypes; X^T Wz over this rank's samples, to be reduced
+	// before add_to_partial()
+	Eigen::MatrixXd local_XtWz(const Eigen::MatrixXd& X) const;
+
+	void add_to_partial(const Eigen::MatrixXd& X,
+	                    const Eigen::MatrixXd& XtWz,
+	                    long jacknife_index,
+	                    RHEreg_ComponentPartial& partial) const;
+
+	// partial.Xty must have been reduced over ranks
+	void merge_partial(RHEreg_ComponentPartial& partial);
+
 	void finalise();
 
 	Eigen::MatrixXd getXXtz() const;
@@ -0,0 +1,53 @@
+#ifndef LEMMA_SAMPLE_MASK_HPP
+#define LEMMA_SAMPLE_MASK_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Dense map from bgen sample index to row of this rank's genotype data.
+// Built once in Data::reduce_to_complete_cases and shared (by reference) with
+// every bgen reader, so decoding a variant needs one array load per sample.
+struct SampleMask {
+	// Row of each sample on this rank, or -1 if excluded (incomplete case or
+	// stored on another rank)
+	std::vector<std::int32_t> rows;
+	long n_excluded;
+
+	// Set with --bgen-scatter; rank 0 alone decodes the samples kept on any
+	// rank (all_ranks, in rank order) and sends rank rr scatter_counts[rr]
+	// of them starting from scatter_displs[rr].
+	std::shared_ptr<SampleMask> all_ranks;
+	std::vector<int> scatter_counts, scatter_displs;
+
+	SampleMask() : n_excluded(0) {
+	}
+
+	void assign(long n_samples, const std::vector<bool>& is_excluded){
+		rows.resize(n_samples);
+		n_excluded = 0;
+		for (long ii = 0; ii < n_samples; ii++) {
+			if (is_excluded[ii]) {
+				rows[ii] = -1;
+				n_excluded++;
+			} else {
+				rows[ii] = (std::int32_t) (ii - n_excluded);
+			}
+		}
+	}
+
+	// Samples past the end of the mask are kept
+	long row(std::size_t ii) const {
+		return ii < rows.size() ? rows[ii] : (long) ii - n_excluded;
+	}
+
+	bool is_valid(std::size_t ii) const {
+		return row(ii) >= 0;
+	}
+
+	bool scatter() const {
+		return all_ranks != nullptr;
+	}
+};
+
+#endif //LEMMA_SAMPLE_MASK_HPP
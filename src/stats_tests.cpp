@@ -1,6 +1,7 @@
 //
 // Created by kerin on 2019-12-01.
 //
+#include "stats_tests.hpp"
 #include "mpi_utils.hpp"
 #include "typedefs.hpp"
 #include "variational_parameters.hpp"
@@ -23,23 +24,24 @@ void prep_lm(const Eigen::MatrixXd &H,
              EigenRefDataMatrix HtH_inv,
              EigenRefDataMatrix Hty,
              double &rss,
-             EigenRefDataMatrix HtVH) {
+             EigenRefDataMatrix HtVH,
+             MPI_Comm comm) {
 	/*** All of the heavy lifting for linear hypothesis tests.
 	 * Easier to have in one place if we go down the MPI route.
 	 */
 
 	HtH     = H.transpose() * H;
-	HtH     = mpiUtils::mpiReduce_inplace(HtH);
+	HtH     = mpiUtils::mpiReduce_inplace(HtH, comm);
 	Hty     = H.transpose() * y;
-	Hty     = mpiUtils::mpiReduce_inplace(Hty);
+	Hty     = mpiUtils::mpiReduce_inplace(Hty, comm);
 	HtH_inv = HtH.inverse();
 
 	EigenDataVector resid = y - H * HtH_inv * Hty;
 	HtVH = H.transpose() * resid.cwiseProduct(resid).asDiagonal() * H;
-	HtVH = mpiUtils::mpiReduce_inplace(HtVH);
+	HtVH = mpiUtils::mpiReduce_inplace(HtVH, comm);
 
 	rss = resid.squaredNorm();
-	rss = mpiUtils::mpiReduce_inplace(&rss);
+	rss = mpiUtils::mpiReduce_inplace(&rss, comm);
 }
 
 void prep_lm(const Eigen::MatrixXd &H,
@@ -47,20 +49,21 @@ void prep_lm(const Eigen::MatrixXd &H,
              EigenRefDataMatrix HtH,
              EigenRefDataMatrix HtH_inv,
              EigenRefDataMatrix Hty,
-             double &rss) {
+             double &rss,
+             MPI_Comm comm) {
 	/*** All of the heavy lifting for linear hypothesis tests.
 	 * Easier to have in one place if we go down the MPI route.
 	 */
 
 	HtH     = H.transpose() * H;
-	HtH     = mpiUtils::mpiReduce_inplace(HtH);
+	HtH     = mpiUtils::mpiReduce_inplace(HtH, comm);
 	Hty     = H.transpose() * y;
-	Hty     = mpiUtils::mpiReduce_inplace(Hty);
+	Hty     = mpiUtils::mpiReduce_inplace(Hty, comm);
 	HtH_inv = HtH.inverse();
 
 	EigenDataVector resid = y - H * HtH_inv * Hty;
 	rss = resid.squaredNorm();
-	rss = mpiUtils::mpiReduce_inplace(&rss);
+	rss = mpiUtils::mpiReduce_inplace(&rss, comm);
 }
 
 void student_t_test(long nn,
@@ -69,13 +72,14 @@ void student_t_test(long nn,
                     double rss,
                     int jj,
                     double &stat,
-                    double &pval) {
+                    double &pval,
+                    MPI_Comm comm) {
 	/* 2-sided Student t-test on regression output
 	   H0: beta[jj] != 0
 	 */
 	long pp = HtH_inv.rows();
 	assert(jj <= pp);
-	nn = mpiUtils::mpiReduce_inplace(&nn);
+	nn = mpiUtils::mpiReduce_inplace(&nn, comm);
 
 	auto beta = HtH_inv * Hty;
 	stat = beta(jj, 0);
@@ -123,12 +127,13 @@ void homo_chi_sq(long nn,
                  const double rss,
                  const int jj,
                  double &stat,
-                 double &pval) {
+                 double &pval,
+                 MPI_Comm comm) {
 	/* Essentially the square of the t-test from regression
 	 */
 	long pp = HtH_inv.rows();
 	assert(jj <= pp);
-	nn = mpiUtils::mpiReduce_inplace(&nn);
+	nn = mpiUtils::mpiReduce_inplace(&nn, comm);
 
 	auto beta = HtH_inv * Hty;
 	stat = beta(jj, 0) * beta(jj, 0);
@@ -173,56 +178,107 @@ double student_t_test(long nn,
 }
 
 template <typename GenoMat>
-void compute_LOCO_pvals(const EigenDataVector &resid_pheno,
-                        const GenoMat &Xtest,
-                        Eigen::MatrixXd &neglogPvals,
-                        Eigen::MatrixXd &testStats,
-                        const EigenDataVector &eta) {
+void compute_LOCO_sums(const EigenDataVector &resid_pheno,
+                       const GenoMat &Xtest,
+                       const EigenDataVector &eta,
+                       Eigen::MatrixXd &sums) {
+	// Column jj holds H^T H, H^T y and y^T y of the regression on variant jj,
+	// where H = [1, x_j] or for GxE tests [1, x_j, x_j * eta, eta]
 	bool isGxE     = eta.rows() > 0;
 	long n_var     = Xtest.cols();
 	long n_samples = Xtest.rows();
+	long kk        = 2 + 2 * (isGxE ? 1 : 0);
+
+	Eigen::VectorXd yy = resid_pheno.cast<double>();
+	Eigen::MatrixXd H(n_samples, kk);
+	H.col(0) = Eigen::VectorXd::Constant(n_samples, 1.0);
+	if (isGxE) H.col(3) = eta.cast<double>();
+	sums.resize(kk * kk + kk + 1, n_var);
+	for(std::uint32_t jj = 0; jj < n_var; jj++ ) {
+		H.col(1) = Xtest.col(jj);
+		if (isGxE) H.col(2) = H.col(1).cwiseProduct(eta.cast<double>());
+		Eigen::Map<Eigen::MatrixXd> HtH(sums.col(jj).data(), kk, kk);
+		HtH = H.transpose() * H;
+		sums.col(jj).segment(kk * kk, kk) = H.transpose() * yy;
+		sums(kk * kk + kk, jj) = yy.squaredNorm();
+	}
+}
+
+template <typename GenoMat>
+void compute_LOCO_hetero_sums(const EigenDataVector &resid_pheno,
+                              const GenoMat &Xtest,
+                              const EigenDataVector &eta,
+                              const Eigen::MatrixXd &sums,
+                              Eigen::MatrixXd &hetero_sums) {
+	// Column jj holds H^T diag(r^2) H and r^T r, where r are the residuals of
+	// the GxE regression on variant jj fitted from the reduced sums
+	long n_var     = Xtest.cols();
+	long n_samples = Xtest.rows();
+	long kk        = 4;
+	assert(eta.rows() > 0);
+
+	Eigen::VectorXd yy = resid_pheno.cast<double>();
+	Eigen::MatrixXd H(n_samples, kk);
+	H.col(0) = Eigen::VectorXd::Constant(n_samples, 1.0);
+	H.col(3) = eta.cast<double>();
+	hetero_sums.resize(kk * kk + 1, n_var);
+	for(std::uint32_t jj = 0; jj < n_var; jj++ ) {
+		H.col(1) = Xtest.col(jj);
+		H.col(2) = H.col(1).cwiseProduct(eta.cast<double>());
+		Eigen::Map<const Eigen::MatrixXd> HtH(sums.col(jj).data(), kk, kk);
+		Eigen::VectorXd beta = HtH.inverse() * sums.col(jj).segment(kk * kk, kk);
+
+		Eigen::VectorXd resid = yy - H * beta;
+		Eigen::Map<Eigen::MatrixXd> HtVH(hetero_sums.col(jj).data(), kk, kk);
+		HtVH = H.transpose() * resid.cwiseProduct(resid).asDiagonal() * H;
+		hetero_sums(kk * kk, jj) = resid.squaredNorm();
+	}
+}
+
+void compute_LOCO_pvals(const Eigen::MatrixXd &sums,
+                        const Eigen::MatrixXd &hetero_sums,
+                        const bool &isGxE,
+                        Eigen::MatrixXd &neglogPvals,
+                        Eigen::MatrixXd &testStats) {
+	long n_var     = sums.cols();
+	long kk        = 2 + 2 * (isGxE ? 1 : 0);
 	long n_effects = (isGxE ? 2 : 1);
-	double Nlocal  = n_samples;
-	double Nglobal = mpiUtils::mpiReduce_inplace(&Nlocal);
 
 	neglogPvals.resize(n_var, (isGxE ? 4 : 1));
 	testStats.resize(n_var, (isGxE ? 4 : 1));
 
 	// Compute p-vals per variant (p=3 as residuals mean centered)
-	Eigen::MatrixXd H(n_samples, 2 + 2 * (isGxE ? 1 : 0));
-	H.col(0) = Eigen::VectorXd::Constant(n_samples, 1.0);
-	if (isGxE) H.col(3) = eta.cast<double>();
-	boost_m::students_t t_dist(n_samples - H.cols() - 1);
-	boost_m::fisher_f f_dist(n_effects, n_samples - H.cols() - 1);
 	for(std::uint32_t jj = 0; jj < n_var; jj++ ) {
-		H.col(1) = Xtest.col(jj);
+		Eigen::MatrixXd HtH = Eigen::Map<const Eigen::MatrixXd>(sums.col(jj).data(), kk, kk);
+		Eigen::MatrixXd Hty = sums.col(jj).segment(kk * kk, kk);
+		double yty = sums(kk * kk + kk, jj);
+		long nn = std::lround(HtH(0, 0));
+		Eigen::MatrixXd HtH_inv = HtH.inverse();
 
 		double rss_alt, rss_null;
-		Eigen::MatrixXd HtH(H.cols(), H.cols()), Hty(H.cols(), 1);
-		Eigen::MatrixXd HtH_inv(H.cols(), H.cols()), HtVH(H.cols(), H.cols());
 		if(!isGxE) {
 			double beta_tstat, beta_pval;
-			prep_lm(H, resid_pheno, HtH, HtH_inv, Hty, rss_alt);
-			student_t_test(n_samples, HtH_inv, Hty, rss_alt, 1, beta_tstat, beta_pval);
+			rss_alt = yty - (Hty.transpose() * HtH_inv * Hty)(0, 0);
+			student_t_test(nn, HtH_inv, Hty, rss_alt, 1, beta_tstat, beta_pval, MPI_COMM_SELF);
 
 			neglogPvals(jj,0) = -1 * log10(beta_pval);
 			testStats(jj,0)   = beta_tstat;
 		} else {
-			H.col(2) = H.col(1).cwiseProduct(eta.cast<double>());
+			boost_m::fisher_f f_dist(n_effects, nn - kk - 1);
+			Eigen::MatrixXd HtVH = Eigen::Map<const Eigen::MatrixXd>(hetero_sums.col(jj).data(), kk, kk);
+			rss_alt = hetero_sums(kk * kk, jj);
 			try {
 				// Single-var tests
 				double beta_tstat, gam_tstat, rgam_stat, beta_pval, gam_pval, rgam_pval;
-				prep_lm(H, resid_pheno, HtH, HtH_inv, Hty, rss_alt, HtVH);
 				hetero_chi_sq(HtH_inv, Hty, HtVH, 2, rgam_stat, rgam_pval);
-				student_t_test(n_samples, HtH_inv, Hty, rss_alt, 2, gam_tstat, gam_pval);
-				student_t_test(n_samples, HtH_inv, Hty, rss_alt, 1, beta_tstat, beta_pval);
+				student_t_test(nn, HtH_inv, Hty, rss_alt, 2, gam_tstat, gam_pval, MPI_COMM_SELF);
+				student_t_test(nn, HtH_inv, Hty, rss_alt, 1, beta_tstat, beta_pval, MPI_COMM_SELF);
 
 				// F-test over main+int effects of snp_j
 				double joint_fstat, joint_pval;
-				rss_null = resid_pheno.squaredNorm();
-				rss_null = mpiUtils::mpiReduce_inplace(&rss_null);
+				rss_null = yty;
 				joint_fstat = (rss_null - rss_alt) / 2.0;
-				joint_fstat /= rss_alt / (Nglobal - 3.0);
+				joint_fstat /= rss_alt / ((double) nn - 3.0);
 				joint_pval = 1.0 - boost_m::cdf(f_dist, joint_fstat);
 
 				neglogPvals(jj, 0) = -1 * std::log10(beta_pval);
@@ -247,9 +303,32 @@ void compute_LOCO_pvals(const EigenDataVector &resid_pheno,
 	}
 }
 
+template <typename GenoMat>
+void compute_LOCO_pvals(const EigenDataVector &resid_pheno,
+                        const GenoMat &Xtest,
+                        Eigen::MatrixXd &neglogPvals,
+                        Eigen::MatrixXd &testStats,
+                        const EigenDataVector &eta,
+                        MPI_Comm comm) {
+	// One reduction for the chunk, plus one for the GxE residuals
+	bool isGxE = eta.rows() > 0;
+	Eigen::MatrixXd sums, hetero_sums;
+	compute_LOCO_sums(resid_pheno, Xtest, eta, sums);
+	sums = mpiUtils::mpiReduce_inplace(sums, comm);
+	if (isGxE) {
+		compute_LOCO_hetero_sums(resid_pheno, Xtest, eta, sums, hetero_sums);
+		hetero_sums = mpiUtils::mpiReduce_inplace(hetero_sums, comm);
+	}
+	compute_LOCO_pvals(sums, hetero_sums, isGxE, neglogPvals, testStats);
+}
+
 // Explicit instantiation
 // https://stackoverflow.com/questions/2152002/how-do-i-force-a-particular-instance-of-a-c-template-to-instantiate
 template void compute_LOCO_pvals(const EigenDataVector&, const EigenDataMatrix&,
-                                 Eigen::MatrixXd&, Eigen::MatrixXd&,const EigenDataVector&);
+                                 Eigen::MatrixXd&, Eigen::MatrixXd&,const EigenDataVector&, MPI_Comm);
 template void compute_LOCO_pvals(const EigenDataVector&, const GenotypeMatrix&,
-                                 Eigen::MatrixXd&, Eigen::MatrixXd&,const EigenDataVector&);
+                                 Eigen::MatrixXd&, Eigen::MatrixXd&,const EigenDataVector&, MPI_Comm);
+template void compute_LOCO_sums(const EigenDataVector&, const GenotypeMatrix&,
+                                const EigenDataVector&, Eigen::MatrixXd&);
+template void compute_LOCO_hetero_sums(const EigenDataVector&, const GenotypeMatrix&,
+                                       const EigenDataVector&, const Eigen::MatrixXd&, Eigen::MatrixXd&);
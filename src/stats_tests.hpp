@@ -6,20 +6,24 @@
 #include "tools/eigen3.3/Dense"
 #include "variational_parameters.hpp"
 
+#include <mpi.h>
+
 void prep_lm(const Eigen::MatrixXd& H,
              const Eigen::MatrixXd& y,
              EigenRefDataMatrix HtH,
              EigenRefDataMatrix HtH_inv,
              EigenRefDataMatrix Hty,
              double& rss,
-             EigenRefDataMatrix HtVH);
+             EigenRefDataMatrix HtVH,
+             MPI_Comm comm = MPI_COMM_WORLD);
 
 void prep_lm(const Eigen::MatrixXd& H,
              const Eigen::MatrixXd& y,
              EigenRefDataMatrix HtH,
              EigenRefDataMatrix HtH_inv,
              EigenRefDataMatrix Hty,
-             double& rss);
+             double& rss,
+             MPI_Comm comm = MPI_COMM_WORLD);
 
 void student_t_test(long nn,
                     const Eigen::MatrixXd& HtH_inv,
@@ -27,7 +31,8 @@ void student_t_test(long nn,
                     double rss,
                     int jj,
                     double& stat,
-                    double& pval);
+                    double& pval,
+                    MPI_Comm comm = MPI_COMM_WORLD);
 
 double student_t_test(long nn,
                       const Eigen::MatrixXd& HtH_inv,
@@ -53,7 +58,8 @@ void homo_chi_sq(long nn,
                  const double rss,
                  const int jj,
                  double& stat,
-                 double& pval);
+                 double& pval,
+                 MPI_Comm comm = MPI_COMM_WORLD);
 
 double homo_chi_sq(const long nn,
                    const Eigen::MatrixXd& HtH_inv,
@@ -61,11 +67,38 @@ double homo_chi_sq(const long nn,
                    const double rss,
                    const int jj);
 
+// compute_LOCO_pvals below in stages, so that the sums over samples of many
+// chunks can be reduced at once: compute_LOCO_sums() over this rank's
+// samples, then for GxE tests (eta non-empty) compute_LOCO_hetero_sums()
+// given the reduced sums, then compute_LOCO_pvals() from the reduced sums.
+// None of these make MPI calls.
+template <typename GenoMat>
+void compute_LOCO_sums(const EigenDataVector &resid_pheno,
+                       const GenoMat &Xtest,
+                       const EigenDataVector &eta,
+                       Eigen::MatrixXd &sums);
+
+template <typename GenoMat>
+void compute_LOCO_hetero_sums(const EigenDataVector &resid_pheno,
+                              const GenoMat &Xtest,
+                              const EigenDataVector &eta,
+                              const Eigen::MatrixXd &sums,
+                              Eigen::MatrixXd &hetero_sums);
+
+void compute_LOCO_pvals(const Eigen::MatrixXd &sums,
+                        const Eigen::MatrixXd &hetero_sums,
+                        const bool &isGxE,
+                        Eigen::MatrixXd &neglogPvals,
+                        Eigen::MatrixXd &testStats);
+
+// Sums over samples are reduced over comm; MPI_COMM_SELF if Xtest holds every
+// sample on this rank.
 template <typename GenoMat>
 void compute_LOCO_pvals(const EigenDataVector &resid_pheno,
                         const GenoMat &Xtest,
                         Eigen::MatrixXd &neglogPvals,
                         Eigen::MatrixXd &testStats,
-                        const EigenDataVector &eta = Eigen::VectorXd::Zero(0));
+                        const EigenDataVector &eta = Eigen::VectorXd::Zero(0),
+                        MPI_Comm comm = MPI_COMM_WORLD);
 
 #endif
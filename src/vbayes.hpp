@@ -10,6 +10,7 @@
 #include "vbayes_tracker.hpp"
 #include "hyps.hpp"
 #include "mpi_utils.hpp"
+#include "parallel_utils.hpp"
 
 #include <algorithm>
 #include <chrono>
@@ -24,6 +25,7 @@
 #include <random>
 #include <thread>
 #include <set>
+#include <sstream>
 #include "sys/types.h"
 #include "tools/eigen3.3/Dense"
 #include <boost/iostreams/filtering_stream.hpp>
@@ -73,7 +75,18 @@ public:
 	std::vector< std::vector <long> > main_back_pass_chunks, gxe_back_pass_chunks;
 	std::vector<long> env_fwd_pass, covar_fwd_pass;
 	std::vector<long> env_back_pass, covar_back_pass;
-	std::map<long, Eigen::MatrixXd> XtX_block_cache, ZtZ_block_cache;
+	std::map<long, Eigen::MatrixXd> ZtZ_block_cache;
+
+// Strict upper triangles of the main effect LD blocks D^T D in float,
+// packed by column and indexed by chunk of main_fwd_pass_chunks. The
+// backward pass reads the same blocks in reverse.
+	std::vector<float> XtX_block_arena;
+	std::vector<std::size_t> XtX_block_offset;
+
+// Keys of the --ldblock-cache files; ZtZ_block_cache is only persisted when
+// n_env == 1, as otherwise it is recomputed every pass
+	std::uint64_t ldblock_data_key, XtX_cache_key, ZtZ_cache_key;
+	bool XtX_cache_hit, ZtZ_cache_hit;
 
 // Data
 	GenotypeMatrix&  X;
@@ -84,7 +97,7 @@ public:
 	Eigen::MatrixXd CtCRidgeInv;
 
 	Eigen::ArrayXXd& dXtEEX_lowertri;
-	std::unordered_map<long, bool> sample_is_invalid;
+	SampleMask sample_mask;
 	std::map<long, int> sample_location;
 
 // Global location of y_m = E[X beta] and y_x = E[X gamma]
@@ -112,7 +125,7 @@ public:
 		p(dat.p),
 		hyps_inits(dat.hyps_inits),
 		sample_location(dat.sample_location),
-		sample_is_invalid(dat.sample_is_invalid),
+		sample_mask(dat.sample_mask),
 		vp_init(dat.vp_init){
 		MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 #ifdef EIGEN_USE_MKL_ALL
@@ -176,6 +189,30 @@ public:
 			covar_back_pass.push_back(n_covar - ll - 1);
 		}
 
+		// Generate initial values for each run
+		if(p.mode_random_start) {
+			std::cout << "Beta and gamma initialised with random draws" << std::endl;
+		}
+
+		// Initialise summary vars for vp_init
+		if(n_env > 0) {
+			vp_init.eta     = E * vp_init.muw.matrix().cast<scalarData>();
+			vp_init.eta_sq  = vp_init.eta.array().square().matrix();
+			vp_init.eta_sq += E.cwiseProduct(E) * vp_init.sw_sq.matrix().template cast<scalarData>();
+		}
+		calcPredEffects(vp_init);
+
+		// The LD block caches are keyed on the data alone and record the
+		// chunk sizes they were built with; a matching cache skips calibration
+		if(p.ldblock_cache_file != "NULL") {
+			ldblock_data_key = ldblock_cache_hash();
+			XtX_cache_key = ldblock_data_key;
+			fileUtils::hash_field(XtX_cache_key, std::string("xtx"));
+		}
+		if(p.auto_chunk_size && !read_cached_chunk_sizes()) {
+			tune_chunk_sizes();
+		}
+
 		// ceiling of n_var / chunk size
 		long n_main_segs, n_gxe_segs;
 		n_main_segs = (n_var + p.main_chunk_size - 1) / p.main_chunk_size;
@@ -206,19 +243,6 @@ public:
 			gxe_fwd_pass_chunks.clear();
 		}
 
-		// Generate initial values for each run
-		if(p.mode_random_start) {
-			std::cout << "Beta and gamma initialised with random draws" << std::endl;
-		}
-
-		// Initialise summary vars for vp_init
-		if(n_env > 0) {
-			vp_init.eta     = E * vp_init.muw.matrix().cast<scalarData>();
-			vp_init.eta_sq  = vp_init.eta.array().square().matrix();
-			vp_init.eta_sq += E.cwiseProduct(E) * vp_init.sw_sq.matrix().template cast<scalarData>();
-		}
-		calcPredEffects(vp_init);
-
 		// Cache Cty
 		if(n_covar > 0) {
 			if (p.debug) std::cout << "Caching Cty" << std::endl;
@@ -229,33 +253,294 @@ public:
 		}
 
 		// Update main effects
-		cache_local_ldblocks(main_fwd_pass_chunks, true);
-		cache_local_ldblocks(main_back_pass_chunks, false);
+		ZtZ_cache_hit = false;
+		if(p.ldblock_cache_file != "NULL" && n_env == 1 && p.gxe_chunk_size > 1) {
+			ZtZ_cache_key = ldblock_data_key;
+			fileUtils::hash_field(ZtZ_cache_key, std::string("ztz"));
+			fileUtils::hash_field(ZtZ_cache_key, p.gxe_chunk_size);
+			fileUtils::hash_field(ZtZ_cache_key, eta_sq_hash());
+			ZtZ_cache_hit = read_ldblock_cache(p.ldblock_cache_file + ".ztz.bin", [this](const std::string& file){
+				return fileUtils::read_ztz_block_cache(file, ZtZ_cache_key, ZtZ_block_cache);
+			});
+			if(!ZtZ_cache_hit) ZtZ_block_cache.clear();
+		}
+		cache_local_ldblocks();
 	}
 
-	void cache_local_ldblocks(std::vector<std::vector<long> >iter_chunks, bool is_fwd_pass){
-		EigenDataMatrix D;
-		for (std::uint32_t ch = 0; ch < iter_chunks.size(); ch++) {
-			std::vector<long> chunk = iter_chunks[ch];
-			int ee = chunk[0] / n_var;
+	bool read_cached_chunk_sizes(){
+		// Chunk sizes of the run that built a matching --ldblock-cache
+		if(p.ldblock_cache_file == "NULL") return false;
+		unsigned int main_chunk_size = 0, gxe_chunk_size = 0;
+		bool cache_hit = read_ldblock_cache(p.ldblock_cache_file + ".xtx.bin", [&](const std::string& file){
+			return fileUtils::read_xtx_block_cache_chunk_sizes(file, XtX_cache_key, main_chunk_size, gxe_chunk_size);
+		});
+		if(!cache_hit) return false;
+
+		p.main_chunk_size = main_chunk_size;
+		p.gxe_chunk_size = gxe_chunk_size;
+		std::cout << "Reusing chunk sizes from LD block cache: main chunk size " << p.main_chunk_size;
+		if(n_effects > 1) {
+			std::cout << " and gxe chunk size " << p.gxe_chunk_size;
+		}
+		std::cout << std::endl;
+		return true;
+	}
+
+	void tune_chunk_sizes(){
+		if(p.mixed_precision) {
+			_internal_tune_chunk_sizes<Eigen::MatrixXf>();
+		} else {
+			_internal_tune_chunk_sizes<Eigen::MatrixXd>();
+		}
+	}
+
+	template <typename EigenMat>
+	void _internal_tune_chunk_sizes(){
+		// Short calibration of main_chunk_size and gxe_chunk_size: each
+		// candidate is timed on a sample of real chunks and the one with the
+		// fewest seconds per variant on the slowest rank is kept, amongst
+		// those whose LD block caches fit in what is left of maxBytesPerRank
+		std::vector<long> main_sizes = {16, 32, 64, 128, 256};
+		std::vector<long> gxe_sizes = {1, 2, 4, 8, 16, 32};
+
+		long long bytes_free = p.maxBytesPerRank;
+#ifndef OSX
+		long long kbLocal = fileUtils::getValueRAM(), kbMax;
+		MPI_Allreduce(&kbLocal, &kbMax, 1, MPI_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+		bytes_free -= kbMax * 1000;
+#endif
+
+		auto pick = [&](const std::vector<long>& sizes, int ee) {
+			long best = std::min(sizes[0], n_var);
+			double best_time = std::numeric_limits<double>::max();
+			for (long ch_len : sizes) {
+				if(ch_len > n_var && ch_len != sizes[0]) break;
+				ch_len = std::min(ch_len, n_var);
+				long long cache_bytes;
+				if(ee == 0) {
+					cache_bytes = (long long) n_var * (ch_len - 1) / 2 * sizeof(float);
+				} else {
+					cache_bytes = (n_env == 1 && ch_len > 1) ? 2LL * n_var * ch_len * sizeof(double) : 0;
+				}
+				if(cache_bytes > bytes_free && ch_len != sizes[0]) break;
+
+				double secsLocal = time_chunk_size<EigenMat>(ch_len, ee), secs;
+				MPI_Allreduce(&secsLocal, &secs, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+				if(p.debug) {
+					std::cout << " - " << (ee == 0 ? "main" : "gxe") << " chunk size " << ch_len << ": ";
+					std::cout << secs * 1e6 << " us per variant" << std::endl;
+				}
+				if(secs < best_time) {
+					best = ch_len;
+					best_time = secs;
+				}
+			}
+			return best;
+		};
+
+		std::cout << "Calibrating VB chunk sizes" << std::endl;
+		p.main_chunk_size = (unsigned int) pick(main_sizes, 0);
+		if(n_effects > 1) {
+			p.gxe_chunk_size = (unsigned int) pick(gxe_sizes, 1);
+		}
+		std::cout << " - chose main chunk size " << p.main_chunk_size;
+		if(n_effects > 1) {
+			std::cout << " and gxe chunk size " << p.gxe_chunk_size;
+		}
+		std::cout << std::endl;
+	}
+
+	template <typename EigenMat>
+	double time_chunk_size(long ch_len, int ee){
+		// Seconds per variant of updateAlphaMu on chunks of ch_len variants,
+		// averaged over a few chunks spread across the genome. Updates run on
+		// fresh copies of vp_init, and main effects read a zeroed LD block
+		// standing in for the arena; both are discarded afterwards.
+		typedef typename EigenMat::Scalar Scalar;
+		long n_probes = std::min(3L, n_var / ch_len);
+		unsigned int gxe_chunk_size = p.gxe_chunk_size;
+		if(ee == 1) p.gxe_chunk_size = (unsigned int) ch_len;
+
+		std::vector<Hyps> all_hyps = hyps_inits;
+		std::vector<VariationalParameters> all_vp;
+		setup_variational_params(all_hyps, all_vp);
+		long n_grid = all_hyps.size();
+
+		XtX_block_offset = {0, (std::size_t) (ch_len * (ch_len - 1) / 2)};
+		XtX_block_arena.assign(XtX_block_offset[1], 0.0f);
+
+		EigenMat D(n_samples, ch_len);
+		Eigen::MatrixXd AAlocal, AA(ch_len, n_grid), rr_diff(ch_len, n_grid);
+		std::chrono::duration<double> elapsed(0);
+		for (long kk = 0; kk < n_probes; kk++) {
+			long start = (n_probes > 1) ? kk * (n_var - ch_len) / (n_probes - 1) : 0;
+			std::vector<long> chunk(ch_len);
+			for (long ii = 0; ii < ch_len; ii++) {
+				chunk[ii] = start + ii + ee * n_var;
+			}
+
+			// With one environment interaction blocks are only computed in
+			// the first pass, so time a later pass
+			if(ee == 1 && n_env == 1 && ch_len > 1) {
+				X.col_block3(chunk, D);
+				ZtZ_block_cache[kk] = computeCorrBlocks(D, all_vp, {0});
+			}
+
+			auto t0 = std::chrono::system_clock::now();
+			X.col_block3(chunk, D);
+			AAlocal = computeGeneResidualCorrelation(D, ee);
+			mpiUtils::mpiReduce_double(AAlocal.data(), AA.data(), AAlocal.size());
+			adjustParams(kk, 0, true, chunk, D, AA, all_hyps, all_vp, rr_diff);
+			if(ee == 0) {
+				YM.noalias() += (D * rr_diff.cast<Scalar>()).template cast<scalarData>();
+			} else {
+				YX.noalias() += (D * rr_diff.cast<Scalar>()).template cast<scalarData>();
+			}
+			elapsed += std::chrono::system_clock::now() - t0;
+		}
+
+		p.gxe_chunk_size = gxe_chunk_size;
+		ZtZ_block_cache.clear();
+		XtX_block_offset.clear();
+		XtX_block_arena.clear();
+		return elapsed.count() / (n_probes * ch_len);
+	}
+
+	void cache_local_ldblocks(){
+		XtX_cache_hit = false;
+		if(p.ldblock_cache_file != "NULL") {
+			std::string cache_file = p.ldblock_cache_file + ".xtx.bin";
+			XtX_cache_hit = read_ldblock_cache(cache_file, [this](const std::string& file){
+				return fileUtils::read_xtx_block_cache(file, XtX_cache_key, p.main_chunk_size, XtX_block_offset, XtX_block_arena) &&
+				       XtX_block_offset.size() == main_fwd_pass_chunks.size() + 1;
+			});
+			if(XtX_cache_hit) {
+				std::cout << "Read LD blocks from cache " << cache_file << std::endl;
+				return;
+			}
+		}
+
+		if(p.mixed_precision) {
+			_internal_cache_local_ldblocks<Eigen::MatrixXf>();
+		} else {
+			_internal_cache_local_ldblocks<Eigen::MatrixXd>();
+		}
+		if(p.debug) {
+			std::cout << "Cached LD blocks of " << main_fwd_pass_chunks.size() << " chunks in ";
+			std::cout << XtX_block_arena.size() * sizeof(float) / 1000.0 / 1000.0 << " MB" << std::endl;
+		}
+
+		if(p.ldblock_cache_file != "NULL" && world_rank == 0) {
+			std::string cache_file = p.ldblock_cache_file + ".xtx.bin";
+			fileUtils::write_xtx_block_cache(cache_file, XtX_cache_key, p.main_chunk_size, p.gxe_chunk_size,
+			                                 XtX_block_offset, XtX_block_arena);
+			std::cout << "Wrote LD blocks to cache " << cache_file << std::endl;
+		}
+	}
+
+	template <typename Reader>
+	bool read_ldblock_cache(const std::string& file, const Reader& reader){
+		// LD blocks are identical on every rank, so all ranks read the file
+		// written by rank 0; fall back to recomputing unless all ranks hit
+		bool cache_hit = reader(file);
+		return mpiUtils::mpiReduce_inplace((double) cache_hit) == mpiUtils::mpiReduce_inplace(1.0);
+	}
+
+	std::uint64_t ldblock_cache_hash() const {
+		// Everything except chunking that determines the LD blocks: the
+		// genotype data, the variants kept and the valid samples
+		std::uint64_t hash = fileUtils::fnv_offset_basis;
+		if(p.bgen_file != "NULL") {
+			fileUtils::hash_field(hash, p.bgen_file);
+			fileUtils::hash_field(hash, (std::uint64_t) boost::filesystem::file_size(p.bgen_file));
+			fileUtils::hash_field(hash, (std::int64_t) boost::filesystem::last_write_time(p.bgen_file));
+		}
+		fileUtils::hash_field(hash, p.flip_high_maf_variants);
+		fileUtils::hash_field(hash, p.low_mem);
+		fileUtils::hash_field(hash, p.genotype_bits);
+		fileUtils::hash_field(hash, p.mixed_precision);
+		fileUtils::hash_field(hash, n_var);
+		for (long jj = 0; jj < n_var; jj++) {
+			fileUtils::hash_field(hash, X.chromosome[jj]);
+			fileUtils::hash_field(hash, X.position[jj]);
+			fileUtils::hash_field(hash, X.SNPID[jj]);
+			fileUtils::hash_field(hash, X.al_0[jj]);
+			fileUtils::hash_field(hash, X.al_1[jj]);
+		}
+		for (const auto& kv : sample_location) {
+			if(kv.second >= 0) fileUtils::hash_field(hash, kv.first);
+		}
+		return hash;
+	}
+
+	std::uint64_t eta_sq_hash() const {
+		// Hash of E[eta^2] over all valid samples in file order
+		Eigen::MatrixXd eta_sq = mpiUtils::allgather_rows(vp_init.eta_sq.cast<double>());
+		std::uint64_t hash = fileUtils::fnv_offset_basis;
+		fileUtils::hash_bytes(hash, eta_sq.data(), eta_sq.size() * sizeof(double));
+		return hash;
+	}
+
+	template <typename EigenMat>
+	void _internal_cache_local_ldblocks(){
+		// Upper triangle of D^T D by SYRK, reduced across ranks in double
+		// and only then narrowed to float
+		long n_chunks = main_fwd_pass_chunks.size();
+		XtX_block_offset.resize(n_chunks + 1);
+		XtX_block_offset[0] = 0;
+		for (long ch = 0; ch < n_chunks; ch++) {
+			long ch_len = main_fwd_pass_chunks[ch].size();
+			XtX_block_offset[ch + 1] = XtX_block_offset[ch] + ch_len * (ch_len - 1) / 2;
+		}
+		XtX_block_arena.resize(XtX_block_offset[n_chunks]);
+
+		EigenMat D, DtD;
+		std::vector<double> packed_local, packed_global;
+		for (long ch = 0; ch < n_chunks; ch++) {
+			const std::vector<long>& chunk = main_fwd_pass_chunks[ch];
 			long ch_len = chunk.size();
 			if (D.cols() != ch_len) {
 				D.resize(n_samples, ch_len);
 			}
 			X.col_block3(chunk, D);
 
-			unsigned long memoize_id = ((is_fwd_pass) ? ch : ch + iter_chunks.size());
-			if (XtX_block_cache.count(memoize_id) == 0) {
-				if (p.n_thread == 1) {
-					Eigen::MatrixXd D_corr(ch_len, ch_len);
-					D_corr.triangularView<Eigen::StrictlyUpper>() = (D.transpose() * D).template cast<double>();
-					XtX_block_cache[memoize_id] = D_corr;
+			DtD.setZero(ch_len, ch_len);
+			DtD.template selfadjointView<Eigen::Upper>().rankUpdate(D.transpose());
+
+			std::size_t n_packed = XtX_block_offset[ch + 1] - XtX_block_offset[ch];
+			packed_local.resize(n_packed);
+			packed_global.resize(n_packed);
+			for (long jj = 1; jj < ch_len; jj++) {
+				for (long ii = 0; ii < jj; ii++) {
+					packed_local[strict_upper_index(ii, jj)] = DtD(ii, jj);
+				}
+			}
+			mpiUtils::mpiReduce_double(packed_local.data(), packed_global.data(), n_packed);
+			std::copy(packed_global.begin(), packed_global.end(), XtX_block_arena.begin() + XtX_block_offset[ch]);
+		}
+	}
+
+	static std::size_t strict_upper_index(long ii, long jj){
+		// Position of (ii, jj), ii < jj, in a strict upper triangle packed by column
+		return jj * (jj - 1) / 2 + ii;
+	}
+
+	Eigen::MatrixXd unpack_ld_block(long ld_block, bool is_fwd_pass){
+		// Strict upper triangle of a cached LD block in double, in the order
+		// of the forward or backward pass chunk
+		long ch_len = main_fwd_pass_chunks[ld_block].size();
+		const float* XtX = XtX_block_arena.data() + XtX_block_offset[ld_block];
+		Eigen::MatrixXd D_corr = Eigen::MatrixXd::Zero(ch_len, ch_len);
+		for (long jj = 1; jj < ch_len; jj++) {
+			for (long ii = 0; ii < jj; ii++) {
+				if (is_fwd_pass) {
+					D_corr(ii, jj) = XtX[strict_upper_index(ii, jj)];
 				} else {
-					XtX_block_cache[memoize_id] = (D.transpose() * D).template cast<double>();
+					D_corr(ii, jj) = XtX[strict_upper_index(ch_len - 1 - jj, ch_len - 1 - ii)];
 				}
-				XtX_block_cache[memoize_id] = mpiUtils::mpiReduce_inplace(XtX_block_cache[memoize_id]);
 			}
 		}
+		return D_corr;
 	}
 
 	void run(){
@@ -279,6 +564,17 @@ public:
 		std::vector< VbTracker > trackers(n_grid, p);
 		run_inference(hyps_inits, false, 2, trackers);
 		write_converged_hyperparams_to_file("", trackers, n_grid);
+
+		write_ztz_ldblock_cache();
+	}
+
+	void write_ztz_ldblock_cache(){
+		// Interaction LD blocks are filled in during the first pass
+		if(p.ldblock_cache_file != "NULL" && n_env == 1 && p.gxe_chunk_size > 1 && !ZtZ_cache_hit && world_rank == 0) {
+			std::string cache_file = p.ldblock_cache_file + ".ztz.bin";
+			fileUtils::write_ztz_block_cache(cache_file, ZtZ_cache_key, ZtZ_block_cache);
+			std::cout << "Wrote interaction LD blocks to cache " << cache_file << std::endl;
+		}
 	}
 
 	void run_inference(const std::vector<Hyps>& hyps_inits,
@@ -288,7 +584,8 @@ public:
 		// Writes results from inference to trackers
 
 		long n_grid = hyps_inits.size();
-		// Parrallel starts swapped for multithreaded inference
+		// Parrallel starts swapped for multithreaded inference; grid points
+		// are instead updated concurrently within adjustParams
 		int n_thread = 1;
 
 		// Divide grid of hyperparameters into chunks for multithreading
@@ -442,7 +739,7 @@ public:
 					all_tracker[nn].dump_state(std::to_string(count), n_samples, n_covar, n_var,
 					                           n_env, n_effects,
 					                           all_vp[nn], all_hyps[nn], Y, C,
-					                           X, covar_names, env_names, sample_is_invalid,
+					                           X, covar_names, env_names, sample_mask,
 					                           sample_location);
 				}
 			}
@@ -507,7 +804,7 @@ public:
 			all_tracker[nn].dump_state("_converged", n_samples, n_covar, n_var,
 			                           n_env, n_effects,
 			                           all_vp[nn], all_hyps[nn], Y, C,
-			                           X, covar_names, env_names, sample_is_invalid, sample_location);
+			                           X, covar_names, env_names, sample_mask, sample_location);
 		}
 
 		// Log all things that we want to track
@@ -675,49 +972,93 @@ public:
 	                   const bool& is_fwd_pass,
 	                   std::vector<double> logw_prev,
 	                   const long& count){
+		// Genotype panels in float or double; residuals, XtX caches and
+		// parameter updates stay in double either way
+		if(p.mixed_precision) {
+			_internal_updateAlphaMu<Eigen::MatrixXf>(iter_chunks, all_hyps, all_vp, is_fwd_pass, logw_prev, count);
+		} else {
+			_internal_updateAlphaMu<Eigen::MatrixXd>(iter_chunks, all_hyps, all_vp, is_fwd_pass, logw_prev, count);
+		}
+	}
+
+	template <typename EigenMat>
+	void _internal_updateAlphaMu(const std::vector< std::vector<long> >& iter_chunks,
+	                             const std::vector<Hyps>& all_hyps,
+	                             std::vector<VariationalParameters>& all_vp,
+	                             const bool& is_fwd_pass,
+	                             std::vector<double> logw_prev,
+	                             const long& count){
 		// Divide updates into chunks
-		// Partition chunks amongst available threads
+		// Software pipelined: while the residual correlations of chunk ch are
+		// reduced across ranks, chunk ch + 1 is decompressed into the other
+		// genotype panel. Decompression does not depend on the residuals, so
+		// only the GEMM has to wait for the previous chunk's update.
+		typedef typename EigenMat::Scalar Scalar;
 		unsigned long n_grid = all_hyps.size();
-		EigenDataMatrix D;
+		// D is n_samples x snp_batch
+		EigenMat D_panels[2];
 		// snp_batch x n_grid
-		Eigen::MatrixXd AA;
+		Eigen::MatrixXd AA, AAlocal;
 		// snp_batch x n_grid
 		Eigen::MatrixXd rr_diff;
+		if(iter_chunks.empty()) return;
+
+		// Chunks are decompressed a few columns at a time, testing the pending
+		// allreduce in between so that MPI can progress it without relying on
+		// an asynchronous progress thread
+		auto load_chunk = [this](const std::vector<long>& chunk, EigenMat& D, MPI_Request* request) {
+			const long panel_cols = 8;
+			long ch_len = chunk.size();
+			if(D.cols() != ch_len) {
+				D.resize(n_samples, ch_len);
+			}
+			int done = (request == nullptr);
+			for (long c0 = 0; c0 < ch_len; c0 += panel_cols) {
+				long nc = std::min(panel_cols, ch_len - c0);
+				std::vector<long> panel(chunk.begin() + c0, chunk.begin() + c0 + nc);
+				auto D_panel = D.middleCols(c0, nc);
+				X.col_block3(panel, D_panel);
+				if(!done) {
+					MPI_Test(request, &done, MPI_STATUS_IGNORE);
+				}
+			}
+		};
+		load_chunk(iter_chunks[0], D_panels[0], nullptr);
 
 		for (std::uint32_t ch = 0; ch < iter_chunks.size(); ch++) {
-			std::vector<long> chunk = iter_chunks[ch];
+			const std::vector<long>& chunk = iter_chunks[ch];
 			int ee                 = chunk[0] / n_var;
 			long ch_len   = chunk.size();
+			EigenMat& D   = D_panels[ch % 2];
 
-			// D is n_samples x snp_batch
-			if(D.cols() != ch_len) {
-				D.resize(n_samples, ch_len);
-			}
 			if(rr_diff.rows() != ch_len) {
 				rr_diff.resize(ch_len, n_grid);
 			}
 			if(AA.rows() != ch_len) {
 				AA.resize(ch_len, n_grid);
 			}
-			X.col_block3(chunk, D);
 
 			// Most work done here
 			// AA is snp_batch x n_grid
-			AA = computeGeneResidualCorrelation(D, ee);
+			AAlocal = computeGeneResidualCorrelation(D, ee);
+			MPI_Request request;
+			MPI_Iallreduce(AAlocal.data(), AA.data(), AAlocal.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &request);
+			if(ch + 1 < iter_chunks.size()) {
+				load_chunk(iter_chunks[ch + 1], D_panels[(ch + 1) % 2], &request);
+			}
+			MPI_Wait(&request, MPI_STATUS_IGNORE);
 
 			// Update parameters based on AA
-			for (int nn = 0; nn < n_grid; nn++) {
-				Eigen::Ref<Eigen::VectorXd> A = AA.col(nn);
-
-				unsigned long memoize_id = ((is_fwd_pass) ? ch : ch + iter_chunks.size());
-				adjustParams(nn, memoize_id, chunk, D, A, all_hyps, all_vp, rr_diff);
-			}
+			// Backward pass main effect chunks are forward chunks reversed
+			unsigned long memoize_id = ((is_fwd_pass) ? ch : ch + iter_chunks.size());
+			long ld_block = ((is_fwd_pass) ? ch : iter_chunks.size() - 1 - ch);
+			adjustParams(memoize_id, ld_block, is_fwd_pass, chunk, D, AA, all_hyps, all_vp, rr_diff);
 
 			// Update residuals
 			if(ee == 0) {
-				YM.noalias() += D * rr_diff.cast<scalarData>();
+				YM.noalias() += (D * rr_diff.cast<Scalar>()).template cast<scalarData>();
 			} else {
-				YX.noalias() += D * rr_diff.cast<scalarData>();
+				YX.noalias() += (D * rr_diff.cast<Scalar>()).template cast<scalarData>();
 			}
 
 			if(p.debug) {
@@ -734,76 +1075,118 @@ public:
 		}
 	}
 
-	void adjustParams(const int& nn, const unsigned long& memoize_id,
+	template <typename EigenMat>
+	void adjustParams(const unsigned long& memoize_id,
+	                  const long& ld_block,
+	                  const bool& is_fwd_pass,
 	                  const std::vector<long>& chunk,
-	                  const EigenDataMatrix& D,
-	                  const Eigen::Ref<const Eigen::VectorXd>& A,
+	                  const EigenMat& D,
+	                  const Eigen::Ref<const Eigen::MatrixXd>& AA,
 	                  const std::vector<Hyps>& all_hyps,
 	                  std::vector<VariationalParameters>& all_vp,
 	                  Eigen::Ref<Eigen::MatrixXd> rr_diff){
-
+		// Grid points are updated concurrently, dealt round-robin over
+		// p.n_thread threads; each writes only its own vp and column of
+		// rr_diff. Interaction correlation blocks (and so every MPI call and
+		// insert into ZtZ_block_cache) are computed on this thread first, so
+		// that workers only read them.
 		int ee                 = chunk[0] / n_var;
-		unsigned long ch_len   = chunk.size();
-		Eigen::MatrixXd Dlocal(ch_len, ch_len), Dglobal(ch_len, ch_len);
-		if (ee == 0) {
-			if (XtX_block_cache.count(memoize_id) == 0) {
-				if(p.n_thread == 1) {
-					Dlocal.triangularView<Eigen::StrictlyUpper>() = (D.transpose() * D).template cast<double>();
-				} else {
-					Dlocal = (D.transpose() * D).template cast<double>();
-				}
-				MPI_Allreduce(Dlocal.data(), Dglobal.data(), Dlocal.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-				XtX_block_cache[memoize_id] = Dglobal;
+		long ch_len            = chunk.size();
+		long n_grid            = all_hyps.size();
+
+		// Main effects read XtX_block_arena. Column block nn * ch_len of ZtZ
+		// is used by grid point nn, or block 0 by all of them if shared is true
+		bool shared = true;
+		Eigen::MatrixXd ZtZ;
+		if (ee == 1 && p.gxe_chunk_size > 1) {
+			auto it = ZtZ_block_cache.find(memoize_id);
+			if (n_env == 1 && it != ZtZ_block_cache.end()) {
+				ZtZ = it->second;
+			} else if (n_env == 1) {
+				ZtZ = computeCorrBlocks(D, all_vp, {0});
+				ZtZ_block_cache[memoize_id] = ZtZ;
+			} else {
+				std::vector<long> grid_index(n_grid);
+				for (long nn = 0; nn < n_grid; nn++) grid_index[nn] = nn;
+				ZtZ = computeCorrBlocks(D, all_vp, grid_index);
+				shared = false;
 			}
-			_internal_updateAlphaMu_beta(chunk, A, XtX_block_cache[memoize_id], all_hyps[nn], all_vp[nn], rr_diff.col(nn));
-		} else {
-			if(p.gxe_chunk_size > 1) {
-				auto it = ZtZ_block_cache.find(memoize_id);
-				if (n_env == 1 && it != ZtZ_block_cache.end()) {
-					Dglobal = ZtZ_block_cache[memoize_id];
-				} else if(p.n_thread == 1) {
-					Dlocal.triangularView<Eigen::StrictlyUpper>() = (D.transpose() * all_vp[nn].eta_sq.asDiagonal() * D).template cast<double>();
-					MPI_Allreduce(Dlocal.data(), Dglobal.data(), Dlocal.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-				} else {
-					Dlocal = (D.transpose() * all_vp[nn].eta_sq.asDiagonal() * D).template cast<double>();
-					MPI_Allreduce(Dlocal.data(), Dglobal.data(), Dlocal.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-				}
+		} else if (ee == 1) {
+			ZtZ = Eigen::MatrixXd::Zero(ch_len, ch_len);
+		}
 
-				if(n_env == 1 && it == ZtZ_block_cache.end()) {
-					ZtZ_block_cache[memoize_id] = Dglobal;
-				}
+		auto update_grid_point = [&](long nn) {
+			long offset = shared ? 0 : nn * ch_len;
+			if (ee == 0) {
+				_internal_updateAlphaMu_beta(chunk, ld_block, is_fwd_pass, AA.col(nn), all_hyps[nn], all_vp[nn], rr_diff.col(nn));
+			} else {
+				_internal_updateAlphaMu_gam(chunk, AA.col(nn), ZtZ.middleCols(offset, ch_len), all_hyps[nn], all_vp[nn], rr_diff.col(nn));
+			}
+		};
+
+		long n_thread = std::max(1L, std::min((long) p.n_thread, n_grid));
+		parallelUtils::parallel_for(n_thread, [&](long tt) {
+			for (long nn = tt; nn < n_grid; nn += n_thread) {
+				update_grid_point(nn);
+			}
+		});
+	}
+
+	template <typename EigenMat>
+	Eigen::MatrixXd computeCorrBlocks(const EigenMat& D,
+	                                  const std::vector<VariationalParameters>& all_vp,
+	                                  const std::vector<long>& grid_index){
+		// ch_len x ch_len blocks D^T diag(eta_sq) D for each grid point
+		// listed, side by side and reduced across ranks
+		// with one allreduce. Products are left to Eigen's own threads. With
+		// a single thread only the strict upper triangle is set, as used by
+		// _internal_updateAlphaMu_*.
+		typedef typename EigenMat::Scalar Scalar;
+		long ch_len = D.cols();
+		long n_blocks = grid_index.size();
+		Eigen::MatrixXd Dlocal(ch_len, ch_len * n_blocks), Dglobal(ch_len, ch_len * n_blocks);
+		EigenMat DtD;
+		for (long kk = 0; kk < n_blocks; kk++) {
+			long nn = grid_index[kk];
+			DtD.noalias() = D.transpose() * all_vp[nn].eta_sq.template cast<Scalar>().asDiagonal() * D;
+			Eigen::Ref<Eigen::MatrixXd> block = Dlocal.middleCols(kk * ch_len, ch_len);
+			if (p.n_thread == 1) {
+				block.triangularView<Eigen::StrictlyUpper>() = DtD.template cast<double>();
+			} else {
+				block = DtD.template cast<double>();
 			}
-			_internal_updateAlphaMu_gam(chunk, A, Dglobal, all_hyps[nn], all_vp[nn], rr_diff.col(nn));
 		}
+		MPI_Allreduce(Dlocal.data(), Dglobal.data(), Dlocal.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		return Dglobal;
 	}
 
 	template <typename EigenMat>
 	Eigen::MatrixXd computeGeneResidualCorrelation(const EigenMat& D,
 	                                               const int& ee){
 		// Most work done here
-		// variant correlations with residuals
+		// variant correlations with residuals on this rank; products at the
+		// precision of D, returned in double for the caller to reduce
+		typedef typename EigenMat::Scalar Scalar;
 		EigenMat resLocal;
 		if(n_effects == 1) {
 			// Main effects update in main effects only model
-			resLocal.noalias() = (YY - YM).transpose() * D;
+			resLocal.noalias() = (YY - YM).transpose().template cast<Scalar>() * D;
 			resLocal.transposeInPlace();
 		} else if (ee == 0) {
 			// Main effects update in interaction model
-			resLocal.noalias() = (YY - YM - YX.cwiseProduct(ETA)).transpose() * D;
+			resLocal.noalias() = (YY - YM - YX.cwiseProduct(ETA)).transpose().template cast<Scalar>() * D;
 			resLocal.transposeInPlace();
 		} else {
 			// Interaction effects
-			resLocal.noalias() = D.transpose() * ((YY - YM).cwiseProduct(ETA) - YX.cwiseProduct(ETA_SQ));
+			resLocal.noalias() = D.transpose() * ((YY - YM).cwiseProduct(ETA) - YX.cwiseProduct(ETA_SQ)).template cast<Scalar>();
 		}
-		EigenMat resGlobal(resLocal.rows(), resLocal.cols());
-		// long P = resLocal.rows() * resLocal.cols();
-		mpiUtils::mpiReduce_double(resLocal.data(), resGlobal.data(), resLocal.size());
-		return(resGlobal.template cast<double>());
+		return(resLocal.template cast<double>());
 	}
 
 	void _internal_updateAlphaMu_beta(const std::vector<long>& iter_chunk,
+	                                  const long& ld_block,
+	                                  const bool& is_fwd_pass,
 	                                  const Eigen::Ref<const Eigen::VectorXd>& A,
-	                                  const Eigen::Ref<const Eigen::MatrixXd>& D_corr,
 	                                  const Hyps& hyps,
 	                                  VariationalParameters& vp,
 	                                  Eigen::Ref<Eigen::MatrixXd> rr_k_diff){
@@ -820,6 +1203,9 @@ public:
 		}
 
 		// adjust updates within chunk
+		// (mm, ii) of a backward pass chunk is (ch_len-1-ii, ch_len-1-mm) of
+		// its forward block
+		const float* XtX = XtX_block_arena.data() + XtX_block_offset[ld_block];
 		Eigen::VectorXd rr_k(ch_len);
 		assert(rr_k_diff.rows() == ch_len);
 		for (int ii = 0; ii < ch_len; ii++) {
@@ -836,8 +1222,16 @@ public:
 
 			// Update mu
 			double offset = rr_k(ii) * (Nglobal-1.0);
-			for (int mm = 0; mm < ii; mm++) {
-				offset -= rr_k_diff(mm, 0) * D_corr(mm, ii);
+			if (is_fwd_pass) {
+				const float* XtX_col = XtX + strict_upper_index(0, ii);
+				for (int mm = 0; mm < ii; mm++) {
+					offset -= rr_k_diff(mm, 0) * (double) XtX_col[mm];
+				}
+			} else {
+				long kk = ch_len - 1 - ii;
+				for (int mm = 0; mm < ii; mm++) {
+					offset -= rr_k_diff(mm, 0) * (double) XtX[strict_upper_index(kk, ch_len - 1 - mm)];
+				}
 			}
 			double AA = A(ii) + offset;
 			vp.mu1_beta(jj)                            = vp.s1_beta_sq(jj) * AA / hyps.sigma;
@@ -853,7 +1247,9 @@ public:
 
 			rr_k_diff(ii, 0) = vp.mean_beta(jj) - rr_k(ii);
 
-			check_nan(vp.alpha_beta(jj), ff_k, offset, hyps, iter_chunk[ii], rr_k_diff, A, D_corr, vp, alpha_cnst);
+			if(std::isnan(vp.alpha_beta(jj))) {
+				check_nan(vp.alpha_beta(jj), ff_k, offset, hyps, iter_chunk[ii], rr_k_diff, A, unpack_ld_block(ld_block, is_fwd_pass), vp, alpha_cnst);
+			}
 		}
 	}
 
@@ -1038,11 +1434,7 @@ public:
 
 		// Recompute eta_sq
 		vp.eta_sq  = vp.eta.array().square().matrix();
-#ifdef DATA_AS_FLOAT
-		vp.eta_sq += E.cwiseProduct(E) * vp.sw_sq.matrix().cast<float>();
-#else
 		vp.eta_sq += E.cwiseProduct(E) * vp.sw_sq.matrix();
-#endif
 
 		// Recompute expected value of diagonal of ZtZ
 		vp.calcEdZtZ(dXtEEX_lowertri, n_env);
@@ -1291,12 +1683,8 @@ public:
 	void
 	compute_residuals_per_chr(const VariationalParametersLite &vp,
 	                          std::vector<Eigen::VectorXd> &loco_phenos) const {
-		std::vector<Eigen::VectorXd> pred_main, pred_int;
-		pred_main.resize(n_chrs);
-		pred_int.resize(n_chrs);
 		loco_phenos.resize(n_chrs);
 
-		// casts used if DATA_AS_FLOAT
 		Eigen::VectorXd map_residuals;
 		if (n_effects > 1) {
 			map_residuals = (Y - vp.ym - vp.yx.cwiseProduct(vp.eta)).cast<double>();
@@ -1304,25 +1692,21 @@ public:
 			map_residuals = (Y - vp.ym).cast<double>();
 		}
 
-		// Compute predicted effects from each chromosome
-		Eigen::VectorXd Eq_beta = vp.mean_beta();
-		for (auto cc : chrs_index) {
-			pred_main[cc] = X.mult_vector_by_chr(chrs_present[cc], Eq_beta);
-		}
-
+		// Compute predicted effects from each chromosome in one pass over X
+		Eigen::MatrixXd Eq_effects(n_var, n_effects > 1 ? 2 : 1);
+		Eq_effects.col(0) = vp.mean_beta();
 		if (n_effects > 1) {
-			Eigen::VectorXd Eq_gam = vp.mean_gam();
-			for (auto cc : chrs_index) {
-				pred_int[cc]  = X.mult_vector_by_chr(chrs_present[cc], Eq_gam);
-			}
+			Eq_effects.col(1) = vp.mean_gam();
 		}
+		std::vector<Eigen::MatrixXd> pred = X.mult_by_chr(Eq_effects);
 
 		// Compute mean-centered residuals for each chromosome
 		for (auto cc : chrs_index) {
+			long kk = X.chr_index(chrs_present[cc]);
 			if (n_effects > 1) {
-				loco_phenos[cc] = map_residuals + pred_main[cc] + pred_int[cc].cwiseProduct(vp.eta.cast<double>());
+				loco_phenos[cc] = map_residuals + pred[0].col(kk) + pred[1].col(kk).cwiseProduct(vp.eta.cast<double>());
 			} else {
-				loco_phenos[cc] = map_residuals + pred_main[cc];
+				loco_phenos[cc] = map_residuals + pred[0].col(kk);
 			}
 			EigenUtils::center_matrix(loco_phenos[cc]);
 		}
@@ -204,7 +204,7 @@ public:
 	                const GenotypeMatrix& X,
 	                const std::vector< std::string >& covar_names,
 	                const std::vector< std::string >& env_names,
-	                const std::unordered_map<long, bool>& sample_is_invalid,
+	                const SampleMask& sample_mask,
 	                const std::map<long, int>& sample_location){
 		std::string path;
 
@@ -0,0 +1,512 @@
+#include "catch.hpp"
+
+#include "../src/tools/eigen3.3/Dense"
+#include "../src/parameters.hpp"
+#include "../src/genotype_matrix.hpp"
+#include "../src/mpi_utils.hpp"
+#include "../src/bgen_parser.hpp"
+#include "../src/file_utils.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// Fill X with reproducible random dosages; n_samples larger than panelRows
+// and n_var not a multiple of panelCols so that ragged tiles are exercised.
+void fill_random_dosages(GenotypeMatrix& X, const long& n_samples, const long& n_var){
+	std::mt19937 generator(42);
+	std::uniform_real_distribution<double> unif(0.0, 2.0);
+	X.resize(n_samples, n_var);
+	for (long jj = 0; jj < n_var; jj++) {
+		X.chromosome[jj] = (jj < n_var / 2) ? 1 : 2;
+		X.position[jj] = jj;
+		for (long ii = 0; ii < n_samples; ii++) {
+			X.assign_index(ii, jj, unif(generator));
+		}
+	}
+	X.calc_scaled_values();
+}
+
+EigenDataMatrix naive_multiply(const GenotypeMatrix& X, const EigenDataMatrix& rhs){
+	EigenDataMatrix res = EigenDataMatrix::Zero(X.rows(), rhs.cols());
+	for (long jj = 0; jj < X.cols(); jj++) {
+		res += X.col(jj) * rhs.row(jj);
+	}
+	return res;
+}
+
+TEST_CASE("GenotypeMatrix low-mem kernels") {
+	long n_samples = 2500, n_var = 150;
+	std::mt19937 generator(7);
+	std::normal_distribution<scalarData> gaussian(0.0, 1.0);
+	EigenDataMatrix rhs(n_var, 3), lhs(n_samples, 3);
+	for (long ii = 0; ii < rhs.size(); ii++) rhs(ii) = gaussian(generator);
+	for (long ii = 0; ii < lhs.size(); ii++) lhs(ii) = gaussian(generator);
+
+	for (unsigned int n_thread : {1, 3}) {
+		DYNAMIC_SECTION("Threads: " << n_thread) {
+			parameters p;
+			p.n_thread = n_thread;
+			GenotypeMatrix X(p, true);
+			fill_random_dosages(X, n_samples, n_var);
+
+			EigenDataMatrix expected = naive_multiply(X, rhs);
+			EigenDataMatrix res = X * rhs;
+			CHECK(res.rows() == n_samples);
+			CHECK((res - expected).cwiseAbs().maxCoeff() < 1e-4);
+
+			EigenDataMatrix expectedT(n_var, lhs.cols());
+			for (long jj = 0; jj < n_var; jj++) {
+				expectedT.row(jj) = X.col(jj).transpose() * lhs;
+			}
+			Eigen::MatrixXd resT = X.transpose_multiply(lhs);
+			CHECK(resT.rows() == n_var);
+			CHECK((resT - expectedT.cast<double>()).cwiseAbs().maxCoeff() < 1e-4);
+
+			std::vector<long> chunk = {3, 4, 5, 70, 71, 149};
+			EigenDataMatrix D(n_samples, chunk.size());
+			X.col_block3(chunk, D);
+			for (long ii = 0; ii < chunk.size(); ii++) {
+				EigenDataVector vec = X.col(chunk[ii]);
+				CHECK((D.col(ii) - vec).cwiseAbs().maxCoeff() < 1e-6);
+				CHECK(D(10, ii) == Approx(X(10, chunk[ii])));
+			}
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix low-mem column statistics") {
+	long n_samples = 500, n_var = 20;
+	parameters p;
+	p.n_thread = 3;
+	GenotypeMatrix X(p, true);
+	fill_random_dosages(X, n_samples, n_var);
+
+	double Nglobal = mpiUtils::mpiReduce_inplace((double) n_samples);
+	for (long jj = 0; jj < n_var; jj++) {
+		Eigen::VectorXd dosage = X.M.col(jj).cast<double>();
+		dosage = (dosage.array() + 0.5) * 2.0 / 256.0;
+		double mean = mpiUtils::mpiReduce_inplace(dosage.sum()) / Nglobal;
+		double ss = mpiUtils::mpiReduce_inplace((dosage.array() - mean).square().sum());
+		CHECK(X.compressed_dosage_means[jj] == Approx(mean));
+		CHECK(X.compressed_dosage_sds[jj] == Approx(std::sqrt(ss / (Nglobal - 1))));
+	}
+}
+
+TEST_CASE("GenotypeMatrix high-mem standardise with missing values") {
+	long n_samples = 150, n_var = 5;
+	parameters p;
+	p.n_thread = 2;
+	GenotypeMatrix X(p, false);
+	X.resize(n_samples, n_var);
+	Eigen::MatrixXd dosage(n_samples, n_var);
+	for (long jj = 0; jj < n_var; jj++) {
+		for (long ii = 0; ii < n_samples; ii++) {
+			dosage(ii, jj) = ((ii * 7 + jj * 3) % 11) / 5.0;
+			if((ii + jj) % 13 == 0 && jj > 0) {
+				dosage(ii, jj) = std::numeric_limits<double>::quiet_NaN();
+			}
+			X.assign_index(ii, jj, dosage(ii, jj));
+		}
+	}
+	X.calc_scaled_values();
+
+	for (long jj = 0; jj < n_var; jj++) {
+		double mu = 0, count = 0, ss = 0;
+		for (long ii = 0; ii < n_samples; ii++) {
+			if(!std::isnan(dosage(ii, jj))) {
+				mu += dosage(ii, jj);
+				count++;
+			}
+		}
+		mu /= count;
+		for (long ii = 0; ii < n_samples; ii++) {
+			if(!std::isnan(dosage(ii, jj))) ss += (dosage(ii, jj) - mu) * (dosage(ii, jj) - mu);
+		}
+		double sigma = std::sqrt(ss / (count - 1));
+		for (long ii = 0; ii < n_samples; ii++) {
+			if(std::isnan(dosage(ii, jj))) {
+				CHECK(X(ii, jj) == 0.0);
+			} else {
+				CHECK(X(ii, jj) == Approx((dosage(ii, jj) - mu) / sigma).margin(1e-9));
+			}
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix packed storage tiers") {
+	long n_samples = 2503, n_var = 70;
+	std::mt19937 generator(11);
+	std::uniform_real_distribution<double> unif(0.0, 2.0);
+	Eigen::MatrixXd dosage(n_samples, n_var);
+	for (long ii = 0; ii < dosage.size(); ii++) dosage(ii) = unif(generator);
+	EigenDataMatrix rhs = EigenDataMatrix::Ones(n_var, 2);
+	rhs.col(1).setLinSpaced(n_var, -1.0, 1.0);
+
+	for (unsigned int n_bits : {4, 2}) {
+		DYNAMIC_SECTION("Bits: " << n_bits) {
+			parameters p;
+			p.genotype_bits = n_bits;
+			p.n_thread = 2;
+			GenotypeMatrix X(p, true);
+			X.resize(n_samples, n_var);
+			CHECK(X.M.rows() == (n_samples * n_bits + 7) / 8);
+			for (long jj = 0; jj < n_var; jj++) {
+				X.assign_col(jj, dosage.col(jj));
+			}
+			X.calc_scaled_values();
+
+			// Decoded dosages within half a quantisation step
+			double tol = (n_bits == 4) ? 2.0 / 30 + 1e-6 : 0.5 + 1e-6;
+			for (long jj = 0; jj < n_var; jj++) {
+				Eigen::VectorXd decoded = X.col(jj).cast<double>() * X.compressed_dosage_sds[jj];
+				decoded.array() += X.compressed_dosage_means[jj];
+				CHECK((decoded - dosage.col(jj)).cwiseAbs().maxCoeff() <= tol);
+				if(n_bits == 2) {
+					CHECK(decoded[5] == Approx(std::round(dosage(5, jj))).margin(1e-9));
+				}
+			}
+
+			EigenDataMatrix res = X * rhs;
+			CHECK((res - naive_multiply(X, rhs)).cwiseAbs().maxCoeff() < 1e-4);
+
+			Eigen::MatrixXd resT = X.transpose_multiply(res);
+			for (long jj = 0; jj < n_var; jj++) {
+				CHECK(resT(jj, 1) == Approx((X.col(jj).transpose() * res.col(1)).sum()).epsilon(1e-6));
+			}
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix sparse storage of rare variants") {
+	long n_samples = 1500, n_var = 90;
+	std::mt19937 generator(3);
+	std::uniform_real_distribution<double> unif(0.0, 2.0);
+	Eigen::MatrixXd dosage = Eigen::MatrixXd::Zero(n_samples, n_var);
+	for (long jj = 0; jj < n_var; jj++) {
+		// Every third variant is common, the rest carried by a few samples
+		for (long ii = 0; ii < n_samples; ii++) {
+			if(jj % 3 == 0 || (ii * 31 + jj) % 97 == 0) {
+				dosage(ii, jj) = unif(generator);
+			}
+		}
+	}
+	EigenDataMatrix rhs(n_var, 2), lhs(n_samples, 2);
+	rhs.col(0).setLinSpaced(n_var, -1.0, 1.0);
+	rhs.col(1).setOnes();
+	lhs.col(0).setLinSpaced(n_samples, 0.0, 1.0);
+	lhs.col(1).setOnes();
+	std::vector<long> chunk = {0, 1, 2, 45, 88, 89};
+
+	for (unsigned int n_bits : {8, 2}) {
+		DYNAMIC_SECTION("Bits: " << n_bits) {
+			parameters p;
+			p.genotype_bits = n_bits;
+			p.n_thread = 2;
+			p.max_sparse_density = 0.05;
+			GenotypeMatrix Xs(p, true);
+			p.max_sparse_density = 0;
+			GenotypeMatrix Xd(p, true);
+			for (GenotypeMatrix* X : {&Xs, &Xd}) {
+				X->resize(n_samples, n_var);
+				for (long jj = 0; jj < n_var; jj++) {
+					X->chromosome[jj] = (jj < 50) ? 1 : 2;
+					X->assign_col(jj, dosage.col(jj));
+				}
+				X->calc_scaled_values();
+			}
+			CHECK(Xs.sparse_vars.size() == 60);
+			CHECK(Xs.M.cols() == 30);
+			CHECK(Xd.sparse_vars.empty());
+
+			CHECK((Xs.compressed_dosage_sds - Xd.compressed_dosage_sds).cwiseAbs().maxCoeff() < 1e-9);
+			CHECK(Xs(7, 1) == Approx(Xd(7, 1)));
+
+			EigenDataMatrix Ds(n_samples, chunk.size()), Dd(n_samples, chunk.size());
+			Xs.col_block3(chunk, Ds);
+			Xd.col_block3(chunk, Dd);
+			CHECK((Ds - Dd).cwiseAbs().maxCoeff() < 1e-9);
+
+			EigenDataMatrix res_s = Xs * rhs, res_d = Xd * rhs;
+			CHECK((res_s - res_d).cwiseAbs().maxCoeff() < 1e-6);
+
+			Eigen::MatrixXd resT_s = Xs.transpose_multiply(lhs);
+			Eigen::MatrixXd resT_d = Xd.transpose_multiply(lhs);
+			CHECK((resT_s - resT_d).cwiseAbs().maxCoeff() < 1e-6);
+
+			Eigen::VectorXd rhs_chr = rhs.col(0).cast<double>();
+			CHECK((Xs.mult_vector_by_chr(2, rhs_chr) - Xd.mult_vector_by_chr(2, rhs_chr)).cwiseAbs().maxCoeff() < 1e-6);
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix binary cache round trip") {
+	long n_samples = 600, n_var = 45;
+	std::mt19937 generator(11);
+	std::uniform_real_distribution<double> unif(0.0, 2.0);
+	Eigen::MatrixXd dosage = Eigen::MatrixXd::Zero(n_samples, n_var);
+	for (long jj = 0; jj < n_var; jj++) {
+		for (long ii = 0; ii < n_samples; ii++) {
+			if(jj % 3 == 0 || (ii * 31 + jj) % 97 == 0) {
+				dosage(ii, jj) = unif(generator);
+			}
+		}
+	}
+
+	// Each rank writes its own file
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	std::string filename = (boost::filesystem::temp_directory_path() /
+	                        ("lemma_genotype_cache_test_" + std::to_string(world_rank) + ".bin")).string();
+
+	for (bool low_mem : {true, false}) {
+		DYNAMIC_SECTION("Low-mem: " << low_mem) {
+			parameters p;
+			p.max_sparse_density = 0.05;
+			GenotypeMatrix X(p, low_mem);
+			X.resize(n_samples, n_var);
+			for (long jj = 0; jj < n_var; jj++) {
+				X.chromosome[jj] = (jj < 20) ? 1 : 3;
+				X.position[jj] = 1000 + jj;
+				X.al_0.set(jj, "A");
+				X.al_1.set(jj, "T");
+				X.rsid.set(jj, "rs" + std::to_string(jj));
+				X.SNPID.set(jj, "snp" + std::to_string(jj));
+				X.assign_col(jj, dosage.col(jj));
+			}
+			X.calc_scaled_values();
+			if(low_mem) {
+				CHECK(X.sparse_vars.size() == 30);
+			}
+			fileUtils::write_genotype_cache(filename, 17, X);
+
+			GenotypeMatrix Y(p, low_mem);
+			CHECK_FALSE(fileUtils::read_genotype_cache(filename, 18, Y));
+			CHECK(Y.cols() == 0);
+			REQUIRE(fileUtils::read_genotype_cache(filename, 17, Y));
+			std::remove(filename.c_str());
+
+			CHECK(Y.rows() == n_samples);
+			CHECK(Y.cols() == n_var);
+			CHECK(Y.scaling_performed);
+			CHECK(Y.sparse_vars == X.sparse_vars);
+			CHECK(Y.dense_vars == X.dense_vars);
+			CHECK(Y.compressed_dosage_means == X.compressed_dosage_means);
+			CHECK(Y.compressed_dosage_sds == X.compressed_dosage_sds);
+
+			CHECK(Y.chromosome == X.chromosome);
+			CHECK(Y.position == X.position);
+			CHECK(Y.chr_ids == X.chr_ids);
+			CHECK(Y.chr_offsets == X.chr_offsets);
+			CHECK(Y.chr_offsets == std::vector<long>({0, 20, 45}));
+			for (long jj = 0; jj < n_var; jj++) {
+				CHECK(Y.al_0[jj] == X.al_0[jj]);
+				CHECK(Y.al_1[jj] == X.al_1[jj]);
+				CHECK(Y.rsid[jj] == X.rsid[jj]);
+				CHECK(Y.SNPID[jj] == X.SNPID[jj]);
+			}
+
+			std::vector<long> chunk(n_var);
+			for (long jj = 0; jj < n_var; jj++) chunk[jj] = jj;
+			EigenDataMatrix Dx(n_samples, n_var), Dy(n_samples, n_var);
+			X.col_block3(chunk, Dx);
+			Y.col_block3(chunk, Dy);
+			CHECK(Dx == Dy);
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix per chromosome products") {
+	long n_samples = 1100, n_var = 150;
+	Eigen::MatrixXd rhs(n_var, 2);
+	rhs.col(0).setLinSpaced(n_var, -1.0, 1.0);
+	rhs.col(1).setOnes();
+
+	for (bool low_mem : {true, false}) {
+		DYNAMIC_SECTION("Low-mem: " << low_mem) {
+			parameters p;
+			p.n_thread = 2;
+			GenotypeMatrix X(p, low_mem);
+			fill_random_dosages(X, n_samples, n_var);
+			CHECK(X.chr_ids == std::vector<int>({1, 2}));
+			CHECK(X.chr_offsets == std::vector<long>({0, 75, 150}));
+
+			std::vector<Eigen::MatrixXd> pred = X.mult_by_chr(rhs);
+			CHECK(pred.size() == 2);
+			for (long ll = 0; ll < 2; ll++) {
+				CHECK(pred[ll].cols() == 2);
+				for (long cc = 0; cc < 2; cc++) {
+					Eigen::VectorXd expected = Eigen::VectorXd::Zero(n_samples);
+					for (long jj = X.chr_offsets[cc]; jj < X.chr_offsets[cc + 1]; jj++) {
+						expected += X.col(jj).cast<double>() * rhs(jj, ll);
+					}
+					CHECK((pred[ll].col(cc) - expected).cwiseAbs().maxCoeff() < 1e-6);
+				}
+			}
+			Eigen::VectorXd rhs0 = rhs.col(0);
+			CHECK((X.mult_vector_by_chr(2, rhs0) - pred[0].col(1)).cwiseAbs().maxCoeff() < 1e-9);
+			CHECK((X.mult_vector_by_chr(1, rhs0) - pred[0].col(0)).cwiseAbs().maxCoeff() < 1e-9);
+
+			CHECK(X.chrs_contiguous());
+			X.chromosome[n_var - 1] = 1;
+			CHECK_FALSE(X.chrs_contiguous());
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix single precision panels") {
+	long n_samples = 1100, n_var = 40;
+	std::vector<long> chunk = {0, 7, 8, 39};
+
+	for (bool low_mem : {true, false}) {
+		DYNAMIC_SECTION("Low-mem: " << low_mem) {
+			parameters p;
+			p.n_thread = 2;
+			GenotypeMatrix X(p, low_mem);
+			fill_random_dosages(X, n_samples, n_var);
+
+			Eigen::MatrixXd Dd(n_samples, chunk.size());
+			Eigen::MatrixXf Df(n_samples, chunk.size());
+			X.col_block3(chunk, Dd);
+			X.col_block3(chunk, Df);
+			CHECK((Df.cast<double>() - Dd).cwiseAbs().maxCoeff() < 1e-5);
+
+			Eigen::MatrixXd XtXd = Dd.transpose() * Dd;
+			Eigen::MatrixXd XtXf = (Df.transpose() * Df).cast<double>();
+			CHECK((XtXf - XtXd).cwiseAbs().maxCoeff() < 1e-5 * n_samples);
+		}
+	}
+}
+
+TEST_CASE("GenotypeMatrix interned variant metadata") {
+	parameters p;
+	GenotypeMatrix X(p, true);
+	X.resize(10, 3);
+	std::vector<std::string> alleles = {"A", "C", "A"};
+	for (long jj = 0; jj < 3; jj++) {
+		X.chromosome[jj] = 22;
+		X.position[jj] = 100 + jj;
+		X.al_0.set(jj, alleles[jj]);
+		X.al_1.set(jj, "G");
+		X.rsid.set(jj, "rs" + std::to_string(jj));
+		X.SNPID.set(jj, "22:" + std::to_string(100 + jj));
+	}
+	CHECK(X.al_0[2] == "A");
+	CHECK(X.al_0.n_unique() == 3);
+	CHECK(X.rsid[1] == "rs1");
+	CHECK(X.snp_key(1) == "22~101~C~G");
+	CHECK(X.SNPID.find("22:102") == 2);
+	CHECK(X.SNPID.find("22:103") == -1);
+
+	X.move_variant(2, 0);
+	X.conservativeResize(10, 2);
+	CHECK(X.rsid[0] == "rs2");
+	CHECK(X.snp_key(0) == "22~102~A~G");
+	CHECK(X.rsid[1] == "rs1");
+
+	// Many strings to force the hash table to grow
+	X.resize(10, 1000);
+	CHECK(X.rsid[0] == "");
+	for (long jj = 0; jj < 1000; jj++) {
+		X.rsid.set(jj, "rs" + std::to_string(jj % 500));
+	}
+	CHECK(X.rsid.n_unique() == 501);
+	CHECK(X.rsid[999] == "rs499");
+	CHECK(X.rsid.find("rs499") == 499);
+}
+
+TEST_CASE("GenotypeMatrix assign precomputed 8-bit codes") {
+	long n_samples = 300;
+	parameters p;
+	GenotypeMatrix Xc(p, true), Xd(p, true);
+	Xc.resize(n_samples, 2);
+	Xd.resize(n_samples, 2);
+	std::vector<std::uint8_t> codes(n_samples);
+	for (long jj = 0; jj < 2; jj++) {
+		Eigen::VectorXd dosage(n_samples);
+		for (long ii = 0; ii < n_samples; ii++) {
+			codes[ii] = (ii * (jj + 3)) % 256;
+			dosage[ii] = (codes[ii] + 0.5) / 128.0;
+		}
+		Xc.assign_codes(jj, codes.data());
+		Xd.assign_col(jj, dosage);
+	}
+	CHECK(Xc.M == Xd.M);
+}
+
+TEST_CASE("DosageSetter 8-bit decoder rejects malformed blocks") {
+	// Layout 2 block: N, K = 2, min / max ploidy 2, ploidy bytes, phased
+	// flag, 8 bits, then p(AA) and p(AB) per sample
+	long n_samples = 3;
+	std::vector<genfile::byte_t> block = {3, 0, 0, 0, 2, 0, 2, 2, 2, 2, 2, 0, 8,
+	                                      255, 0, 0, 255, 0, 0};
+	genfile::bgen::Context context;
+	context.flags = genfile::bgen::e_Layout2;
+	SampleMask sample_mask;
+	sample_mask.assign(n_samples, std::vector<bool>(n_samples, false));
+
+	DosageSetter setter(sample_mask);
+	CHECK(setter.parse_biallelic_8bit(block.data(), block.data() + block.size(), context));
+
+	// p(AA) + p(AB) > 1 for the last sample
+	block[17] = 200;
+	block[18] = 100;
+	DosageSetter bad_setter(sample_mask);
+	CHECK_FALSE(bad_setter.parse_biallelic_8bit(block.data(), block.data() + block.size(), context));
+	CHECK_FALSE(bad_setter.m_has_codes);
+}
+
+TEST_CASE("DosageSetter 8-bit decoder matches the generic parser") {
+	// Layout 2 block of 6 samples: sample 2 is excluded by the mask and
+	// sample 4 is missing (ploidy byte 0x82)
+	long n_samples = 6;
+	std::vector<genfile::byte_t> block = {6, 0, 0, 0, 2, 0, 2, 2,
+	                                      2, 2, 2, 2, 0x82, 2, 0, 8,
+	                                      255, 0, 0, 255, 10, 20, 0, 0, 0, 0, 100, 50};
+	genfile::bgen::Context context;
+	context.flags = genfile::bgen::e_Layout2;
+	context.number_of_samples = n_samples;
+	std::vector<bool> is_excluded(n_samples, false);
+	is_excluded[2] = true;
+	SampleMask sample_mask;
+	sample_mask.assign(n_samples, is_excluded);
+
+	DosageSetter fast(sample_mask), generic(sample_mask);
+	REQUIRE(fast.parse_biallelic_8bit(block.data(), block.data() + block.size(), context));
+	genfile::bgen::parse_probability_data(block.data(), block.data() + block.size(), context, generic);
+	CHECK(fast.m_has_codes);
+	CHECK_FALSE(generic.m_has_codes);
+
+	// Dosages 0, 1, 2 and 260 / 255 on the kept rows; missing row left at 0
+	std::vector<std::uint8_t> expected = {0, 128, 255, 0, 130};
+	CHECK(fast.m_codes == expected);
+
+	long n_stats = DosageSetter::n_summary_stats;
+	std::vector<double> fast_stats(n_stats), generic_stats(n_stats);
+	fast.local_summary_stats(fast_stats.data());
+	generic.local_summary_stats(generic_stats.data());
+	CHECK(fast_stats[0] == 5);
+	CHECK(fast_stats[1] == 1);
+	CHECK(generic_stats[0] == fast_stats[0]);
+	CHECK(generic_stats[1] == fast_stats[1]);
+	for (long ss = 2; ss < n_stats; ss++) {
+		CHECK(fast_stats[ss] == Approx(generic_stats[ss]).epsilon(1e-12).margin(1e-12));
+	}
+
+	// Summary stats of this rank alone; the missing row gets the mean
+	fast.set_summary_stats(fast_stats.data());
+	generic.set_summary_stats(generic_stats.data());
+	CHECK(fast.m_missingness == generic.m_missingness);
+	CHECK(fast.m_mean == Approx(generic.m_mean).epsilon(1e-12));
+	CHECK(fast.m_maf == Approx(generic.m_maf).epsilon(1e-12));
+	CHECK(fast.m_info == Approx(generic.m_info).epsilon(1e-12));
+	CHECK(fast.m_sigma2 == Approx(generic.m_sigma2).epsilon(1e-12));
+
+	std::vector<std::uint8_t> fast_codes(5), generic_codes(5);
+	fast.copy_rows(0, 5, fast_codes.data());
+	generic.copy_rows(0, 5, generic_codes.data());
+	CHECK(fast_codes == generic_codes);
+	CHECK(fast_codes[3] == (std::uint8_t) std::floor(fast.m_mean * 128.0));
+}
@@ -7,11 +7,20 @@
 #include "../src/data.hpp"
 #include "../src/hyps.hpp"
 #include "../src/genotype_matrix.hpp"
+#include "../src/file_utils.hpp"
+
+#include <boost/filesystem.hpp>
+#include <mpi.h>
 
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
 #include <limits>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 #include <sys/stat.h>
 
 char* case_study_args[] = { (char*) "bin/bgen_prog", (char*) "--VB-varEM",
@@ -112,7 +121,7 @@ TEST_CASE( "Case study: varEM w/ multi-env + MoG + covars" ){
 		tracker.init_interim_output(0,2, VB.n_effects, VB.n_covar, VB.n_env, VB.env_names, vp);
 		tracker.dump_state("2", VB.n_samples, VB.n_covar, VB.n_var, VB.n_env,
 		                   VB.n_effects, vp, hyps, VB.Y, VB.C, VB.X,
-		                   VB.covar_names, VB.env_names, VB.sample_is_invalid, VB.sample_location);
+		                   VB.covar_names, VB.env_names, VB.sample_mask, VB.sample_location);
 
 		// variances
 		CHECK(vp.EdZtZ.sum() == Approx(7153.6186444063));
@@ -156,6 +165,323 @@ TEST_CASE("Case Study: var-EM w/ sample subsetting"){
 	}
 }
 
+TEST_CASE("Case study: packed LD blocks with an uneven final chunk"){
+	// 69 variants in chunks of 16 leaves a final chunk of 5; coordinate
+	// updates are exact within chunks, so the case study values still hold
+	parameters p;
+	int argc = sizeof(case_study_args)/sizeof(case_study_args[0]);
+	parse_arguments(p, argc, case_study_args);
+	p.main_chunk_size = 16;
+	Data data( p );
+
+	data.read_non_genetic_data();
+	data.standardise_non_genetic_data();
+	data.read_full_bgen();
+
+	data.calc_dxteex();
+	data.calc_snpstats();
+	data.set_vb_init();
+	VBayes VB(data);
+	long n_chunks = VB.main_fwd_pass_chunks.size();
+	REQUIRE(n_chunks == 5);
+	REQUIRE(VB.main_fwd_pass_chunks.back().size() == 5);
+
+	SECTION("Backward pass LD blocks match the dense reversed D^T D"){
+		for (long ch : {0L, n_chunks - 1}) {
+			const std::vector<long>& back_chunk = VB.main_back_pass_chunks[n_chunks - 1 - ch];
+			long ch_len = back_chunk.size();
+			REQUIRE(ch_len == VB.main_fwd_pass_chunks[ch].size());
+
+			EigenDataMatrix D(VB.n_samples, ch_len);
+			VB.X.col_block3(back_chunk, D);
+			Eigen::MatrixXd DtD_local = (D.transpose() * D).cast<double>();
+			Eigen::MatrixXd DtD(ch_len, ch_len);
+			mpiUtils::mpiReduce_double(DtD_local.data(), DtD.data(), DtD_local.size());
+
+			Eigen::MatrixXd D_corr = VB.unpack_ld_block(ch, false);
+			for (long jj = 0; jj < ch_len; jj++) {
+				for (long ii = 0; ii < ch_len; ii++) {
+					if(ii < jj) {
+						CHECK(D_corr(ii, jj) == Approx(DtD(ii, jj)).epsilon(1e-5).margin(1e-4));
+					} else {
+						CHECK(D_corr(ii, jj) == 0);
+					}
+				}
+			}
+		}
+	}
+
+	SECTION("Forward and backward pass match the case study"){
+		long n_grid = VB.hyps_inits.size();
+		std::vector<Hyps> all_hyps = VB.hyps_inits;
+		std::vector<VariationalParameters> all_vp;
+		VB.setup_variational_params(all_hyps, all_vp);
+
+		int round_index = 2;
+		std::vector<double> logw_prev(n_grid, -std::numeric_limits<double>::max());
+		VariationalParameters& vp = all_vp[0];
+
+		VB.updateAllParams(0, round_index, all_vp, all_hyps, logw_prev);
+
+		CHECK(vp.alpha_beta(0)            == Approx(0.1304866836));
+		CHECK(vp.alpha_beta(63)           == Approx(0.1287316327));
+		CHECK(vp.mean_gam(0)           == Approx(-0.0008928842));
+		CHECK(vp.mean_gam(63)           == Approx(0.0006366846));
+		CHECK(vp.muw(0, 0)              == Approx(0.0881921519));
+
+		VB.updateAllParams(1, round_index, all_vp, all_hyps, logw_prev);
+
+		CHECK(vp.alpha_beta(0)            == Approx(0.1299179906));
+		CHECK(vp.muw(0, 0)              == Approx(0.0252971947));
+		CHECK(vp.alpha_gam(63)           == Approx(0.1206189086));
+		CHECK(vp.mu1_gam(63)              == Approx(0.0017733056));
+		CHECK(vp.s1_gam_sq(63)            == Approx(0.0027427621));
+	}
+}
+
+TEST_CASE("Case study: pipelined chunk loop"){
+	// Chunks of 24 variants are decompressed in several panels while the
+	// previous chunk is reduced; results match the sequential loop that
+	// produced the case study values
+	parameters p;
+	int argc = sizeof(case_study_args)/sizeof(case_study_args[0]);
+	parse_arguments(p, argc, case_study_args);
+	p.main_chunk_size = 24;
+	Data data( p );
+
+	data.read_non_genetic_data();
+	data.standardise_non_genetic_data();
+	data.read_full_bgen();
+
+	data.calc_dxteex();
+	data.calc_snpstats();
+	data.set_vb_init();
+	VBayes VB(data);
+	REQUIRE(VB.main_fwd_pass_chunks.size() == 3);
+
+	std::vector< VbTracker > trackers(VB.hyps_inits.size(), p);
+	VB.run_inference(VB.hyps_inits, false, 2, trackers);
+	CHECK(trackers[0].count == 10);
+	CHECK(trackers[0].logw == Approx(-95.5990828788));
+}
+
+TEST_CASE("Case study: calibrated chunk sizes"){
+	// Calibration times updates on copies of the variational parameters,
+	// so inference afterwards matches the case study
+	parameters p;
+	int argc = sizeof(case_study_args)/sizeof(case_study_args[0]);
+	parse_arguments(p, argc, case_study_args);
+	p.auto_chunk_size = true;
+	Data data( p );
+
+	data.read_non_genetic_data();
+	data.standardise_non_genetic_data();
+	data.read_full_bgen();
+
+	data.calc_dxteex();
+	data.calc_snpstats();
+	data.set_vb_init();
+	VBayes VB(data);
+	std::vector<unsigned int> main_sizes = {16, 32, 64};
+	CHECK(std::count(main_sizes.begin(), main_sizes.end(), VB.p.main_chunk_size) == 1);
+	CHECK(VB.XtX_block_offset.size() == VB.main_fwd_pass_chunks.size() + 1);
+	CHECK(VB.ZtZ_block_cache.empty());
+
+	std::vector< VbTracker > trackers(VB.hyps_inits.size(), p);
+	VB.run_inference(VB.hyps_inits, false, 2, trackers);
+	CHECK(trackers[0].count == 10);
+	CHECK(trackers[0].logw == Approx(-95.5990828788));
+}
+
+TEST_CASE("Case study: grid points updated on several threads"){
+	// Each grid point only touches its own vp, so the ELBO of every grid
+	// point matches a single threaded run
+	std::vector<double> logw_serial, logw_threaded;
+	for (unsigned int n_thread : {1U, 3U}) {
+		parameters p;
+		int argc = sizeof(case_study_args)/sizeof(case_study_args[0]);
+		parse_arguments(p, argc, case_study_args);
+		p.hyps_grid_file = "unit/data/multi_hyps_gxage.txt";
+		p.hyps_probs_file = "NULL";
+		p.n_thread = n_thread;
+		Data data( p );
+
+		data.read_non_genetic_data();
+		data.standardise_non_genetic_data();
+		data.read_full_bgen();
+
+		data.calc_dxteex();
+		data.calc_snpstats();
+		data.set_vb_init();
+		VBayes VB(data);
+
+		long n_grid = VB.hyps_inits.size();
+		REQUIRE(n_grid == 5);
+		std::vector<Hyps> all_hyps = VB.hyps_inits;
+		std::vector<VariationalParameters> all_vp;
+		VB.setup_variational_params(all_hyps, all_vp);
+
+		int round_index = 2;
+		std::vector<double> logw_prev(n_grid, -std::numeric_limits<double>::max());
+		for (long count = 0; count < 4; count++) {
+			VB.updateAllParams(count, round_index, all_vp, all_hyps, logw_prev);
+		}
+
+		std::vector<double>& logw = (n_thread == 1) ? logw_serial : logw_threaded;
+		for (long nn = 0; nn < n_grid; nn++) {
+			logw.push_back(VB.calc_logw(all_hyps[nn], all_vp[nn]));
+		}
+	}
+
+	REQUIRE(logw_threaded.size() == logw_serial.size());
+	for (long nn = 0; nn < logw_serial.size(); nn++) {
+		CHECK(logw_threaded[nn] == Approx(logw_serial[nn]));
+	}
+}
+
+char* ldblock_cache_args[] = { (char*) "bin/bgen_prog", (char*) "--VB-varEM",
+	                           (char*) "--VB-iter-max", (char*) "10",
+	                           (char*) "--environment", (char*) "unit/data/n50_p100_env1_sq.txt",
+	                           (char*) "--bgen", (char*) "unit/data/n50_p100.bgen",
+	                           (char*) "--out", (char*) "unit/data/test_ldblock_cache.out.gz",
+	                           (char*) "--pheno", (char*) "unit/data/pheno.txt",
+	                           (char*) "--hyps-grid", (char*) "unit/data/single_hyps_gxage.txt",
+	                           (char*) "--hyps-probs", (char*) "unit/data/single_hyps_gxage_probs.txt"};
+
+std::unique_ptr<Data> load_ldblock_cache_data(parameters& p){
+	std::unique_ptr<Data> data(new Data(p));
+	data->read_non_genetic_data();
+	data->standardise_non_genetic_data();
+	data->read_full_bgen();
+	data->calc_dxteex();
+	data->calc_snpstats();
+	data->set_vb_init();
+	return data;
+}
+
+double run_ldblock_cache_vb(VBayes& VB){
+	std::vector< VbTracker > trackers(VB.hyps_inits.size(), VB.p);
+	VB.run_inference(VB.hyps_inits, false, 2, trackers);
+	return trackers[0].logw;
+}
+
+TEST_CASE("LD block cache"){
+	// Single environment, so that the interaction LD blocks are cached too
+	parameters p;
+	int argc = sizeof(ldblock_cache_args)/sizeof(ldblock_cache_args[0]);
+	parse_arguments(p, argc, ldblock_cache_args);
+
+	int world_rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	std::string prefix = (boost::filesystem::temp_directory_path() / "lemma_ldblock_cache_test").string();
+	std::string xtx_file = prefix + ".xtx.bin", ztz_file = prefix + ".ztz.bin";
+	if(world_rank == 0) {
+		std::remove(xtx_file.c_str());
+		std::remove(ztz_file.c_str());
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	// Reference run without the cache
+	std::unique_ptr<Data> data_ref = load_ldblock_cache_data(p);
+	VBayes VB_ref(*data_ref);
+	double logw_ref = run_ldblock_cache_vb(VB_ref);
+
+	// First run with the cache computes the LD blocks and writes both files
+	p.ldblock_cache_file = prefix;
+	std::unique_ptr<Data> data_write = load_ldblock_cache_data(p);
+	VBayes VB_write(*data_write);
+	CHECK(!VB_write.XtX_cache_hit);
+	CHECK(!VB_write.ZtZ_cache_hit);
+	CHECK(run_ldblock_cache_vb(VB_write) == Approx(logw_ref));
+	VB_write.write_ztz_ldblock_cache();
+	MPI_Barrier(MPI_COMM_WORLD);
+	REQUIRE(boost::filesystem::exists(xtx_file));
+	REQUIRE(boost::filesystem::exists(ztz_file));
+	REQUIRE(!VB_write.ZtZ_block_cache.empty());
+
+	SECTION("Cache files round trip"){
+		std::vector<std::size_t> offsets;
+		std::vector<float> arena;
+		CHECK(fileUtils::read_xtx_block_cache(xtx_file, VB_write.XtX_cache_key, VB_write.p.main_chunk_size, offsets, arena));
+		CHECK(offsets == VB_write.XtX_block_offset);
+		CHECK(arena == VB_write.XtX_block_arena);
+		CHECK(!fileUtils::read_xtx_block_cache(xtx_file, VB_write.XtX_cache_key + 1, VB_write.p.main_chunk_size, offsets, arena));
+		CHECK(!fileUtils::read_xtx_block_cache(xtx_file, VB_write.XtX_cache_key, VB_write.p.main_chunk_size + 1, offsets, arena));
+
+		unsigned int main_chunk_size = 0, gxe_chunk_size = 0;
+		CHECK(fileUtils::read_xtx_block_cache_chunk_sizes(xtx_file, VB_write.XtX_cache_key, main_chunk_size, gxe_chunk_size));
+		CHECK(main_chunk_size == VB_write.p.main_chunk_size);
+		CHECK(gxe_chunk_size == VB_write.p.gxe_chunk_size);
+
+		std::map<long, Eigen::MatrixXd> blocks;
+		CHECK(fileUtils::read_ztz_block_cache(ztz_file, VB_write.ZtZ_cache_key, blocks));
+		CHECK(blocks.size() == VB_write.ZtZ_block_cache.size());
+		for (const auto& kv : VB_write.ZtZ_block_cache) {
+			REQUIRE(blocks.count(kv.first) == 1);
+			CHECK(blocks[kv.first] == kv.second);
+		}
+		CHECK(!fileUtils::read_ztz_block_cache(ztz_file, VB_write.ZtZ_cache_key + 1, blocks));
+	}
+
+	SECTION("Run from the cache gives the same ELBO"){
+		std::unique_ptr<Data> data = load_ldblock_cache_data(p);
+		VBayes VB(*data);
+		CHECK(VB.XtX_cache_hit);
+		CHECK(VB.ZtZ_cache_hit);
+		CHECK(VB.XtX_block_arena == VB_write.XtX_block_arena);
+		CHECK(run_ldblock_cache_vb(VB) == Approx(logw_ref));
+	}
+
+	SECTION("Changed chunk sizes miss the cache"){
+		p.main_chunk_size = 32;
+		p.gxe_chunk_size = 4;
+		std::unique_ptr<Data> data = load_ldblock_cache_data(p);
+		VBayes VB(*data);
+		CHECK(VB.XtX_cache_key == VB_write.XtX_cache_key);
+		CHECK(VB.ZtZ_cache_key != VB_write.ZtZ_cache_key);
+		CHECK(!VB.XtX_cache_hit);
+		CHECK(!VB.ZtZ_cache_hit);
+	}
+
+	SECTION("Calibration reuses the chunk sizes of a matching cache"){
+		p.auto_chunk_size = true;
+		p.main_chunk_size = 32;
+		p.gxe_chunk_size = 4;
+		std::unique_ptr<Data> data = load_ldblock_cache_data(p);
+		VBayes VB(*data);
+		CHECK(VB.p.main_chunk_size == VB_write.p.main_chunk_size);
+		CHECK(VB.p.gxe_chunk_size == VB_write.p.gxe_chunk_size);
+		CHECK(VB.XtX_cache_hit);
+		CHECK(VB.ZtZ_cache_hit);
+	}
+
+	SECTION("Changed sample set misses the cache"){
+		p.incl_sids_file = "unit/data/n25_sample_ids.txt";
+		std::unique_ptr<Data> data = load_ldblock_cache_data(p);
+		VBayes VB(*data);
+		CHECK(VB.XtX_cache_key != VB_write.XtX_cache_key);
+		CHECK(!VB.XtX_cache_hit);
+		CHECK(!VB.ZtZ_cache_hit);
+	}
+
+	SECTION("Changed variant list misses the cache"){
+		p.maf_lim = true;
+		p.min_maf = 0.2;
+		std::unique_ptr<Data> data = load_ldblock_cache_data(p);
+		VBayes VB(*data);
+		CHECK(VB.n_var < VB_write.n_var);
+		CHECK(VB.XtX_cache_key != VB_write.XtX_cache_key);
+		CHECK(!VB.XtX_cache_hit);
+		CHECK(!VB.ZtZ_cache_hit);
+	}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(world_rank == 0) {
+		std::remove(xtx_file.c_str());
+		std::remove(ztz_file.c_str());
+	}
+}
+
 TEST_CASE("NaN vparam update throws exception" ){
 	parameters p;
 	int argc = sizeof(case_study_args)/sizeof(case_study_args[0]);
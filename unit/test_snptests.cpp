@@ -7,7 +7,9 @@
 #include "../src/parse_arguments.hpp"
 #include "../src/vbayes.hpp"
 #include "../src/data.hpp"
+#include "../src/bgen_stream.hpp"
 
+#include <cstdio>
 #include <string>
 
 char* full_run[] = { (char*) "prog",
@@ -61,7 +63,7 @@ void my_test(const std::string& mode){
 		long n_var_parsed = 0;
 		GenotypeMatrix Xstream(p);
 		bool bgen_pass = true;
-		fileUtils::read_bgen_chunk(data.streamBgenViews[0], Xstream, data.sample_is_invalid,
+		fileUtils::read_bgen_chunk(data.streamBgenViews[0], Xstream, data.sample_mask,
 		                           data.n_samples, 128, p, bgen_pass, n_var_parsed);
 		Xstream.calc_scaled_values();
 		compute_LOCO_pvals(data.resid_loco.col(0), Xstream, neglogPvals, testStats, data.vp_init.eta);
@@ -86,3 +88,133 @@ TEST_CASE("Assoc tests invariant to code path"){
 		my_test(mode);
 	}
 }
+
+TEST_CASE("Streamed bgen chunks match direct reads"){
+	parameters p;
+	int argc = sizeof(from_file) / sizeof(from_file[0]);
+	parse_arguments(p, argc, from_file);
+	Data data(p);
+	data.read_non_genetic_data();
+
+	genfile::bgen::View::UniquePtr view = genfile::bgen::View::create(p.streamBgenFiles[0]);
+	BgenStreamReader reader(data.streamBgenViews[0], data.sample_mask, p, false, 32, 2);
+	GenotypeMatrix Xdirect(p, false), Xstream(p, false);
+	bool bgen_pass = true;
+	long n_direct = 0, n_stream = 0;
+	while (fileUtils::read_bgen_chunk(view, Xdirect, data.sample_mask, data.n_samples, 32, p, bgen_pass, n_direct)) {
+		REQUIRE(fileUtils::read_bgen_chunk(reader, Xstream, data.n_samples, 32, p, n_stream));
+		CHECK(n_stream == n_direct);
+		REQUIRE(Xstream.cols() == Xdirect.cols());
+		CHECK(Xstream.SNPID[Xstream.cols() - 1] == Xdirect.SNPID[Xdirect.cols() - 1]);
+		Xdirect.calc_scaled_values();
+		Xstream.calc_scaled_values();
+		CHECK(Xstream(3, 0) == Approx(Xdirect(3, 0)));
+	}
+	CHECK(n_direct == 100);
+	CHECK_FALSE(fileUtils::read_bgen_chunk(reader, Xstream, data.n_samples, 32, p, n_stream));
+}
+
+TEST_CASE("Streamed bgen variant ranges"){
+	parameters p;
+	int argc = sizeof(from_file) / sizeof(from_file[0]);
+	parse_arguments(p, argc, from_file);
+	Data data(p);
+	data.read_non_genetic_data();
+
+	// Variants 40 to 69 of the file, against one at a time reads from the start
+	genfile::bgen::View::UniquePtr view = genfile::bgen::View::create(p.streamBgenFiles[0]);
+	BgenStreamReader reader(view, data.sample_mask, p, false, 1, 1, 0, 70);
+	fileUtils::seek_bgen_variant(data.streamBgenViews[0], p.streamBgiFiles[0], [&data] {
+		return data.stream_bgen_query(0);
+	}, 40);
+	BgenStreamReader range(data.streamBgenViews[0], data.sample_mask, p, false, 32, 1, 40, 30, MPI_COMM_SELF);
+	GenotypeMatrix Xone(p, false), Xrange(p, false);
+	std::vector<std::string> expected;
+	long n_all = 0, n_range = 40;
+	while (fileUtils::read_bgen_chunk(reader, Xone, data.n_samples, 1, p, n_all)) {
+		if (n_all > 40) expected.push_back(Xone.SNPID[0]);
+	}
+	CHECK(n_all == 70);
+	REQUIRE(fileUtils::read_bgen_chunk(range, Xrange, data.n_samples, 32, p, n_range));
+	CHECK(n_range == 70);
+	REQUIRE(Xrange.cols() == expected.size());
+	for (long jj = 0; jj < Xrange.cols(); jj++) {
+		CHECK(Xrange.SNPID[jj] == expected[jj]);
+	}
+	CHECK_FALSE(fileUtils::read_bgen_chunk(range, Xrange, data.n_samples, 32, p, n_range));
+}
+
+TEST_CASE("Scattered bgen chunks match direct reads"){
+	parameters p;
+	int argc = sizeof(from_file) / sizeof(from_file[0]);
+	parse_arguments(p, argc, from_file);
+	p.bgen_scatter = true;
+	Data data(p);
+	data.read_non_genetic_data();
+	REQUIRE(data.sample_mask.scatter());
+
+	SampleMask local = data.sample_mask;
+	local.all_ranks.reset();
+	genfile::bgen::View::UniquePtr view = genfile::bgen::View::create(p.streamBgenFiles[0]);
+	BgenStreamReader reader(data.streamBgenViews[0], data.sample_mask, p, false, 32, 2);
+	GenotypeMatrix Xdirect(p, false), Xstream(p, false);
+	bool bgen_pass = true;
+	long n_direct = 0, n_stream = 0;
+	while (fileUtils::read_bgen_chunk(view, Xdirect, local, data.n_samples, 32, p, bgen_pass, n_direct)) {
+		REQUIRE(fileUtils::read_bgen_chunk(reader, Xstream, data.n_samples, 32, p, n_stream));
+		CHECK(n_stream == n_direct);
+		REQUIRE(Xstream.cols() == Xdirect.cols());
+		CHECK(Xstream.SNPID[Xstream.cols() - 1] == Xdirect.SNPID[Xdirect.cols() - 1]);
+		CHECK(Xstream.position[0] == Xdirect.position[0]);
+		Xdirect.calc_scaled_values();
+		Xstream.calc_scaled_values();
+		CHECK(Xstream(3, 0) == Approx(Xdirect(3, 0)));
+	}
+	CHECK(n_direct == 100);
+	CHECK_FALSE(fileUtils::read_bgen_chunk(reader, Xstream, data.n_samples, 32, p, n_stream));
+}
+
+TEST_CASE("Bgen QC sidecar skips failing variants"){
+	parameters p;
+	int argc = sizeof(from_file) / sizeof(from_file[0]);
+	parse_arguments(p, argc, from_file);
+	p.maf_lim = true;
+	p.min_maf = 0.3;
+	p.bgen_qc_cache_file = "unit/data/test_qc_sidecar";
+	std::remove("unit/data/test_qc_sidecar.streamBgen0.qc");
+	Data data(p);
+	data.read_non_genetic_data();
+	REQUIRE(data.streamBgenQc.size() == 1);
+
+	// First pass fills in and writes the sidecar
+	GenotypeMatrix Xfirst(p, false), Xsecond(p, false);
+	long n_first = 0, n_second = 0;
+	{
+		BgenStreamReader reader(data.streamBgenViews[0], data.sample_mask, p, false, 128, 1, 0, -1,
+		                        MPI_COMM_WORLD, data.streamBgenQc[0].get());
+		REQUIRE(fileUtils::read_bgen_chunk(reader, Xfirst, data.n_samples, 128, p, n_first));
+		CHECK_FALSE(fileUtils::read_bgen_chunk(reader, Xfirst, data.n_samples, 128, p, n_first));
+	}
+
+	BgenQcSidecar qc("unit/data/test_qc_sidecar.streamBgen0.qc", data.bgen_qc_key(p.streamBgenFiles[0]), 100);
+	REQUIRE(qc.load(p));
+	long n_skip = 0;
+	for (long jj = 0; jj < 100; jj++) {
+		if (qc.skip(jj)) n_skip++;
+	}
+	CHECK(n_skip > 0);
+
+	genfile::bgen::View::UniquePtr view = genfile::bgen::View::create(p.streamBgenFiles[0]);
+	BgenStreamReader reader(view, data.sample_mask, p, false, 128, 1, 0, -1, MPI_COMM_WORLD, &qc);
+	REQUIRE(fileUtils::read_bgen_chunk(reader, Xsecond, data.n_samples, 128, p, n_second));
+	CHECK(n_second == n_first);
+	REQUIRE(Xsecond.cols() == Xfirst.cols());
+	CHECK(Xsecond.cols() == 100 - n_skip);
+	Xfirst.calc_scaled_values();
+	Xsecond.calc_scaled_values();
+	for (long jj = 0; jj < Xfirst.cols(); jj++) {
+		CHECK(Xsecond.SNPID[jj] == Xfirst.SNPID[jj]);
+		CHECK(Xsecond(3, jj) == Approx(Xfirst(3, jj)));
+	}
+	std::remove("unit/data/test_qc_sidecar.streamBgen0.qc");
+}